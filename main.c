@@ -1,17 +1,79 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <linux/mempolicy.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0))->Attribute
-
 #define COLUMN_USERNAME_SIZE 32
 #define COLUMN_EMAIL_SIZE 255
+#define COLUMN_NAME_MAX 15
+#define MAX_COLUMNS 8
+// space for a row in a cell. every schema's rows have to fit; the
+// default one (id int64, username varchar(32), email varchar(255)) fills it
+#define ROW_SIZE (8 + COLUMN_USERNAME_SIZE + 1 + COLUMN_EMAIL_SIZE + 1)
+// space for an encoded primary key in a cell
+#define KEY_SIZE 32
 #define TABLE_MAX_PAGES 100
+#define BACKUP_PAGES_PER_STEP 8
+#define WAL_SEGMENT_SIZE (256 * 1024)
+#define WAL_PATH_MAX 4096
+#define CDC_BATCH_SIZE (64 * 1024)
+#define CDC_MAX_CONSUMERS 16
+#define INPUT_READ_SIZE 4096
+#define LSM_MEMTABLE_MAX_ENTRIES 1024
+#define LSM_SKIPLIST_MAX_HEIGHT 12
+#define LSM_INDEX_INTERVAL 16
+#define LSM_BLOOM_BITS_PER_KEY 10
+#define LSM_BLOOM_HASHES 7
+#define LSM_L0_COMPACTION_TRIGGER 4
+#define LSM_L0_STOP_WRITES 8
+#define LSM_LEVEL_SIZE_RATIO 10
+#define LSM_MAX_LEVELS 7
+#define LSM_MAX_RUNS 64
+#define LSM_COMPACTION_ENTRIES_PER_STEP 512
+#define TABLE_NAME_MAX 32
+#define MAX_TABLES 64
+#define DEFAULT_TABLE_NAME "users"
+#define NODE_SEARCH_TREE_MIN_KEYS 16
+#define PAGER_SCAN_RING_PAGES 4
+#define HOT_KEY_CACHE_SLOTS 1024
+#define RESULT_CACHE_SLOTS 64
+#define RESULT_CACHE_MAX_ROWS 4096
+#define STATEMENT_TEXT_MAX 256
+#define PLAN_CACHE_SLOTS 32
+#define MAX_PREDICATES 4
+#define STATS_HISTOGRAM_BUCKETS 16
+#define COLUMN_SORT_KEY_MAX (2 * ROW_SIZE + 2)
+#define MAX_PARTITIONS 8
+#define JIT_HOT_EXECUTIONS 8
+#define JIT_CODE_MAX 256
+#define VM_MAX_INSTRUCTIONS (MAX_PARTITIONS * (2 * MAX_PREDICATES + 6) + 2)
+#define MAX_SHARDS 16
+#define NUMA_MAX_NODES 1024
+#define SHARD_PROMPT "db > "
 
 typedef enum
 {
@@ -25,894 +87,8880 @@ typedef enum
     PREPARE_SYNTAX_ERROR,
     PREPARE_NEGATIVE_ID,
     PREPARE_STRING_TOO_LONG,
+    PREPARE_ROW_TOO_WIDE,
+    PREPARE_KEY_TOO_WIDE,
+    PREPARE_NO_SUCH_TABLE,
     PREPARE_UNRECOGNIZED_STATEMENT
 } PrepareResult;
 
 typedef enum
 {
     STATEMENT_INSERT,
-    STATEMENT_SELECT
+    STATEMENT_SELECT,
+    STATEMENT_UPDATE,
+    STATEMENT_DELETE,
+    STATEMENT_CREATE_TABLE,
+    STATEMENT_DROP_TABLE,
+    STATEMENT_ANALYZE
 } StatementType;
 
 typedef enum
 {
     EXECUTE_SUCCESS,
     EXECUTE_DUPLICATE_KEY,
-    EXECUTE_TABLE_FULL
+    EXECUTE_TABLE_FULL,
+    EXECUTE_READ_ONLY,
+    EXECUTE_NO_SUCH_TABLE,
+    EXECUTE_TABLE_EXISTS,
+    EXECUTE_UNSUPPORTED,
+    EXECUTE_FORWARDED // a shard's answer has been printed as it was
 } ExecuteResult;
 
+typedef enum
+{
+    TABLE_ENGINE_BTREE,
+    TABLE_ENGINE_LSM
+} TableEngine;
+
+typedef enum
+{
+    COLUMN_INT32,
+    COLUMN_INT64,
+    COLUMN_DOUBLE,
+    COLUMN_VARCHAR,
+    COLUMN_BLOB
+} ColumnType;
+
+typedef struct
+{
+    char name[COLUMN_NAME_MAX + 1];
+    int type;
+    int length; // declared length of varchar and blob columns
+} ColumnDefinition;
+
+/**
+ * a table's columns as stored in the catalog. the primary key is the
+ * first column unless the table declares one
+ */
+typedef struct
+{
+    int num_columns;
+    ColumnDefinition columns[MAX_COLUMNS];
+    int num_key_columns;
+    int key_columns[MAX_COLUMNS];
+} Schema;
+
+typedef enum
+{
+    COMPARE_EQUAL,
+    COMPARE_NOT_EQUAL,
+    COMPARE_LESS,
+    COMPARE_LESS_EQUAL,
+    COMPARE_GREATER,
+    COMPARE_GREATER_EQUAL,
+    NUM_COMPARE_OPERATORS
+} CompareOperator;
+
+/**
+ * "column op value" of a where clause. the value is kept in the key
+ * encoding, zero padded, so it compares with memcmp whatever its type
+ */
 typedef struct
 {
-    ssize_t id;
-    char username[COLUMN_USERNAME_SIZE + 1];
-    char email[COLUMN_EMAIL_SIZE + 1];
-} Row;
+    int column;
+    CompareOperator op;
+    int length;
+    uint8_t value[COLUMN_SORT_KEY_MAX];
+} Predicate;
+
+/**
+ * whether a row passes every predicate of a statement
+ */
+typedef bool (*NativeFilter)(const void* row);
 
+/**
+ * a prepared statement, the logical plan the executor follows
+ */
 typedef struct
 {
     StatementType type;
-    Row row_to_insert; // Only used by insert statement
+    char text[STATEMENT_TEXT_MAX]; // normalized, empty if it is too long
+    bool explain; // print the access path instead of running it
+    char table_name[TABLE_NAME_MAX + 1]; // empty to analyze every table
+    TableEngine engine; // Only used by create table statement
+    Schema schema;      // Only used by create table statement
+    int num_partitions; // Only used by create table statement, 0 for none
+    // lower bound of each partition, the first is unused
+    uint8_t partition_bounds[MAX_PARTITIONS][KEY_SIZE];
+    uint8_t key[KEY_SIZE];        // Only used by insert statement
+    char row_to_insert[ROW_SIZE]; // insert, and the new values of update
+    int num_assignments;          // Only used by update statement
+    int assignments[MAX_COLUMNS]; // the columns update sets
+    int num_predicates;           // select, update and delete, all must hold
+    Predicate predicates[MAX_PREDICATES];
+    int num_projections; // Only used by select statement, 0 for every column
+    int projections[MAX_COLUMNS];
+    int order_column; // Only used by select statement, -1 for key order
+    bool order_descending;
+    int limit; // Only used by select statement, -1 for none
+    NativeFilter native_filter; // the predicates compiled, NULL if not
 } Statement;
 
+typedef struct
+{
+    int file_descriptor;
+    int num_pages;  // pages in the snapshot taken at .backup time
+    int next_page;  // next page visited by the sequential copy
+    int since_lsn;  // incremental backups skip pages not newer than this
+    int pages_copied;
+    bool copied[TABLE_MAX_PAGES];
+} Backup;
+
+/**
+ * write-ahead log: after-images of every page a statement modified,
+ * appended as one commit group to "<db>-wal.NNNNNN" segment files.
+ * a replica tails another database's segments with the same reader the
+ * primary uses for recovery.
+ * a checkpoint writes the cached pages back to the db file and records in
+ * "<db>-wal.checkpoint" the segment recovery starts from; the segments
+ * before it are removed once no replica is still reading them. each
+ * replica keeps the segment it reads in "<db>-wal.replica.<pid>"
+ */
+typedef struct
+{
+    char path[WAL_PATH_MAX]; // database whose segments are read/written
+    bool read_only;          // tailing a primary, never appends
+    int segment;             // current segment number
+    int file_descriptor;     // current segment, -1 if not open
+    off_t offset;            // append position, or read position on replica
+    int applied_lsn;         // newest LSN applied from the log
+    int checkpoint_lsn;      // every page up to it is in the db file
+    time_t last_applied;
+} Wal;
+
+typedef struct
+{
+    uint32_t checksum; // of the rest of the header and the page image
+    int lsn;
+    int page_num;
+    int flags;
+} WalRecordHeader;
+
+typedef struct
+{
+    int lsn;
+    int segment; // first segment recovery has to read
+} WalCheckpoint;
+
+#define WAL_RECORD_COMMIT 1
+
+/**
+ * copy of an internal node's keys in Eytzinger (breadth-first) order: the
+ * children of position i are 2i and 2i + 1, so a search walks forward
+ * through one array and the levels below can be prefetched while the
+ * current key is compared. built by the first search of a node, dropped
+ * when the node's keys change
+ */
+typedef struct
+{
+    int num_keys;
+    uint8_t* keys;     // position 0 is unused
+    int* sorted_index; // index on the page of the key at each position
+} NodeSearchTree;
+
+/**
+ * 2Q page replacement. a page read in starts on probation and is
+ * evicted first-in first-out from there, however often it is hit, so a
+ * scan cannot push hot pages out. a page read again soon after it was
+ * evicted from probation has proven itself and goes to the protected
+ * queue, which is evicted least recently used. pages a sequential cursor
+ * is done with are marked use once and recycled before anything else
+ */
+typedef enum
+{
+    PAGE_QUEUE_PROBATION,
+    PAGE_QUEUE_PROTECTED,
+    PAGE_QUEUE_USE_ONCE,
+    NUM_PAGE_QUEUES
+} PageQueue;
+
 typedef struct
 {
     int file_descriptor;
     int file_length;
     int num_pages;
+    int lsn; // last log sequence number stamped on a page
+    int max_cached_pages; // evicted down to at the end of each statement
+    int num_cached_pages;
+    // each queue is a list running oldest first through next_page
+    int queue_first[NUM_PAGE_QUEUES];
+    int queue_last[NUM_PAGE_QUEUES];
+    int queue_length[NUM_PAGE_QUEUES];
+    PageQueue queues[TABLE_MAX_PAGES];
+    int previous_page[TABLE_MAX_PAGES]; // in the page's queue, -1 at the ends
+    int next_page[TABLE_MAX_PAGES];
+    bool referenced[TABLE_MAX_PAGES]; // hit since it was last queued
+    int num_free_frames;
+    void* free_frames[TABLE_MAX_PAGES]; // buffers of evicted pages, for reuse
+    unsigned int evicted_at[TABLE_MAX_PAGES]; // 0 unless evicted from probation
+    unsigned int num_evictions;
+    int cache_hits;
+    int cache_misses;
+    Backup* backup;
+    Wal* wal;
+    bool dirty[TABLE_MAX_PAGES]; // modified by the running statement
+    int num_free_pages;
+    int free_pages[TABLE_MAX_PAGES]; // pages no table uses, found at open
+    NodeSearchTree* search_trees[TABLE_MAX_PAGES];
     void* pages[TABLE_MAX_PAGES];
 } Pager;
 
-const int ID_OFFSET = 0;
-const int ID_SIZE = size_of_attribute(Row, id);
-const int USERNAME_SIZE = size_of_attribute(Row, username);
-const int USERNAME_OFFSET = ID_OFFSET + ID_SIZE;
-const int EMAIL_SIZE = size_of_attribute(Row, email);
-const int EMAIL_OFFSET = USERNAME_OFFSET + USERNAME_SIZE;
-const int ROW_SIZE = ID_SIZE + USERNAME_SIZE + EMAIL_SIZE;
-
 const int PAGE_SIZE = 4096;
+const int WAL_RECORD_SIZE = sizeof(WalRecordHeader) + PAGE_SIZE;
 const int ROWS_PER_PAGE = PAGE_SIZE / ROW_SIZE;
 const int TABLE_MAX_ROWS = ROWS_PER_PAGE * TABLE_MAX_PAGES;
 
-void serialize_row(Row* source, void* destination)
+/**
+ * column codecs. a row is stored as its columns back to back at offsets
+ * fixed by the schema, so encoding a row is one parse per column straight
+ * into the cell image and reading it back needs no decoding at all
+ */
+typedef struct
 {
-    memcpy(destination + ID_OFFSET, &(source->id), ID_SIZE);
-    strncpy(destination + USERNAME_OFFSET, source->username, USERNAME_SIZE);
-    strncpy(destination + EMAIL_OFFSET, source->email, EMAIL_SIZE);
-}
+    const char* name;
+    bool sized; // declared with a length, e.g. varchar(32)
+    int size;   // bytes in the row, added to the declared length if sized
+    PrepareResult (*parse)(ColumnDefinition* column, const char* text,
+                           void* destination);
+    void (*print)(ColumnDefinition* column, void* source);
+    // key encoding, see key_compare. both return the key bytes used
+    int (*encode_key)(ColumnDefinition* column, void* source, uint8_t* key);
+    int (*decode_key)(ColumnDefinition* column, uint8_t* key,
+                      void* destination);
+} ColumnCodec;
 
-void deserialize_row(void* source, Row* destination)
+/**
+ * a schema compiled for encoding rows: where each column lives and which
+ * codec handles it
+ */
+typedef struct
+{
+    Schema schema;
+    int row_size;
+    int offsets[MAX_COLUMNS];
+    const ColumnCodec* codecs[MAX_COLUMNS];
+} RowFormat;
+
+PrepareResult parse_integer(const char* text, long long min, long long max,
+                            long long* value)
 {
-    memcpy(&(destination->id), source + ID_OFFSET, ID_SIZE);
-    memcpy(&(destination->username), source + USERNAME_OFFSET, USERNAME_SIZE);
-    memcpy(&(destination->email), source + EMAIL_OFFSET, EMAIL_SIZE);
+    char* end;
+    errno = 0;
+    *value = strtoll(text, &end, 10);
+    if(end == text || *end != '\0' || errno == ERANGE || *value < min ||
+       *value > max)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    return PREPARE_SUCCESS;
 }
 
-Pager* pager_open(const char* filename)
+PrepareResult int32_parse(ColumnDefinition* column, const char* text,
+                          void* destination)
 {
-    int fd = open(filename,
-                  O_RDWR |     // Read/Write mode
-                      O_CREAT, // Create file if it does not exist
-                  S_IWUSR |    // User write permission
-                      S_IRUSR  // User read permission
-    );
-
-    if(fd == -1)
+    (void)column;
+    long long value;
+    if(parse_integer(text, INT32_MIN, INT32_MAX, &value) != PREPARE_SUCCESS)
     {
-        printf("Unable to open file\n");
-        exit(EXIT_FAILURE);
+        return PREPARE_SYNTAX_ERROR;
     }
+    int32_t value32 = value;
+    memcpy(destination, &value32, sizeof(value32));
 
-    off_t file_length = lseek(fd, 0, SEEK_END);
+    return PREPARE_SUCCESS;
+}
 
-    Pager* pager = malloc(sizeof(Pager));
-    pager->file_descriptor = fd;
-    pager->file_length = file_length;
-    pager->num_pages = (file_length / PAGE_SIZE);
+void int32_print(ColumnDefinition* column, void* source)
+{
+    (void)column;
+    int32_t value;
+    memcpy(&value, source, sizeof(value));
+    printf("%d", value);
+}
 
-    if(file_length % PAGE_SIZE != 0)
-    {
-        printf("DB file is not a whole number of pages. Corrupt file\n");
-        exit(EXIT_FAILURE);
-    }
+/**
+ * big-endian with the sign bit flipped, so negative numbers sort first
+ */
+int int32_encode_key(ColumnDefinition* column, void* source, uint8_t* key)
+{
+    (void)column;
+    uint32_t value;
+    memcpy(&value, source, sizeof(value));
+    value = htobe32(value ^ 0x80000000u);
+    memcpy(key, &value, sizeof(value));
 
-    for(int i = 0; i < TABLE_MAX_PAGES; i++)
-    {
-        pager->pages[i] = NULL;
-    }
+    return sizeof(value);
+}
 
-    return pager;
+int int32_decode_key(ColumnDefinition* column, uint8_t* key,
+                     void* destination)
+{
+    (void)column;
+    uint32_t value;
+    memcpy(&value, key, sizeof(value));
+    value = be32toh(value) ^ 0x80000000u;
+    memcpy(destination, &value, sizeof(value));
+
+    return sizeof(value);
 }
 
-void* get_page(Pager* pager, int page_num)
+PrepareResult int64_parse(ColumnDefinition* column, const char* text,
+                          void* destination)
 {
-    if(page_num > TABLE_MAX_PAGES)
+    (void)column;
+    long long value;
+    if(parse_integer(text, INT64_MIN, INT64_MAX, &value) != PREPARE_SUCCESS)
     {
-        printf("Tried to fetch page number out of bounds: %d > %d\n", page_num,
-               TABLE_MAX_PAGES);
-        exit(EXIT_FAILURE);
+        return PREPARE_SYNTAX_ERROR;
     }
+    int64_t value64 = value;
+    memcpy(destination, &value64, sizeof(value64));
 
-    if(pager->pages[page_num] == NULL)
-    {
-        // Cache miss. Allocate memory and load from file.
-        void* page = malloc(PAGE_SIZE);
-
-        int num_pages = pager->file_length / PAGE_SIZE;
+    return PREPARE_SUCCESS;
+}
 
-        // We might save a partial page at the end of the file
-        if(pager->file_length % PAGE_SIZE)
-        {
-            num_pages += 1;
-        }
+void int64_print(ColumnDefinition* column, void* source)
+{
+    (void)column;
+    int64_t value;
+    memcpy(&value, source, sizeof(value));
+    printf("%lld", (long long)value);
+}
 
-        if(page_num <= num_pages)
-        {
-            lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
+int int64_encode_key(ColumnDefinition* column, void* source, uint8_t* key)
+{
+    (void)column;
+    uint64_t value;
+    memcpy(&value, source, sizeof(value));
+    value = htobe64(value ^ 0x8000000000000000u);
+    memcpy(key, &value, sizeof(value));
 
-            if(bytes_read == -1)
-            {
-                printf("Error reading file: %d\n", errno);
-                exit(EXIT_FAILURE);
-            }
-        }
+    return sizeof(value);
+}
 
-        pager->pages[page_num] = page;
-        if(page_num >= pager->num_pages)
-        {
-            pager->num_pages = page_num + 1;
-        }
-    }
+int int64_decode_key(ColumnDefinition* column, uint8_t* key,
+                     void* destination)
+{
+    (void)column;
+    uint64_t value;
+    memcpy(&value, key, sizeof(value));
+    value = be64toh(value) ^ 0x8000000000000000u;
+    memcpy(destination, &value, sizeof(value));
 
-    return pager->pages[page_num];
+    return sizeof(value);
 }
 
-void pager_flush(Pager* pager, int page_num)
+PrepareResult double_parse(ColumnDefinition* column, const char* text,
+                           void* destination)
 {
-    if(pager->pages[page_num] == NULL)
-    {
-        printf("Tried to flush null page\n");
-        exit(EXIT_FAILURE);
-    }
-
-    off_t offset =
-        lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-    if(offset == -1)
+    (void)column;
+    char* end;
+    double value = strtod(text, &end);
+    // nan compares unequal to itself and has no place in key order
+    if(end == text || *end != '\0' || isnan(value))
     {
-        printf("Error seeking: %d\n", errno);
-        exit(EXIT_FAILURE);
+        return PREPARE_SYNTAX_ERROR;
     }
+    memcpy(destination, &value, sizeof(value));
 
-    // TODO:
-    ssize_t bytes_written =
-        write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
-    if(bytes_written == -1)
-    {
-        printf("Error writing: %d\n", errno);
-        exit(EXIT_FAILURE);
-    }
+    return PREPARE_SUCCESS;
 }
 
-typedef enum
+void double_print(ColumnDefinition* column, void* source)
 {
-    NODE_INTERNAL,
-    NODE_LEAF
-} NodeType;
+    (void)column;
+    double value;
+    memcpy(&value, source, sizeof(value));
+    printf("%.15g", value);
+}
 
 /**
- * common node header layout
+ * positive doubles sort like their bits once the sign bit is set;
+ * negative ones have all bits inverted so that larger magnitudes sort first.
+ * -0.0 is encoded as 0.0, which it equals
  */
-const int NODE_TYPE_SIZE = sizeof(int);
-const int NODE_TYPE_OFFSET = 0;
-const int IS_ROOT_SIZE = sizeof(int);
-const int IS_ROOT_OFFSET = NODE_TYPE_SIZE;
-const int PARENT_POINTER_SIZE = sizeof(int);
-const int PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
-const int COMMON_NODE_HEADER_SIZE =
-    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE;
+int double_encode_key(ColumnDefinition* column, void* source, uint8_t* key)
+{
+    (void)column;
+    double value;
+    memcpy(&value, source, sizeof(value));
+    if(value == 0)
+    {
+        value = 0;
+    }
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = bits & 0x8000000000000000u ? ~bits : bits | 0x8000000000000000u;
+    bits = htobe64(bits);
+    memcpy(key, &bits, sizeof(bits));
 
-/**
- * leaf node header layout
- */
-const int LEAF_NODE_NUM_CELLS_SIZE = sizeof(int);
-const int LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const int LEAF_NODE_HEADER_SIZE =
-    COMMON_NODE_HEADER_SIZE + LEAF_NODE_NUM_CELLS_SIZE;
+    return sizeof(bits);
+}
+
+int double_decode_key(ColumnDefinition* column, uint8_t* key,
+                      void* destination)
+{
+    (void)column;
+    uint64_t bits;
+    memcpy(&bits, key, sizeof(bits));
+    bits = be64toh(bits);
+    bits = bits & 0x8000000000000000u ? bits & ~0x8000000000000000u : ~bits;
+    memcpy(destination, &bits, sizeof(bits));
+
+    return sizeof(bits);
+}
 
 /**
- * leaf node body layout
+ * varchar(n): n bytes plus a terminator, zero padded
  */
-const int LEAF_NODE_KEY_SIZE = sizeof(int);
-const int LEAF_NODE_KEY_OFFSET = 0;
-const int LEAF_NODE_VALUE_SIZE = ROW_SIZE;
-const int LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
-const int LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
-const int LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
-const int LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+PrepareResult varchar_parse(ColumnDefinition* column, const char* text,
+                            void* destination)
+{
+    size_t length = strlen(text);
+    if(length > (size_t)column->length)
+    {
+        return PREPARE_STRING_TOO_LONG;
+    }
+    memcpy(destination, text, length);
+    memset(destination + length, 0, column->length + 1 - length);
 
-const int LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
-const int LEAF_NODE_LEFT_SPLIT_COUNT =
-    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+    return PREPARE_SUCCESS;
+}
 
-/**
- * internal Node Header Layout
- */
-const int INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(int);
-const int INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
-const int INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(int);
-const int INTERNAL_NODE_RIGHT_CHILD_OFFSET =
-    INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
-const int INTERNAL_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
-                                      INTERNAL_NODE_NUM_KEYS_SIZE +
-                                      INTERNAL_NODE_RIGHT_CHILD_SIZE;
+void varchar_print(ColumnDefinition* column, void* source)
+{
+    printf("%.*s", column->length, (char*)source);
+}
 
 /**
- * internal Node Body Layout
+ * the string and its terminator: a prefix sorts before longer strings
  */
-const int INTERNAL_NODE_KEY_SIZE = sizeof(int);
-const int INTERNAL_NODE_CHILD_SIZE = sizeof(int);
-const int INTERNAL_NODE_CELL_SIZE =
-    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
-
-void* leaf_node_cell(void* node, int cell_num)
+int varchar_encode_key(ColumnDefinition* column, void* source, uint8_t* key)
 {
-    return node + LEAF_NODE_HEADER_SIZE + cell_num + LEAF_NODE_CELL_SIZE;
+    int length = strnlen(source, column->length);
+    memcpy(key, source, length);
+    key[length] = 0;
+
+    return length + 1;
 }
 
-int* leaf_node_num_cells(void* node)
+int varchar_decode_key(ColumnDefinition* column, uint8_t* key,
+                       void* destination)
 {
-    return node + LEAF_NODE_NUM_CELLS_OFFSET;
+    int length = strnlen((char*)key, column->length);
+    memset(destination, 0, column->length + 1);
+    memcpy(destination, key, length);
+
+    return length + 1;
 }
 
-int* leaf_node_key(void* node, int cell_num)
+/**
+ * blob(n): a 4 byte length, then up to n bytes. written as hex digits
+ */
+PrepareResult blob_parse(ColumnDefinition* column, const char* text,
+                         void* destination)
 {
-    return leaf_node_cell(node, cell_num);
+    size_t digits = strlen(text);
+    if(digits % 2 != 0)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    if(digits / 2 > (size_t)column->length)
+    {
+        return PREPARE_STRING_TOO_LONG;
+    }
+
+    int32_t length = digits / 2;
+    uint8_t* bytes = destination + sizeof(int32_t);
+    memcpy(destination, &length, sizeof(length));
+    memset(bytes, 0, column->length);
+    for(int i = 0; i < length; i++)
+    {
+        unsigned int byte;
+        if(!isxdigit((unsigned char)text[2 * i]) ||
+           !isxdigit((unsigned char)text[2 * i + 1]) ||
+           sscanf(text + 2 * i, "%2x", &byte) != 1)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        bytes[i] = byte;
+    }
+
+    return PREPARE_SUCCESS;
 }
 
-void* leaf_node_value(void* node, int cell_num)
+void blob_print(ColumnDefinition* column, void* source)
 {
-    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+    (void)column;
+    int32_t length;
+    memcpy(&length, source, sizeof(length));
+    uint8_t* bytes = source + sizeof(int32_t);
+    for(int i = 0; i < length; i++)
+    {
+        printf("%02x", bytes[i]);
+    }
 }
 
-void set_node_type(void* node, NodeType type)
+/**
+ * zero bytes are escaped as 00 ff and the blob ends with 00 01, which
+ * sorts below any escaped or regular byte
+ */
+int blob_encode_key(ColumnDefinition* column, void* source, uint8_t* key)
 {
-    int value = type;
+    (void)column;
+    int32_t length;
+    memcpy(&length, source, sizeof(length));
+    uint8_t* bytes = source + sizeof(int32_t);
 
-    *((int*)(node + NODE_TYPE_OFFSET)) = value;
+    int key_length = 0;
+    for(int i = 0; i < length; i++)
+    {
+        key[key_length++] = bytes[i];
+        if(bytes[i] == 0)
+        {
+            key[key_length++] = 0xff;
+        }
+    }
+    key[key_length++] = 0;
+    key[key_length++] = 1;
+
+    return key_length;
 }
 
-NodeType get_node_type(void* node)
+int blob_decode_key(ColumnDefinition* column, uint8_t* key,
+                    void* destination)
 {
-    int value = *((int*)(node + NODE_TYPE_OFFSET));
+    uint8_t* bytes = destination + sizeof(int32_t);
+    int32_t length = 0;
+    int key_length = 0;
 
-    return (NodeType)value;
+    memset(destination, 0, sizeof(int32_t) + column->length);
+    while(!(key[key_length] == 0 && key[key_length + 1] == 1))
+    {
+        bytes[length++] = key[key_length];
+        key_length += key[key_length] == 0 ? 2 : 1;
+    }
+    memcpy(destination, &length, sizeof(length));
+
+    return key_length + 2;
 }
 
-void print_constants()
+const ColumnCodec COLUMN_CODECS[] = {
+    [COLUMN_INT32] = {"int32", false, 4, int32_parse, int32_print,
+                      int32_encode_key, int32_decode_key},
+    [COLUMN_INT64] = {"int64", false, 8, int64_parse, int64_print,
+                      int64_encode_key, int64_decode_key},
+    [COLUMN_DOUBLE] = {"double", false, 8, double_parse, double_print,
+                       double_encode_key, double_decode_key},
+    [COLUMN_VARCHAR] = {"varchar", true, 1, varchar_parse, varchar_print,
+                        varchar_encode_key, varchar_decode_key},
+    [COLUMN_BLOB] = {"blob", true, 4, blob_parse, blob_print,
+                     blob_encode_key, blob_decode_key},
+};
+const int NUM_COLUMN_TYPES = sizeof(COLUMN_CODECS) / sizeof(ColumnCodec);
+
+/**
+ * the schema of the "users" table, and of tables created without columns
+ */
+void schema_default(Schema* schema)
 {
-    printf("ROW_SIZE: %d\n", ROW_SIZE);
-    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
-    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
-    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
-    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+    memset(schema, 0, sizeof(Schema));
+    schema->num_columns = 3;
+    schema->columns[0] = (ColumnDefinition){"id", COLUMN_INT64, 0};
+    schema->columns[1] =
+        (ColumnDefinition){"username", COLUMN_VARCHAR, COLUMN_USERNAME_SIZE};
+    schema->columns[2] =
+        (ColumnDefinition){"email", COLUMN_VARCHAR, COLUMN_EMAIL_SIZE};
+    schema->num_key_columns = 1;
+    schema->key_columns[0] = 0;
 }
 
-int* internal_node_num_keys(void* node)
+/**
+ * longest encoding of a column's values as part of a key
+ */
+int column_max_key_size(ColumnDefinition* column)
 {
-    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+    switch(column->type)
+    {
+    case(COLUMN_VARCHAR):
+        return column->length + 1;
+    case(COLUMN_BLOB):
+        return 2 * column->length + 2;
+    default:
+        return COLUMN_CODECS[column->type].size;
+    }
 }
 
-int* internal_node_right_child(void* node)
+void row_format_compile(RowFormat* format, Schema* schema)
 {
-    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+    format->schema = *schema;
+    format->row_size = 0;
+    for(int i = 0; i < schema->num_columns; i++)
+    {
+        const ColumnCodec* codec = &COLUMN_CODECS[schema->columns[i].type];
+        format->codecs[i] = codec;
+        format->offsets[i] = format->row_size;
+        format->row_size +=
+            codec->sized ? schema->columns[i].length + codec->size
+                         : codec->size;
+    }
 }
 
-int* internal_node_cell(void* node, int cell_num)
+/**
+ * keys are compared as bytes. each key column is encoded so that byte
+ * order is the column's order, and the columns of a composite key follow
+ * each other. the rest of the KEY_SIZE bytes stay zero
+ */
+uint64_t key_prefix(const void* key)
 {
-    return node + INTERNAL_NODE_HEADER_SIZE +
-           cell_num * INTERNAL_NODE_CELL_SIZE;
+    uint64_t prefix;
+    memcpy(&prefix, key, sizeof(prefix));
+    return be64toh(prefix);
 }
 
-int* internal_node_child(void* node, int child_num)
+int key_compare(const void* a, const void* b)
 {
-    int num_keys = *internal_node_num_keys(node);
-    if(child_num > num_keys)
+    // most keys differ in their first 8 bytes, compare those as one
+    // big-endian word before falling back to memcmp
+    uint64_t prefix_a = key_prefix(a);
+    uint64_t prefix_b = key_prefix(b);
+    if(prefix_a != prefix_b)
     {
-        printf("Tried to access child_num %d > num_keys %d\n", child_num,
-               num_keys);
+        return prefix_a < prefix_b ? -1 : 1;
+    }
+
+    return memcmp(a + sizeof(prefix_a), b + sizeof(prefix_b),
+                  KEY_SIZE - sizeof(prefix_a));
+}
+
+/**
+ * index of the first of num_keys sorted keys, stride bytes apart, that is
+ * >= key. the position is guessed from the 8-byte prefixes as if the keys
+ * were evenly spread, then corrected by galloping away from the guess and
+ * a binary search of the bracket found. nearly sequential ids land on or
+ * next to the guess
+ */
+int key_lower_bound(const uint8_t* keys, int stride, int num_keys,
+                    const void* key)
+{
+    if(num_keys == 0)
+    {
+        return 0;
+    }
+
+    uint64_t low = key_prefix(keys);
+    uint64_t high = key_prefix(keys + (num_keys - 1) * stride);
+    uint64_t target = key_prefix(key);
+    int guess = 0;
+    if(target >= high)
+    {
+        guess = num_keys - 1;
+    }
+    else if(target > low)
+    {
+        guess = (unsigned __int128)(target - low) * (num_keys - 1) /
+                (high - low);
+    }
+
+    int min_index;
+    int one_past_max_index;
+    int step = 1;
+    if(key_compare(keys + guess * stride, key) < 0)
+    {
+        min_index = guess + 1;
+        int probe = guess + step;
+        while(probe < num_keys && key_compare(keys + probe * stride, key) < 0)
+        {
+            min_index = probe + 1;
+            step *= 2;
+            probe = guess + step;
+        }
+        one_past_max_index = probe < num_keys ? probe : num_keys;
+    }
+    else
+    {
+        one_past_max_index = guess;
+        int probe = guess - step;
+        while(probe >= 0 && key_compare(keys + probe * stride, key) >= 0)
+        {
+            one_past_max_index = probe;
+            step *= 2;
+            probe = guess - step;
+        }
+        min_index = probe >= 0 ? probe + 1 : 0;
+    }
+
+    while(min_index != one_past_max_index)
+    {
+        int index = (min_index + one_past_max_index) / 2;
+        if(key_compare(keys + index * stride, key) < 0)
+        {
+            min_index = index + 1;
+        }
+        else
+        {
+            one_past_max_index = index;
+        }
+    }
+
+    return min_index;
+}
+
+/**
+ * the primary key of an encoded row
+ */
+void row_key(RowFormat* format, void* row, uint8_t* key)
+{
+    Schema* schema = &format->schema;
+    int length = 0;
+
+    memset(key, 0, KEY_SIZE);
+    for(int i = 0; i < schema->num_key_columns; i++)
+    {
+        int column = schema->key_columns[i];
+        length += format->codecs[column]->encode_key(
+            &schema->columns[column], row + format->offsets[column],
+            key + length);
+    }
+}
+
+/**
+ * print the key of a row in hex, which sorts like the key itself. a shard
+ * puts it before each row it selects, for the router to merge on
+ */
+void row_print_key(RowFormat* format, void* row)
+{
+    uint8_t key[KEY_SIZE];
+    row_key(format, row, key);
+    for(int i = 0; i < KEY_SIZE; i++)
+    {
+        printf("%02x", key[i]);
+    }
+    printf(" ");
+}
+
+/**
+ * print a key as its column values, "3" or "(abc, 3)"
+ */
+void key_print(RowFormat* format, uint8_t* key)
+{
+    Schema* schema = &format->schema;
+    char value[ROW_SIZE];
+    int length = 0;
+
+    if(schema->num_key_columns > 1)
+    {
+        printf("(");
+    }
+    for(int i = 0; i < schema->num_key_columns; i++)
+    {
+        ColumnDefinition* column = &schema->columns[schema->key_columns[i]];
+        const ColumnCodec* codec = format->codecs[schema->key_columns[i]];
+        if(i > 0)
+        {
+            printf(", ");
+        }
+        length += codec->decode_key(column, key + length, value);
+        codec->print(column, value);
+    }
+    if(schema->num_key_columns > 1)
+    {
+        printf(")");
+    }
+}
+
+/**
+ * key of a single int32 column, as used by the catalog for table ids
+ */
+void key_from_int(int value, uint8_t* key)
+{
+    memset(key, 0, KEY_SIZE);
+    int32_encode_key(NULL, &value, key);
+}
+
+int key_to_int(uint8_t* key)
+{
+    int value;
+    int32_decode_key(NULL, key, &value);
+
+    return value;
+}
+
+/**
+ * print the given columns of a row, every column if num_columns is 0
+ */
+void row_print_projection(RowFormat* format, void* row, int num_columns,
+                          int* columns)
+{
+    printf("(");
+    for(int i = 0;
+        i < (num_columns > 0 ? num_columns : format->schema.num_columns); i++)
+    {
+        int column = num_columns > 0 ? columns[i] : i;
+        if(i > 0)
+        {
+            printf(", ");
+        }
+        format->codecs[column]->print(&format->schema.columns[column],
+                                      row + format->offsets[column]);
+    }
+    printf(")\n");
+}
+
+void row_print(RowFormat* format, void* row)
+{
+    row_print_projection(format, row, 0, NULL);
+}
+
+int row_column_size(RowFormat* format, int column)
+{
+    int end = column + 1 < format->schema.num_columns
+                  ? format->offsets[column + 1]
+                  : format->row_size;
+
+    return end - format->offsets[column];
+}
+
+/**
+ * a column value in the key encoding, zero padded to COLUMN_SORT_KEY_MAX
+ * bytes, so that two of them compare with memcmp. returns the bytes used
+ */
+int column_sort_key(ColumnDefinition* column, void* value, uint8_t* key)
+{
+    memset(key, 0, COLUMN_SORT_KEY_MAX);
+    return COLUMN_CODECS[column->type].encode_key(column, value, key);
+}
+
+Pager* pager_open(const char* filename)
+{
+    int fd = open(filename,
+                  O_RDWR |     // Read/Write mode
+                      O_CREAT, // Create file if it does not exist
+                  S_IWUSR |    // User write permission
+                      S_IRUSR  // User read permission
+    );
+
+    if(fd == -1)
+    {
+        printf("Unable to open file\n");
         exit(EXIT_FAILURE);
     }
-    else if(child_num == num_keys)
+
+    off_t file_length = lseek(fd, 0, SEEK_END);
+
+    Pager* pager = malloc(sizeof(Pager));
+    pager->file_descriptor = fd;
+    pager->file_length = file_length;
+    pager->num_pages = (file_length / PAGE_SIZE);
+    pager->lsn = 0;
+    pager->backup = NULL;
+    pager->wal = NULL;
+    pager->num_free_pages = 0;
+    pager->max_cached_pages = TABLE_MAX_PAGES;
+    pager->num_cached_pages = 0;
+    pager->num_free_frames = 0;
+    for(int queue = 0; queue < NUM_PAGE_QUEUES; queue++)
     {
-        return internal_node_right_child(node);
+        pager->queue_first[queue] = -1;
+        pager->queue_last[queue] = -1;
+        pager->queue_length[queue] = 0;
+    }
+    pager->num_evictions = 0;
+    pager->cache_hits = 0;
+    pager->cache_misses = 0;
+
+    if(file_length % PAGE_SIZE != 0)
+    {
+        printf("DB file is not a whole number of pages. Corrupt file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(int i = 0; i < TABLE_MAX_PAGES; i++)
+    {
+        pager->pages[i] = NULL;
+        pager->dirty[i] = false;
+        pager->search_trees[i] = NULL;
+        pager->evicted_at[i] = 0;
+    }
+
+    return pager;
+}
+
+void node_search_tree_drop(Pager* pager, int page_num)
+{
+    NodeSearchTree* tree = pager->search_trees[page_num];
+    if(tree != NULL)
+    {
+        free(tree->keys);
+        free(tree->sorted_index);
+        free(tree);
+        pager->search_trees[page_num] = NULL;
+    }
+}
+
+void page_queue_remove(Pager* pager, int page_num)
+{
+    PageQueue queue = pager->queues[page_num];
+    int previous = pager->previous_page[page_num];
+    int next = pager->next_page[page_num];
+
+    if(previous == -1)
+    {
+        pager->queue_first[queue] = next;
     }
     else
     {
-        return internal_node_cell(node, child_num);
+        pager->next_page[previous] = next;
+    }
+    if(next == -1)
+    {
+        pager->queue_last[queue] = previous;
+    }
+    else
+    {
+        pager->previous_page[next] = previous;
+    }
+    pager->queue_length[queue]--;
+}
+
+/**
+ * add page_num to queue as its newest page
+ */
+void page_queue_append(Pager* pager, int page_num, PageQueue queue)
+{
+    int last = pager->queue_last[queue];
+
+    pager->queues[page_num] = queue;
+    pager->previous_page[page_num] = last;
+    pager->next_page[page_num] = -1;
+    if(last == -1)
+    {
+        pager->queue_first[queue] = page_num;
+    }
+    else
+    {
+        pager->next_page[last] = page_num;
+    }
+    pager->queue_last[queue] = page_num;
+    pager->queue_length[queue]++;
+}
+
+/**
+ * read page_num into a frame. evicted pages leave their buffers behind,
+ * so a cache that is full takes no allocation to miss
+ */
+void* get_page_miss(Pager* pager, int page_num)
+{
+    if(page_num >= TABLE_MAX_PAGES)
+    {
+        printf("Tried to fetch page number out of bounds: %d > %d\n", page_num,
+               TABLE_MAX_PAGES);
+        exit(EXIT_FAILURE);
+    }
+
+    // Cache miss. Take a frame and load from file.
+    // pages past the end of the file read as zeroes (LSN 0)
+    void* page;
+    if(pager->num_free_frames > 0)
+    {
+        page = pager->free_frames[--pager->num_free_frames];
+        memset(page, 0, PAGE_SIZE);
+    }
+    else
+    {
+        page = calloc(1, PAGE_SIZE);
+    }
+
+    int num_pages = pager->file_length / PAGE_SIZE;
+
+    // We might save a partial page at the end of the file
+    if(pager->file_length % PAGE_SIZE)
+    {
+        num_pages += 1;
+    }
+
+    if(page_num <= num_pages)
+    {
+        lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+        ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
+
+        if(bytes_read == -1)
+        {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pager->pages[page_num] = page;
+    if(page_num >= pager->num_pages)
+    {
+        pager->num_pages = page_num + 1;
+    }
+
+    // a page evicted from probation that is wanted again soon after
+    // is hot
+    unsigned int evicted_at = pager->evicted_at[page_num];
+    page_queue_append(pager, page_num,
+                      evicted_at != 0 &&
+                              pager->num_evictions - evicted_at <
+                                  (unsigned int)pager->max_cached_pages / 2
+                          ? PAGE_QUEUE_PROTECTED
+                          : PAGE_QUEUE_PROBATION);
+    pager->evicted_at[page_num] = 0;
+    pager->referenced[page_num] = false;
+    pager->num_cached_pages++;
+    pager->cache_misses++;
+    return page;
+}
+
+/**
+ * a hit only marks the page referenced and leaves the queues alone. the
+ * queues are put in order when the cache is trimmed
+ */
+void* get_page(Pager* pager, int page_num)
+{
+    void* page = page_num < TABLE_MAX_PAGES ? pager->pages[page_num] : NULL;
+    if(page == NULL)
+    {
+        return get_page_miss(pager, page_num);
+    }
+
+    pager->referenced[page_num] = true;
+    pager->cache_hits++;
+    return page;
+}
+
+/**
+ * a sequential cursor is done with page. unless the page is hot it is
+ * recycled first
+ */
+void pager_use_once(Pager* pager, int page_num)
+{
+    if(pager->queues[page_num] == PAGE_QUEUE_PROBATION)
+    {
+        page_queue_remove(pager, page_num);
+        page_queue_append(pager, page_num, PAGE_QUEUE_USE_ONCE);
+    }
+}
+
+void pager_flush(Pager* pager, int page_num)
+{
+    if(pager->pages[page_num] == NULL)
+    {
+        printf("Tried to flush null page\n");
+        exit(EXIT_FAILURE);
+    }
+
+    off_t offset =
+        lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
+    if(offset == -1)
+    {
+        printf("Error seeking: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    // TODO:
+    ssize_t bytes_written =
+        write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+    if(bytes_written == -1)
+    {
+        printf("Error writing: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    if(offset + PAGE_SIZE > pager->file_length)
+    {
+        pager->file_length = offset + PAGE_SIZE;
+    }
+}
+
+/**
+ * the page to evict next from queue, -1 if there is none.
+ * protected pages hit since they were queued get another round at the
+ * back instead. pages the running statement modified cannot go before
+ * they are logged
+ */
+int page_queue_victim(Pager* pager, PageQueue queue)
+{
+    int page_num = pager->queue_first[queue];
+    while(page_num != -1)
+    {
+        int next = pager->next_page[page_num];
+        if(queue == PAGE_QUEUE_PROTECTED && pager->referenced[page_num])
+        {
+            pager->referenced[page_num] = false;
+            page_queue_remove(pager, page_num);
+            page_queue_append(pager, page_num, queue);
+        }
+        else if(!pager->dirty[page_num])
+        {
+            return page_num;
+        }
+        page_num = next;
+    }
+
+    return -1;
+}
+
+void pager_evict(Pager* pager, int page_num)
+{
+    pager_flush(pager, page_num);
+    pager->free_frames[pager->num_free_frames++] = pager->pages[page_num];
+    pager->pages[page_num] = NULL;
+    node_search_tree_drop(pager, page_num);
+
+    page_queue_remove(pager, page_num);
+    pager->num_cached_pages--;
+    pager->num_evictions++;
+    if(pager->queues[page_num] == PAGE_QUEUE_PROBATION)
+    {
+        pager->evicted_at[page_num] = pager->num_evictions;
+    }
+}
+
+/**
+ * evict down to max_cached_pages. this only runs between statements, when
+ * no page pointers are held, so pages need no pinning
+ */
+void pager_trim(Pager* pager)
+{
+    if(pager->max_cached_pages >= TABLE_MAX_PAGES)
+    {
+        return;
+    }
+
+    // scans keep a small ring of pages whatever the room
+    while(pager->queue_length[PAGE_QUEUE_USE_ONCE] > PAGER_SCAN_RING_PAGES ||
+          pager->num_cached_pages > pager->max_cached_pages)
+    {
+        int victim = page_queue_victim(pager, PAGE_QUEUE_USE_ONCE);
+        if(pager->num_cached_pages <= pager->max_cached_pages)
+        {
+            if(victim == -1)
+            {
+                return;
+            }
+        }
+        else if(victim == -1)
+        {
+            if(pager->queue_length[PAGE_QUEUE_PROBATION] >
+               pager->max_cached_pages / 4)
+            {
+                victim = page_queue_victim(pager, PAGE_QUEUE_PROBATION);
+            }
+            if(victim == -1)
+            {
+                victim = page_queue_victim(pager, PAGE_QUEUE_PROTECTED);
+            }
+            if(victim == -1)
+            {
+                victim = page_queue_victim(pager, PAGE_QUEUE_PROBATION);
+            }
+            if(victim == -1)
+            {
+                return;
+            }
+        }
+        pager_evict(pager, victim);
+    }
+}
+
+typedef enum
+{
+    NODE_INTERNAL,
+    NODE_LEAF
+} NodeType;
+
+/**
+ * common node header layout
+ */
+const int NODE_TYPE_SIZE = sizeof(int);
+const int NODE_TYPE_OFFSET = 0;
+const int IS_ROOT_SIZE = sizeof(int);
+const int IS_ROOT_OFFSET = NODE_TYPE_SIZE;
+const int PARENT_POINTER_SIZE = sizeof(int);
+const int PARENT_POINTER_OFFSET = IS_ROOT_OFFSET + IS_ROOT_SIZE;
+const int PAGE_LSN_SIZE = sizeof(int);
+const int PAGE_LSN_OFFSET = PARENT_POINTER_OFFSET + PARENT_POINTER_SIZE;
+const int COMMON_NODE_HEADER_SIZE =
+    NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE + PAGE_LSN_SIZE;
+
+/**
+ * leaf node header layout
+ */
+const int LEAF_NODE_NUM_CELLS_SIZE = sizeof(int);
+const int LEAF_NODE_NUM_CELLS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const int LEAF_NODE_NEXT_LEAF_SIZE = sizeof(int);
+const int LEAF_NODE_NEXT_LEAF_OFFSET =
+    LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE;
+const int LEAF_NODE_HEADER_SIZE = COMMON_NODE_HEADER_SIZE +
+                                  LEAF_NODE_NUM_CELLS_SIZE +
+                                  LEAF_NODE_NEXT_LEAF_SIZE;
+
+/**
+ * leaf node body layout
+ */
+const int LEAF_NODE_KEY_SIZE = KEY_SIZE;
+const int LEAF_NODE_KEY_OFFSET = 0;
+const int LEAF_NODE_VALUE_SIZE = ROW_SIZE;
+const int LEAF_NODE_VALUE_OFFSET = LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE;
+const int LEAF_NODE_CELL_SIZE = LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE;
+const int LEAF_NODE_SPACE_FOR_CELLS = PAGE_SIZE - LEAF_NODE_HEADER_SIZE;
+const int LEAF_NODE_MAX_CELLS = LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;
+
+const int LEAF_NODE_RIGHT_SPLIT_COUNT = (LEAF_NODE_MAX_CELLS + 1) / 2;
+const int LEAF_NODE_LEFT_SPLIT_COUNT =
+    (LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT;
+
+/**
+ * internal Node Header Layout
+ */
+const int INTERNAL_NODE_NUM_KEYS_SIZE = sizeof(int);
+const int INTERNAL_NODE_NUM_KEYS_OFFSET = COMMON_NODE_HEADER_SIZE;
+const int INTERNAL_NODE_RIGHT_CHILD_SIZE = sizeof(int);
+const int INTERNAL_NODE_RIGHT_CHILD_OFFSET =
+    INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE;
+const int INTERNAL_NODE_NUM_MESSAGES_SIZE = sizeof(int);
+const int INTERNAL_NODE_NUM_MESSAGES_OFFSET =
+    INTERNAL_NODE_RIGHT_CHILD_OFFSET + INTERNAL_NODE_RIGHT_CHILD_SIZE;
+const int INTERNAL_NODE_HEADER_SIZE =
+    COMMON_NODE_HEADER_SIZE + INTERNAL_NODE_NUM_KEYS_SIZE +
+    INTERNAL_NODE_RIGHT_CHILD_SIZE + INTERNAL_NODE_NUM_MESSAGES_SIZE;
+
+/**
+ * internal node message buffer layout (B-epsilon tree)
+ * the second half of every internal node queues rows on their way down
+ * to its subtree
+ */
+const int MESSAGE_KEY_SIZE = KEY_SIZE;
+const int MESSAGE_KEY_OFFSET = 0;
+const int MESSAGE_VALUE_OFFSET = MESSAGE_KEY_OFFSET + MESSAGE_KEY_SIZE;
+const int MESSAGE_SIZE = MESSAGE_KEY_SIZE + ROW_SIZE;
+const int INTERNAL_NODE_MAX_MESSAGES = (PAGE_SIZE / 2) / MESSAGE_SIZE;
+const int INTERNAL_NODE_BUFFER_SIZE = INTERNAL_NODE_MAX_MESSAGES * MESSAGE_SIZE;
+const int INTERNAL_NODE_BUFFER_OFFSET = PAGE_SIZE - INTERNAL_NODE_BUFFER_SIZE;
+
+/**
+ * internal Node Body Layout
+ */
+const int INTERNAL_NODE_KEY_SIZE = KEY_SIZE;
+const int INTERNAL_NODE_CHILD_SIZE = sizeof(int);
+const int INTERNAL_NODE_CELL_SIZE =
+    INTERNAL_NODE_CHILD_SIZE + INTERNAL_NODE_KEY_SIZE;
+const int INTERNAL_NODE_SPACE_FOR_CELLS =
+    INTERNAL_NODE_BUFFER_OFFSET - INTERNAL_NODE_HEADER_SIZE;
+const int INTERNAL_NODE_MAX_CELLS =
+    INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE;
+
+void* leaf_node_cell(void* node, int cell_num)
+{
+    return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+}
+
+int* leaf_node_num_cells(void* node)
+{
+    return node + LEAF_NODE_NUM_CELLS_OFFSET;
+}
+
+/**
+ * page number of the leaf to the right, 0 for the rightmost leaf
+ */
+int* leaf_node_next_leaf(void* node)
+{
+    return node + LEAF_NODE_NEXT_LEAF_OFFSET;
+}
+
+void* leaf_node_key(void* node, int cell_num)
+{
+    return leaf_node_cell(node, cell_num);
+}
+
+void* leaf_node_value(void* node, int cell_num)
+{
+    return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_SIZE;
+}
+
+void set_node_type(void* node, NodeType type)
+{
+    int value = type;
+
+    *((int*)(node + NODE_TYPE_OFFSET)) = value;
+}
+
+NodeType get_node_type(void* node)
+{
+    int value = *((int*)(node + NODE_TYPE_OFFSET));
+
+    return (NodeType)value;
+}
+
+void print_constants()
+{
+    printf("ROW_SIZE: %d\n", ROW_SIZE);
+    printf("COMMON_NODE_HEADER_SIZE: %d\n", COMMON_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_HEADER_SIZE: %d\n", LEAF_NODE_HEADER_SIZE);
+    printf("LEAF_NODE_CELL_SIZE: %d\n", LEAF_NODE_CELL_SIZE);
+    printf("LEAF_NODE_SPACE_FOR_CELLS: %d\n", LEAF_NODE_SPACE_FOR_CELLS);
+    printf("LEAF_NODE_MAX_CELLS: %d\n", LEAF_NODE_MAX_CELLS);
+    printf("INTERNAL_NODE_HEADER_SIZE: %d\n", INTERNAL_NODE_HEADER_SIZE);
+    printf("INTERNAL_NODE_MAX_CELLS: %d\n", INTERNAL_NODE_MAX_CELLS);
+    printf("INTERNAL_NODE_MAX_MESSAGES: %d\n", INTERNAL_NODE_MAX_MESSAGES);
+}
+
+int* internal_node_num_keys(void* node)
+{
+    return node + INTERNAL_NODE_NUM_KEYS_OFFSET;
+}
+
+int* internal_node_right_child(void* node)
+{
+    return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
+}
+
+int* internal_node_cell(void* node, int cell_num)
+{
+    return node + INTERNAL_NODE_HEADER_SIZE +
+           cell_num * INTERNAL_NODE_CELL_SIZE;
+}
+
+int* internal_node_child(void* node, int child_num)
+{
+    int num_keys = *internal_node_num_keys(node);
+    if(child_num > num_keys)
+    {
+        printf("Tried to access child_num %d > num_keys %d\n", child_num,
+               num_keys);
+        exit(EXIT_FAILURE);
+    }
+    else if(child_num == num_keys)
+    {
+        return internal_node_right_child(node);
+    }
+    else
+    {
+        return internal_node_cell(node, child_num);
+    }
+}
+
+void* internal_node_key(void* node, int key_num)
+{
+    return (void*)internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+}
+
+int* internal_node_num_messages(void* node)
+{
+    return node + INTERNAL_NODE_NUM_MESSAGES_OFFSET;
+}
+
+void* internal_node_message(void* node, int message_num)
+{
+    return node + INTERNAL_NODE_BUFFER_OFFSET + message_num * MESSAGE_SIZE;
+}
+
+void* message_key(void* message)
+{
+    return message + MESSAGE_KEY_OFFSET;
+}
+
+void* message_value(void* message)
+{
+    return message + MESSAGE_VALUE_OFFSET;
+}
+
+int* node_parent(void* node)
+{
+    return node + PARENT_POINTER_OFFSET;
+}
+
+/**
+ * keys in an internal node are the max key of the child to their left,
+ * so the max of a subtree is found down its rightmost path
+ */
+void* get_node_max_key(Pager* pager, void* node)
+{
+    if(get_node_type(node) == NODE_LEAF)
+    {
+        return leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+    }
+
+    void* right_child = get_page(pager, *internal_node_right_child(node));
+    return get_node_max_key(pager, right_child);
+}
+
+bool is_node_root(void* node)
+{
+    int value = *((int*)(node + IS_ROOT_OFFSET));
+    return (bool)value;
+}
+
+void set_node_root(void* node, bool is_root)
+{
+    int value = is_root;
+    *((int*)(node + IS_ROOT_OFFSET)) = value;
+}
+
+int* page_lsn(void* node)
+{
+    return node + PAGE_LSN_OFFSET;
+}
+
+/**
+ * highest page LSN stored in an open file, read straight from the page
+ * headers so nothing is pulled into the cache
+ */
+int file_max_lsn(int fd)
+{
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    int max_lsn = 0;
+
+    for(off_t offset = 0; offset < file_length; offset += PAGE_SIZE)
+    {
+        int lsn;
+        if(pread(fd, &lsn, PAGE_LSN_SIZE, offset + PAGE_LSN_OFFSET) !=
+           PAGE_LSN_SIZE)
+        {
+            printf("Error reading file: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if(lsn > max_lsn)
+        {
+            max_lsn = lsn;
+        }
+    }
+
+    return max_lsn;
+}
+
+void backup_copy_page(Pager* pager, Backup* backup, int page_num)
+{
+    void* page = get_page(pager, page_num);
+
+    backup->copied[page_num] = true;
+    if(*page_lsn(page) <= backup->since_lsn)
+    {
+        return;
+    }
+
+    ssize_t bytes_written = pwrite(backup->file_descriptor, page, PAGE_SIZE,
+                                   (off_t)page_num * PAGE_SIZE);
+    if(bytes_written != PAGE_SIZE)
+    {
+        printf("Error writing backup: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    backup->pages_copied += 1;
+}
+
+/**
+ * start copying a snapshot of the current database state to dest.
+ * pages are copied a few at a time by backup_step() so statements keep
+ * running; a page about to be modified is copied first (copy-on-write),
+ * which keeps the backup consistent as of this call.
+ * if dest already holds a backup, only pages with a newer LSN are copied.
+ */
+bool backup_begin(Pager* pager, const char* dest)
+{
+    if(pager->backup != NULL)
+    {
+        printf("A backup is already running\n");
+        return false;
+    }
+
+    int fd = open(dest, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+    if(fd == -1)
+    {
+        printf("Unable to open backup file\n");
+        return false;
+    }
+
+    off_t dest_length = lseek(fd, 0, SEEK_END);
+    if(dest_length % PAGE_SIZE != 0)
+    {
+        printf("Backup file is not a whole number of pages\n");
+        close(fd);
+        return false;
+    }
+
+    Backup* backup = malloc(sizeof(Backup));
+    backup->file_descriptor = fd;
+    backup->num_pages = pager->num_pages;
+    backup->next_page = 0;
+    // a fresh destination takes every page, even those never stamped
+    backup->since_lsn = dest_length == 0 ? -1 : file_max_lsn(fd);
+    backup->pages_copied = 0;
+    for(int i = 0; i < TABLE_MAX_PAGES; i++)
+    {
+        backup->copied[i] = false;
+    }
+
+    pager->backup = backup;
+    return true;
+}
+
+void backup_finish(Pager* pager)
+{
+    Backup* backup = pager->backup;
+
+    if(ftruncate(backup->file_descriptor,
+                 (off_t)backup->num_pages * PAGE_SIZE) == -1 ||
+       fsync(backup->file_descriptor) == -1)
+    {
+        printf("Error writing backup: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    close(backup->file_descriptor);
+
+    printf("Backup complete: %d of %d pages copied\n", backup->pages_copied,
+           backup->num_pages);
+
+    free(backup);
+    pager->backup = NULL;
+}
+
+/**
+ * copy the next batch of snapshot pages. the batch size bounds how much
+ * work is done between two statements
+ */
+void backup_step(Pager* pager)
+{
+    Backup* backup = pager->backup;
+    if(backup == NULL)
+    {
+        return;
+    }
+
+    int copied = 0;
+    while(backup->next_page < backup->num_pages &&
+          copied < BACKUP_PAGES_PER_STEP)
+    {
+        int page_num = backup->next_page++;
+        if(!backup->copied[page_num])
+        {
+            backup_copy_page(pager, backup, page_num);
+            copied += 1;
+        }
+    }
+
+    if(backup->next_page >= backup->num_pages)
+    {
+        backup_finish(pager);
+    }
+}
+
+void backup_preserve_page(Pager* pager, int page_num)
+{
+    Backup* backup = pager->backup;
+    if(backup != NULL && page_num < backup->num_pages &&
+       !backup->copied[page_num])
+    {
+        backup_copy_page(pager, backup, page_num);
+    }
+}
+
+/**
+ * for changes to an internal node's message buffer only, which leave the
+ * node's search tree valid
+ */
+void pager_mark_buffer_dirty(Pager* pager, int page_num)
+{
+    backup_preserve_page(pager, page_num);
+
+    *page_lsn(get_page(pager, page_num)) = ++pager->lsn;
+    pager->dirty[page_num] = true;
+}
+
+/**
+ * must be called before a page is modified: preserves the page for a
+ * running backup, stamps it with a new LSN and queues it for the WAL
+ */
+void pager_mark_dirty(Pager* pager, int page_num)
+{
+    pager_mark_buffer_dirty(pager, page_num);
+    node_search_tree_drop(pager, page_num);
+}
+
+void wal_segment_name(char* name, const char* path, int segment)
+{
+    if(snprintf(name, WAL_PATH_MAX, "%s-wal.%06d", path, segment) >=
+       WAL_PATH_MAX)
+    {
+        printf("WAL path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * "<db>-wal.<suffix>", for the checkpoint and the replica positions
+ */
+void wal_file_name(char* name, const char* path, const char* suffix)
+{
+    if(snprintf(name, WAL_PATH_MAX, "%s-wal.%s", path, suffix) >=
+       WAL_PATH_MAX)
+    {
+        printf("WAL path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int wal_open_segment(Wal* wal, int segment, int flags)
+{
+    char name[WAL_PATH_MAX];
+    wal_segment_name(name, wal->path, segment);
+
+    return open(name, flags, S_IWUSR | S_IRUSR);
+}
+
+/**
+ * move to the next segment once the current one is exhausted. the writer
+ * only creates a segment after the previous one is complete, so its
+ * existence means nothing more will be appended to the current one
+ */
+bool wal_next_segment(Wal* wal)
+{
+    int fd = wal_open_segment(wal, wal->segment + 1, O_RDONLY);
+    if(fd == -1)
+    {
+        return false;
+    }
+
+    if(wal->file_descriptor != -1)
+    {
+        close(wal->file_descriptor);
+    }
+    wal->file_descriptor = fd;
+    wal->segment += 1;
+    wal->offset = 0;
+
+    return true;
+}
+
+/**
+ * FNV-1a over a record past its checksum field
+ */
+uint32_t wal_checksum(const void* record)
+{
+    const uint8_t* bytes = record;
+    uint32_t hash = 2166136261u;
+    for(int i = sizeof(uint32_t); i < WAL_RECORD_SIZE; i++)
+    {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * length of the commit group starting at the read position, 0 if the
+ * group is not complete yet. a record whose checksum does not match is
+ * still being written, or is the torn tail of a crash. the newest LSN in
+ * the group goes to *lsn
+ */
+off_t wal_group_length(Wal* wal, int* lsn)
+{
+    void* record = malloc(WAL_RECORD_SIZE);
+    WalRecordHeader* header = record;
+    off_t length = 0;
+
+    do
+    {
+        ssize_t bytes_read = pread(wal->file_descriptor, record,
+                                   WAL_RECORD_SIZE, wal->offset + length);
+        if(bytes_read != WAL_RECORD_SIZE ||
+           header->checksum != wal_checksum(record))
+        {
+            free(record);
+            return 0;
+        }
+        length += WAL_RECORD_SIZE;
+        *lsn = header->lsn;
+    } while(!(header->flags & WAL_RECORD_COMMIT));
+
+    free(record);
+    return length;
+}
+
+/**
+ * overwrite a page with an image of it stamped with lsn, unless the page
+ * is already as new
+ */
+void wal_redo_page(Pager* pager, int page_num, int lsn, const void* image)
+{
+    void* page = get_page(pager, page_num);
+    if(lsn > *page_lsn(page))
+    {
+        backup_preserve_page(pager, page_num);
+        memcpy(page, image, PAGE_SIZE);
+        node_search_tree_drop(pager, page_num);
+    }
+}
+
+void wal_replica_name(char* name, Wal* wal)
+{
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), "replica.%d", (int)getpid());
+    wal_file_name(name, wal->path, suffix);
+}
+
+/**
+ * let the primary know the oldest segment this replica still reads. a
+ * position that cannot be read keeps every segment
+ */
+void wal_publish_position(Wal* wal)
+{
+    char name[WAL_PATH_MAX];
+    wal_replica_name(name, wal);
+
+    int segment = wal->file_descriptor != -1 ? wal->segment : wal->segment + 1;
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if(fd == -1 || write(fd, &segment, sizeof(segment)) != sizeof(segment) ||
+       close(fd) == -1)
+    {
+        printf("Unable to write replica position\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * oldest segment a running replica of this log still reads, INT_MAX if
+ * there is none. positions left behind by replicas that exited without
+ * closing are removed
+ */
+int wal_replica_segment(Wal* wal)
+{
+    char directory[WAL_PATH_MAX];
+    char prefix[WAL_PATH_MAX];
+    const char* slash = strrchr(wal->path, '/');
+    if(slash == NULL)
+    {
+        snprintf(directory, WAL_PATH_MAX, ".");
+        wal_file_name(prefix, wal->path, "replica.");
+    }
+    else
+    {
+        snprintf(directory, WAL_PATH_MAX, "%.*s",
+                 slash == wal->path ? 1 : (int)(slash - wal->path),
+                 wal->path);
+        wal_file_name(prefix, slash + 1, "replica.");
+    }
+
+    DIR* dir = opendir(directory);
+    if(dir == NULL)
+    {
+        return 0;
+    }
+
+    int oldest = INT_MAX;
+    size_t prefix_length = strlen(prefix);
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        if(strncmp(entry->d_name, prefix, prefix_length) != 0)
+        {
+            continue;
+        }
+
+        char name[WAL_PATH_MAX];
+        if(snprintf(name, WAL_PATH_MAX, "%s/%s", directory, entry->d_name) >=
+           WAL_PATH_MAX)
+        {
+            continue;
+        }
+        int pid = atoi(entry->d_name + prefix_length);
+        if(pid <= 0 || (kill(pid, 0) == -1 && errno == ESRCH))
+        {
+            unlink(name);
+            continue;
+        }
+
+        int segment = 0;
+        int fd = open(name, O_RDONLY);
+        if(fd != -1)
+        {
+            if(read(fd, &segment, sizeof(segment)) != sizeof(segment))
+            {
+                segment = 0;
+            }
+            close(fd);
+        }
+        if(segment < oldest)
+        {
+            oldest = segment;
+        }
+    }
+    closedir(dir);
+
+    return oldest;
+}
+
+bool wal_read_checkpoint(const char* path, WalCheckpoint* checkpoint)
+{
+    char name[WAL_PATH_MAX];
+    wal_file_name(name, path, "checkpoint");
+
+    int fd = open(name, O_RDONLY);
+    if(fd == -1)
+    {
+        return false;
+    }
+    ssize_t bytes_read = read(fd, checkpoint, sizeof(WalCheckpoint));
+    close(fd);
+
+    return bytes_read == sizeof(WalCheckpoint);
+}
+
+/**
+ * bring a replica up to the primary's last checkpoint from the primary's
+ * db file, as the segments before the checkpoint may be gone. a page is
+ * read until two reads agree, so one the primary is writing back at the
+ * same time is not taken half written
+ */
+void wal_apply_checkpoint(Pager* pager)
+{
+    int fd = open(pager->wal->path, O_RDONLY);
+    if(fd == -1)
+    {
+        return;
+    }
+
+    void* image = malloc(PAGE_SIZE);
+    void* previous = malloc(PAGE_SIZE);
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    for(int page_num = 0;
+        page_num < TABLE_MAX_PAGES && page_num * PAGE_SIZE < file_length;
+        page_num++)
+    {
+        off_t offset = (off_t)page_num * PAGE_SIZE;
+        bool complete = pread(fd, image, PAGE_SIZE, offset) == PAGE_SIZE;
+        while(complete)
+        {
+            memcpy(previous, image, PAGE_SIZE);
+            complete = pread(fd, image, PAGE_SIZE, offset) == PAGE_SIZE;
+            if(complete && memcmp(previous, image, PAGE_SIZE) == 0)
+            {
+                break;
+            }
+        }
+        if(!complete)
+        {
+            break;
+        }
+
+        wal_redo_page(pager, page_num, *page_lsn(image), image);
+        if(*page_lsn(image) > pager->lsn)
+        {
+            pager->lsn = *page_lsn(image);
+        }
+    }
+
+    free(previous);
+    free(image);
+    close(fd);
+}
+
+/**
+ * redo every complete commit group past the read position. a page is
+ * overwritten only if the record is newer than the page, so replaying a
+ * log that was partially applied before is harmless
+ */
+void wal_apply(Pager* pager)
+{
+    Wal* wal = pager->wal;
+    void* record = malloc(WAL_RECORD_SIZE);
+    int segment = wal->segment;
+
+    while(wal->file_descriptor != -1 || wal_next_segment(wal))
+    {
+        int group_lsn;
+        off_t length = wal_group_length(wal, &group_lsn);
+        if(length == 0)
+        {
+            if(!wal_next_segment(wal))
+            {
+                break;
+            }
+            continue;
+        }
+
+        for(off_t offset = 0; offset < length; offset += WAL_RECORD_SIZE)
+        {
+            pread(wal->file_descriptor, record, WAL_RECORD_SIZE,
+                  wal->offset + offset);
+
+            WalRecordHeader* header = record;
+            wal_redo_page(pager, header->page_num, header->lsn,
+                          record + sizeof(WalRecordHeader));
+        }
+
+        wal->offset += length;
+        wal->applied_lsn = group_lsn;
+        wal->last_applied = time(NULL);
+        if(group_lsn > pager->lsn)
+        {
+            pager->lsn = group_lsn;
+        }
+    }
+
+    free(record);
+    if(wal->read_only && wal->segment != segment)
+    {
+        wal_publish_position(wal);
+    }
+}
+
+/**
+ * newest complete LSN the log holds past the read position, without
+ * applying anything
+ */
+int wal_peek_lsn(Wal* wal)
+{
+    Wal peek = *wal;
+    int lsn = wal->applied_lsn;
+
+    if(peek.file_descriptor != -1)
+    {
+        peek.file_descriptor = dup(wal->file_descriptor);
+    }
+
+    while(peek.file_descriptor != -1 || wal_next_segment(&peek))
+    {
+        int group_lsn;
+        off_t length = wal_group_length(&peek, &group_lsn);
+        if(length == 0)
+        {
+            if(!wal_next_segment(&peek))
+            {
+                break;
+            }
+            continue;
+        }
+        peek.offset += length;
+        lsn = group_lsn;
+    }
+
+    if(peek.file_descriptor != -1)
+    {
+        close(peek.file_descriptor);
+    }
+
+    return lsn;
+}
+
+/**
+ * attach a log to the pager and redo whatever it holds past the last
+ * checkpoint. a primary then keeps appending at the end of the last
+ * complete group, dropping a torn tail left by a crash. a replica first
+ * publishes a position that holds every segment, then starts from the
+ * primary's checkpoint
+ */
+void wal_open(Pager* pager, const char* path, bool read_only)
+{
+    Wal* wal = malloc(sizeof(Wal));
+    snprintf(wal->path, WAL_PATH_MAX, "%s", path);
+    wal->read_only = read_only;
+    wal->segment = -1;
+    wal->file_descriptor = -1;
+    wal->offset = 0;
+    wal->applied_lsn = 0;
+    wal->checkpoint_lsn = 0;
+    wal->last_applied = 0;
+    pager->wal = wal;
+
+    if(read_only)
+    {
+        wal_publish_position(wal);
+    }
+    WalCheckpoint checkpoint;
+    if(wal_read_checkpoint(path, &checkpoint))
+    {
+        wal->segment = checkpoint.segment - 1;
+        wal->applied_lsn = checkpoint.lsn;
+        wal->checkpoint_lsn = checkpoint.lsn;
+        if(read_only)
+        {
+            wal_publish_position(wal);
+            wal_apply_checkpoint(pager);
+        }
+    }
+
+    wal_apply(pager);
+    if(read_only)
+    {
+        return;
+    }
+
+    if(wal->file_descriptor != -1)
+    {
+        close(wal->file_descriptor);
+    }
+    else
+    {
+        wal->segment += 1;
+    }
+    wal->file_descriptor = wal_open_segment(wal, wal->segment, O_RDWR | O_CREAT);
+    if(wal->file_descriptor == -1 ||
+       ftruncate(wal->file_descriptor, wal->offset) == -1)
+    {
+        printf("Unable to open WAL segment\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * write every cached page back to the db file, record that recovery can
+ * start from the current segment, and remove the segments before it that
+ * no replica still reads
+ */
+void wal_checkpoint(Pager* pager)
+{
+    Wal* wal = pager->wal;
+
+    for(int i = 0; i < pager->num_pages; i++)
+    {
+        if(pager->pages[i] != NULL)
+        {
+            pager_flush(pager, i);
+        }
+    }
+    if(fsync(pager->file_descriptor) == -1)
+    {
+        printf("Error syncing db file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    char name[WAL_PATH_MAX];
+    char temp_name[WAL_PATH_MAX];
+    wal_file_name(name, wal->path, "checkpoint");
+    wal_file_name(temp_name, wal->path, "checkpoint.tmp");
+
+    WalCheckpoint checkpoint = {pager->lsn, wal->segment};
+    int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if(fd == -1 ||
+       write(fd, &checkpoint, sizeof(checkpoint)) != sizeof(checkpoint) ||
+       fsync(fd) == -1 || close(fd) == -1 || rename(temp_name, name) == -1)
+    {
+        printf("Unable to write WAL checkpoint\n");
+        exit(EXIT_FAILURE);
+    }
+    wal->checkpoint_lsn = checkpoint.lsn;
+
+    // segments below the oldest one kept were removed by an earlier
+    // checkpoint
+    int keep = wal_replica_segment(wal);
+    if(checkpoint.segment < keep)
+    {
+        keep = checkpoint.segment;
+    }
+    for(int i = keep - 1; i >= 0; i--)
+    {
+        wal_segment_name(name, wal->path, i);
+        if(unlink(name) == -1)
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * append the pages modified by the statement as one commit group and make
+ * it durable. filling a segment starts the next one and checkpoints
+ */
+void wal_commit(Pager* pager)
+{
+    Wal* wal = pager->wal;
+    int num_records = 0;
+
+    for(int i = 0; i < TABLE_MAX_PAGES; i++)
+    {
+        num_records += pager->dirty[i];
+    }
+    if(wal == NULL || num_records == 0)
+    {
+        return;
+    }
+
+    void* group = malloc(num_records * WAL_RECORD_SIZE);
+    void* record = group;
+    for(int i = 0; i < TABLE_MAX_PAGES; i++)
+    {
+        if(!pager->dirty[i])
+        {
+            continue;
+        }
+        pager->dirty[i] = false;
+
+        WalRecordHeader* header = record;
+        header->lsn = *page_lsn(pager->pages[i]);
+        header->page_num = i;
+        header->flags = --num_records == 0 ? WAL_RECORD_COMMIT : 0;
+        memcpy(record + sizeof(WalRecordHeader), pager->pages[i], PAGE_SIZE);
+        header->checksum = wal_checksum(record);
+        record += WAL_RECORD_SIZE;
+    }
+
+    size_t length = record - group;
+    if(pwrite(wal->file_descriptor, group, length, wal->offset) !=
+           (ssize_t)length ||
+       fdatasync(wal->file_descriptor) == -1)
+    {
+        printf("Error writing WAL: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    free(group);
+    wal->offset += length;
+    wal->applied_lsn = pager->lsn;
+
+    if(wal->offset >= WAL_SEGMENT_SIZE)
+    {
+        close(wal->file_descriptor);
+        wal->segment += 1;
+        wal->offset = 0;
+        wal->file_descriptor =
+            wal_open_segment(wal, wal->segment, O_RDWR | O_CREAT | O_TRUNC);
+        if(wal->file_descriptor == -1)
+        {
+            printf("Unable to open WAL segment\n");
+            exit(EXIT_FAILURE);
+        }
+        wal_checkpoint(pager);
+    }
+}
+
+/**
+ * a replica withdraws its position so the primary stops keeping segments
+ * for it
+ */
+void wal_close(Pager* pager)
+{
+    if(pager->wal == NULL)
+    {
+        return;
+    }
+    if(pager->wal->file_descriptor != -1)
+    {
+        close(pager->wal->file_descriptor);
+    }
+    if(pager->wal->read_only)
+    {
+        char name[WAL_PATH_MAX];
+        wal_replica_name(name, pager->wal);
+        unlink(name);
+    }
+    free(pager->wal);
+    pager->wal = NULL;
+}
+
+void initialize_leaf_node(void* node)
+{
+    set_node_type(node, NODE_LEAF);
+    set_node_root(node, false);
+    *leaf_node_num_cells(node) = 0;
+    *leaf_node_next_leaf(node) = 0;
+}
+
+void initialize_internal_node(void* node)
+{
+    set_node_type(node, NODE_INTERNAL);
+    set_node_root(node, false);
+    *internal_node_num_keys(node) = 0;
+    *internal_node_num_messages(node) = 0;
+}
+
+/**
+ * change data capture: one record per row change, in LSN order, appended
+ * to a file. consumers either read the file themselves, keeping their
+ * own offset, or connect to the unix socket and send the offset (8 bytes)
+ * to resume from; the file is then streamed to them with sendfile()
+ */
+typedef enum
+{
+    CDC_INSERT = 1,
+    CDC_UPDATE,
+    CDC_DELETE
+} CdcOperation;
+
+typedef struct
+{
+    int lsn;
+    int table_id;
+    int operation;
+    int length; // bytes of row image following the header
+    uint8_t key[KEY_SIZE];
+} CdcRecordHeader;
+
+typedef struct
+{
+    int file_descriptor;
+    off_t length; // bytes written to the file
+    char batch[CDC_BATCH_SIZE];
+    size_t batch_length;
+    int listen_descriptor; // -1 without a socket
+    int num_consumers;
+    int consumers[CDC_MAX_CONSUMERS];
+    off_t consumer_offsets[CDC_MAX_CONSUMERS]; // -1 until the consumer
+                                               // sent its offset
+} Cdc;
+
+Cdc* cdc_open(const char* path, const char* socket_path)
+{
+    Cdc* cdc = malloc(sizeof(Cdc));
+    cdc->file_descriptor =
+        open(path, O_RDWR | O_CREAT | O_APPEND, S_IWUSR | S_IRUSR);
+    if(cdc->file_descriptor == -1)
+    {
+        printf("Unable to open change data capture file\n");
+        exit(EXIT_FAILURE);
+    }
+    cdc->length = lseek(cdc->file_descriptor, 0, SEEK_END);
+    cdc->batch_length = 0;
+    cdc->listen_descriptor = -1;
+    cdc->num_consumers = 0;
+
+    if(socket_path == NULL)
+    {
+        return cdc;
+    }
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    unlink(socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(fd == -1 ||
+       bind(fd, (struct sockaddr*)&address, sizeof(address)) == -1 ||
+       listen(fd, CDC_MAX_CONSUMERS) == -1)
+    {
+        printf("Unable to listen on change data capture socket\n");
+        exit(EXIT_FAILURE);
+    }
+    cdc->listen_descriptor = fd;
+
+    // a consumer going away must not take the database with it
+    signal(SIGPIPE, SIG_IGN);
+
+    return cdc;
+}
+
+void cdc_drop_consumer(Cdc* cdc, int i)
+{
+    close(cdc->consumers[i]);
+    cdc->num_consumers -= 1;
+    cdc->consumers[i] = cdc->consumers[cdc->num_consumers];
+    cdc->consumer_offsets[i] = cdc->consumer_offsets[cdc->num_consumers];
+}
+
+/**
+ * accept new consumers and send everyone what they have not seen yet.
+ * sockets are non-blocking: a slow consumer is resumed on the next call
+ */
+void cdc_serve(Cdc* cdc)
+{
+    if(cdc == NULL || cdc->listen_descriptor == -1)
+    {
+        return;
+    }
+
+    int fd;
+    while(cdc->num_consumers < CDC_MAX_CONSUMERS &&
+          (fd = accept4(cdc->listen_descriptor, NULL, NULL,
+                        SOCK_NONBLOCK)) != -1)
+    {
+        cdc->consumers[cdc->num_consumers] = fd;
+        cdc->consumer_offsets[cdc->num_consumers] = -1;
+        cdc->num_consumers += 1;
+    }
+
+    for(int i = cdc->num_consumers - 1; i >= 0; i--)
+    {
+        if(cdc->consumer_offsets[i] == -1)
+        {
+            int64_t offset;
+            ssize_t bytes_read =
+                recv(cdc->consumers[i], &offset, sizeof(offset), MSG_PEEK);
+            if(bytes_read == 0 || (bytes_read == -1 && errno != EAGAIN))
+            {
+                cdc_drop_consumer(cdc, i);
+                continue;
+            }
+            if(bytes_read < (ssize_t)sizeof(offset))
+            {
+                continue;
+            }
+            recv(cdc->consumers[i], &offset, sizeof(offset), 0);
+            cdc->consumer_offsets[i] =
+                offset < 0 || offset > cdc->length ? cdc->length : offset;
+        }
+
+        while(cdc->consumer_offsets[i] < cdc->length)
+        {
+            ssize_t bytes_sent = sendfile(
+                cdc->consumers[i], cdc->file_descriptor,
+                &cdc->consumer_offsets[i],
+                cdc->length - cdc->consumer_offsets[i]);
+            if(bytes_sent == -1)
+            {
+                if(errno != EAGAIN)
+                {
+                    cdc_drop_consumer(cdc, i);
+                }
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * write the pending batch with a single append and push it to consumers
+ */
+void cdc_flush(Cdc* cdc)
+{
+    if(cdc == NULL || cdc->batch_length == 0)
+    {
+        return;
+    }
+
+    ssize_t bytes_written =
+        write(cdc->file_descriptor, cdc->batch, cdc->batch_length);
+    if(bytes_written != (ssize_t)cdc->batch_length)
+    {
+        printf("Error writing change data capture file: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    cdc->length += cdc->batch_length;
+    cdc->batch_length = 0;
+
+    cdc_serve(cdc);
+}
+
+/**
+ * queue one change. the row image is copied straight from the serialized
+ * cell, it is never deserialized
+ */
+void cdc_emit(Cdc* cdc, int lsn, int table_id, CdcOperation operation,
+              void* key, void* row_image, int length)
+{
+    if(cdc == NULL)
+    {
+        return;
+    }
+
+    size_t record_length = sizeof(CdcRecordHeader) + length;
+    if(cdc->batch_length + record_length > CDC_BATCH_SIZE)
+    {
+        cdc_flush(cdc);
+    }
+
+    CdcRecordHeader header = {lsn, table_id, operation, length, {0}};
+    memcpy(header.key, key, KEY_SIZE);
+    memcpy(cdc->batch + cdc->batch_length, &header, sizeof(header));
+    memcpy(cdc->batch + cdc->batch_length + sizeof(header), row_image,
+           length);
+    cdc->batch_length += record_length;
+}
+
+void cdc_close(Cdc* cdc)
+{
+    if(cdc == NULL)
+    {
+        return;
+    }
+
+    cdc_flush(cdc);
+    for(int i = 0; i < cdc->num_consumers; i++)
+    {
+        close(cdc->consumers[i]);
+    }
+    if(cdc->listen_descriptor != -1)
+    {
+        close(cdc->listen_descriptor);
+    }
+    close(cdc->file_descriptor);
+    free(cdc);
+}
+
+/**
+ * LSM engine: an alternative to the B-tree for write-heavy tables.
+ * inserts go to a skiplist memtable (and a sequential log for recovery).
+ * a full memtable is written out as an immutable sorted run with a sparse
+ * index and a Bloom filter. runs are merged by leveled compaction in small
+ * steps between statements: level 0 holds overlapping runs straight from
+ * the memtable, every deeper level a single run LSM_LEVEL_SIZE_RATIO
+ * times larger than the previous one.
+ */
+
+/**
+ * lsm entry layout, shared by the memtable, the log and the runs
+ */
+const int LSM_ENTRY_KEY_OFFSET = 0;
+const int LSM_ENTRY_FLAGS_OFFSET = KEY_SIZE;
+const int LSM_ENTRY_VALUE_OFFSET = KEY_SIZE + sizeof(int);
+const int LSM_ENTRY_SIZE = KEY_SIZE + sizeof(int) + ROW_SIZE;
+
+#define LSM_TOMBSTONE 1
+
+typedef struct LsmMemtableNode
+{
+    char* entry;
+    int height;
+    struct LsmMemtableNode* next[LSM_SKIPLIST_MAX_HEIGHT];
+} LsmMemtableNode;
+
+typedef struct
+{
+    int magic;
+    int num_entries;
+    int num_index; // one index key every LSM_INDEX_INTERVAL entries
+    int bloom_bits;
+    uint8_t min_key[KEY_SIZE];
+    uint8_t max_key[KEY_SIZE];
+} LsmRunHeader;
+
+#define LSM_RUN_MAGIC 0x4c534d31
+
+typedef struct
+{
+    int id;
+    int level;
+    int file_descriptor;
+    LsmRunHeader header;
+    uint8_t* index; // num_index keys
+    uint8_t* bloom;
+} LsmRun;
+
+/**
+ * a sorted input of a merge: the memtable or a run read block by block
+ */
+typedef struct
+{
+    LsmRun* run; // NULL for the memtable
+    LsmMemtableNode* node;
+    char* block;
+    int block_start; // entry number of block[0]
+    int block_count;
+    int position; // entry number within the run
+} LsmSource;
+
+typedef struct
+{
+    int num_sources;
+    LsmSource sources[LSM_MAX_RUNS + 1]; // newest first
+    bool skip_tombstones;
+    bool end;
+    char* entry; // copy of the current entry
+} LsmMerge;
+
+typedef struct
+{
+    LsmRun* run;
+    int capacity; // upper bound on entries, sizes index and Bloom filter
+    char* block;
+    int block_count;
+} LsmRunWriter;
+
+typedef struct
+{
+    int output_level;
+    int num_inputs;
+    LsmRun* inputs[LSM_MAX_RUNS];
+    LsmMerge merge;
+    LsmRunWriter writer;
+} LsmCompaction;
+
+typedef struct
+{
+    char path[WAL_PATH_MAX]; // runs, log and manifest live next to the db
+    LsmMemtableNode head;
+    int memtable_entries;
+    int log_descriptor;
+    int sequence; // last sequence number given to a change
+    int next_run_id;
+    int num_runs;
+    LsmRun* runs[LSM_MAX_RUNS]; // search order: level 0 newest first, then
+                                // one run per deeper level
+    LsmCompaction* compaction;  // NULL when no compaction is running
+} Lsm;
+
+void* lsm_entry_key(char* entry)
+{
+    return entry + LSM_ENTRY_KEY_OFFSET;
+}
+
+int* lsm_entry_flags(char* entry)
+{
+    return (int*)(entry + LSM_ENTRY_FLAGS_OFFSET);
+}
+
+void* lsm_entry_value(char* entry)
+{
+    return entry + LSM_ENTRY_VALUE_OFFSET;
+}
+
+void lsm_file_name(char* name, Lsm* lsm, const char* suffix, int id)
+{
+    int length =
+        id < 0
+            ? snprintf(name, WAL_PATH_MAX, "%s-lsm%s", lsm->path, suffix)
+            : snprintf(name, WAL_PATH_MAX, "%s-lsm-%06d%s", lsm->path, id,
+                       suffix);
+    if(length >= WAL_PATH_MAX)
+    {
+        printf("LSM path is too long: %s\n", lsm->path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+uint32_t lsm_hash(const uint8_t* key)
+{
+    // FNV-1a over the key, then a final mix
+    uint32_t hash = 2166136261u;
+    for(int i = 0; i < KEY_SIZE; i++)
+    {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    hash ^= hash >> 15;
+    hash *= 0x85ebca77u;
+    hash ^= hash >> 13;
+
+    return hash;
+}
+
+/**
+ * double hashing: the k probes are h1 + i * h2
+ */
+void lsm_bloom_add(uint8_t* bloom, int bloom_bits, const uint8_t* key)
+{
+    uint32_t h1 = lsm_hash(key);
+    uint32_t h2 = (h1 >> 17) | (h1 << 15);
+
+    for(int i = 0; i < LSM_BLOOM_HASHES; i++)
+    {
+        uint32_t bit = (h1 + i * h2) % bloom_bits;
+        bloom[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+bool lsm_bloom_may_contain(uint8_t* bloom, int bloom_bits,
+                           const uint8_t* key)
+{
+    uint32_t h1 = lsm_hash(key);
+    uint32_t h2 = (h1 >> 17) | (h1 << 15);
+
+    for(int i = 0; i < LSM_BLOOM_HASHES; i++)
+    {
+        uint32_t bit = (h1 + i * h2) % bloom_bits;
+        if(!(bloom[bit / 8] & (1 << (bit % 8))))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * memtable: skiplist ordered by key, newer entries replace older ones
+ */
+int lsm_random_height()
+{
+    int height = 1;
+    while(height < LSM_SKIPLIST_MAX_HEIGHT && (rand() & 3) == 0)
+    {
+        height += 1;
+    }
+
+    return height;
+}
+
+LsmMemtableNode* lsm_memtable_find(Lsm* lsm, const uint8_t* key,
+                                   LsmMemtableNode** update)
+{
+    LsmMemtableNode* node = &lsm->head;
+
+    for(int level = LSM_SKIPLIST_MAX_HEIGHT - 1; level >= 0; level--)
+    {
+        while(node->next[level] != NULL &&
+              key_compare(lsm_entry_key(node->next[level]->entry), key) < 0)
+        {
+            node = node->next[level];
+        }
+        if(update != NULL)
+        {
+            update[level] = node;
+        }
+    }
+
+    node = node->next[0];
+    if(node != NULL && key_compare(lsm_entry_key(node->entry), key) == 0)
+    {
+        return node;
+    }
+
+    return NULL;
+}
+
+void lsm_memtable_put(Lsm* lsm, char* entry)
+{
+    LsmMemtableNode* update[LSM_SKIPLIST_MAX_HEIGHT];
+    LsmMemtableNode* node =
+        lsm_memtable_find(lsm, lsm_entry_key(entry), update);
+
+    if(node != NULL)
+    {
+        memcpy(node->entry, entry, LSM_ENTRY_SIZE);
+        return;
+    }
+
+    node = malloc(sizeof(LsmMemtableNode));
+    node->entry = malloc(LSM_ENTRY_SIZE);
+    memcpy(node->entry, entry, LSM_ENTRY_SIZE);
+    node->height = lsm_random_height();
+    for(int level = 0; level < LSM_SKIPLIST_MAX_HEIGHT; level++)
+    {
+        if(level < node->height)
+        {
+            node->next[level] = update[level]->next[level];
+            update[level]->next[level] = node;
+        }
+        else
+        {
+            node->next[level] = NULL;
+        }
+    }
+
+    lsm->memtable_entries += 1;
+}
+
+void lsm_memtable_clear(Lsm* lsm)
+{
+    LsmMemtableNode* node = lsm->head.next[0];
+    while(node != NULL)
+    {
+        LsmMemtableNode* next = node->next[0];
+        free(node->entry);
+        free(node);
+        node = next;
+    }
+
+    for(int level = 0; level < LSM_SKIPLIST_MAX_HEIGHT; level++)
+    {
+        lsm->head.next[level] = NULL;
+    }
+    lsm->memtable_entries = 0;
+}
+
+/**
+ * runs
+ */
+off_t lsm_run_entry_offset(int entry_num)
+{
+    return sizeof(LsmRunHeader) + (off_t)entry_num * LSM_ENTRY_SIZE;
+}
+
+void lsm_read(int fd, void* buffer, size_t length, off_t offset)
+{
+    if(pread(fd, buffer, length, offset) != (ssize_t)length)
+    {
+        printf("Error reading sorted run: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+LsmRun* lsm_run_open(Lsm* lsm, int id, int level)
+{
+    char name[WAL_PATH_MAX];
+    lsm_file_name(name, lsm, ".sst", id);
+
+    LsmRun* run = malloc(sizeof(LsmRun));
+    run->id = id;
+    run->level = level;
+    run->file_descriptor = open(name, O_RDONLY);
+    if(run->file_descriptor == -1)
+    {
+        printf("Unable to open sorted run %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    LsmRunHeader* header = &run->header;
+    lsm_read(run->file_descriptor, header, sizeof(LsmRunHeader), 0);
+    if(header->magic != LSM_RUN_MAGIC)
+    {
+        printf("Sorted run %s is corrupt\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    off_t offset = lsm_run_entry_offset(header->num_entries);
+    run->index = malloc(header->num_index * KEY_SIZE);
+    lsm_read(run->file_descriptor, run->index, header->num_index * KEY_SIZE,
+             offset);
+
+    offset += header->num_index * KEY_SIZE;
+    run->bloom = malloc((header->bloom_bits + 7) / 8);
+    lsm_read(run->file_descriptor, run->bloom, (header->bloom_bits + 7) / 8,
+             offset);
+
+    return run;
+}
+
+void lsm_run_free(LsmRun* run)
+{
+    close(run->file_descriptor);
+    free(run->index);
+    free(run->bloom);
+    free(run);
+}
+
+/**
+ * point lookup in one run: Bloom filter, then the sparse index narrows it
+ * down to a single block
+ */
+bool lsm_run_get(LsmRun* run, const uint8_t* key, char* entry)
+{
+    LsmRunHeader* header = &run->header;
+    if(header->num_entries == 0 || key_compare(key, header->min_key) < 0 ||
+       key_compare(key, header->max_key) > 0 ||
+       !lsm_bloom_may_contain(run->bloom, header->bloom_bits, key))
+    {
+        return false;
+    }
+
+    // last index key <= key. the first one is the run's min_key
+    int index = key_lower_bound(run->index, KEY_SIZE, header->num_index, key);
+    if(index == header->num_index ||
+       key_compare(run->index + index * KEY_SIZE, key) > 0)
+    {
+        index--;
+    }
+
+    int block_start = index * LSM_INDEX_INTERVAL;
+    int block_count = header->num_entries - block_start;
+    if(block_count > LSM_INDEX_INTERVAL)
+    {
+        block_count = LSM_INDEX_INTERVAL;
+    }
+
+    char block[LSM_INDEX_INTERVAL * LSM_ENTRY_SIZE];
+    lsm_read(run->file_descriptor, block, block_count * LSM_ENTRY_SIZE,
+             lsm_run_entry_offset(block_start));
+    for(int i = 0; i < block_count; i++)
+    {
+        char* candidate = block + i * LSM_ENTRY_SIZE;
+        if(key_compare(lsm_entry_key(candidate), key) == 0)
+        {
+            memcpy(entry, candidate, LSM_ENTRY_SIZE);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void lsm_writer_begin(Lsm* lsm, LsmRunWriter* writer, int level,
+                      int capacity)
+{
+    char name[WAL_PATH_MAX];
+    int id = lsm->next_run_id++;
+    lsm_file_name(name, lsm, ".sst", id);
+
+    LsmRun* run = malloc(sizeof(LsmRun));
+    run->id = id;
+    run->level = level;
+    run->file_descriptor =
+        open(name, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if(run->file_descriptor == -1)
+    {
+        printf("Unable to create sorted run %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    run->header.magic = LSM_RUN_MAGIC;
+    run->header.num_entries = 0;
+    run->header.num_index = 0;
+    run->header.bloom_bits = capacity * LSM_BLOOM_BITS_PER_KEY + 8;
+    run->index = malloc((capacity / LSM_INDEX_INTERVAL + 1) * KEY_SIZE);
+    run->bloom = calloc(1, (run->header.bloom_bits + 7) / 8);
+
+    writer->run = run;
+    writer->capacity = capacity;
+    writer->block = malloc(LSM_INDEX_INTERVAL * LSM_ENTRY_SIZE);
+    writer->block_count = 0;
+}
+
+void lsm_write(int fd, void* buffer, size_t length, off_t offset)
+{
+    if(pwrite(fd, buffer, length, offset) != (ssize_t)length)
+    {
+        printf("Error writing sorted run: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+void lsm_writer_flush_block(LsmRunWriter* writer)
+{
+    LsmRun* run = writer->run;
+    int block_start = run->header.num_entries - writer->block_count;
+
+    lsm_write(run->file_descriptor, writer->block,
+              writer->block_count * LSM_ENTRY_SIZE,
+              lsm_run_entry_offset(block_start));
+    writer->block_count = 0;
+}
+
+/**
+ * entries must be added in key order
+ */
+void lsm_writer_add(LsmRunWriter* writer, char* entry)
+{
+    LsmRun* run = writer->run;
+    LsmRunHeader* header = &run->header;
+    uint8_t* key = lsm_entry_key(entry);
+
+    if(header->num_entries % LSM_INDEX_INTERVAL == 0)
+    {
+        memcpy(run->index + header->num_index++ * KEY_SIZE, key, KEY_SIZE);
+    }
+    if(header->num_entries == 0)
+    {
+        memcpy(header->min_key, key, KEY_SIZE);
+    }
+    memcpy(header->max_key, key, KEY_SIZE);
+    lsm_bloom_add(run->bloom, header->bloom_bits, key);
+
+    memcpy(writer->block + writer->block_count * LSM_ENTRY_SIZE, entry,
+           LSM_ENTRY_SIZE);
+    writer->block_count += 1;
+    header->num_entries += 1;
+    if(writer->block_count == LSM_INDEX_INTERVAL)
+    {
+        lsm_writer_flush_block(writer);
+    }
+}
+
+LsmRun* lsm_writer_finish(LsmRunWriter* writer)
+{
+    LsmRun* run = writer->run;
+    LsmRunHeader* header = &run->header;
+
+    lsm_writer_flush_block(writer);
+    free(writer->block);
+
+    off_t offset = lsm_run_entry_offset(header->num_entries);
+    lsm_write(run->file_descriptor, run->index, header->num_index * KEY_SIZE,
+              offset);
+    offset += header->num_index * KEY_SIZE;
+    lsm_write(run->file_descriptor, run->bloom, (header->bloom_bits + 7) / 8,
+              offset);
+    lsm_write(run->file_descriptor, header, sizeof(LsmRunHeader), 0);
+
+    if(fdatasync(run->file_descriptor) == -1)
+    {
+        printf("Error writing sorted run: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    return run;
+}
+
+void lsm_writer_abort(Lsm* lsm, LsmRunWriter* writer)
+{
+    char name[WAL_PATH_MAX];
+    lsm_file_name(name, lsm, ".sst", writer->run->id);
+
+    free(writer->block);
+    lsm_run_free(writer->run);
+    unlink(name);
+}
+
+/**
+ * merging iterator over the memtable and/or runs. when several sources
+ * hold a key, the newest (first) one wins
+ */
+char* lsm_source_entry(LsmSource* source)
+{
+    if(source->run == NULL)
+    {
+        return source->node == NULL ? NULL : source->node->entry;
+    }
+
+    LsmRunHeader* header = &source->run->header;
+    if(source->position >= header->num_entries)
+    {
+        return NULL;
+    }
+    if(source->position >= source->block_start + source->block_count)
+    {
+        // sequential read of the next block
+        source->block_start = source->position;
+        source->block_count = header->num_entries - source->position;
+        if(source->block_count > LSM_INDEX_INTERVAL)
+        {
+            source->block_count = LSM_INDEX_INTERVAL;
+        }
+        lsm_read(source->run->file_descriptor, source->block,
+                 source->block_count * LSM_ENTRY_SIZE,
+                 lsm_run_entry_offset(source->block_start));
+    }
+
+    return source->block +
+           (source->position - source->block_start) * LSM_ENTRY_SIZE;
+}
+
+void lsm_source_next(LsmSource* source)
+{
+    if(source->run == NULL)
+    {
+        source->node = source->node->next[0];
+    }
+    else
+    {
+        source->position += 1;
+    }
+}
+
+void lsm_merge_add_memtable(LsmMerge* merge, Lsm* lsm)
+{
+    LsmSource* source = &merge->sources[merge->num_sources++];
+    source->run = NULL;
+    source->node = lsm->head.next[0];
+    source->block = NULL;
+}
+
+void lsm_merge_add_run(LsmMerge* merge, LsmRun* run)
+{
+    LsmSource* source = &merge->sources[merge->num_sources++];
+    source->run = run;
+    source->node = NULL;
+    source->block = malloc(LSM_INDEX_INTERVAL * LSM_ENTRY_SIZE);
+    source->block_start = 0;
+    source->block_count = 0;
+    source->position = 0;
+}
+
+void lsm_merge_next(LsmMerge* merge)
+{
+    while(true)
+    {
+        int winner = -1;
+        uint8_t winner_key[KEY_SIZE];
+        for(int i = 0; i < merge->num_sources; i++)
+        {
+            char* entry = lsm_source_entry(&merge->sources[i]);
+            if(entry != NULL &&
+               (winner == -1 ||
+                key_compare(lsm_entry_key(entry), winner_key) < 0))
+            {
+                winner = i;
+                memcpy(winner_key, lsm_entry_key(entry), KEY_SIZE);
+            }
+        }
+
+        if(winner == -1)
+        {
+            merge->end = true;
+            return;
+        }
+
+        memcpy(merge->entry, lsm_source_entry(&merge->sources[winner]),
+               LSM_ENTRY_SIZE);
+        for(int i = winner; i < merge->num_sources; i++)
+        {
+            char* entry = lsm_source_entry(&merge->sources[i]);
+            if(entry != NULL &&
+               key_compare(lsm_entry_key(entry), winner_key) == 0)
+            {
+                lsm_source_next(&merge->sources[i]);
+            }
+        }
+
+        if(!(merge->skip_tombstones &&
+             (*lsm_entry_flags(merge->entry) & LSM_TOMBSTONE)))
+        {
+            return;
+        }
+    }
+}
+
+void lsm_merge_init(LsmMerge* merge, bool skip_tombstones)
+{
+    merge->num_sources = 0;
+    merge->skip_tombstones = skip_tombstones;
+    merge->end = false;
+    merge->entry = malloc(LSM_ENTRY_SIZE);
+}
+
+void lsm_merge_free(LsmMerge* merge)
+{
+    for(int i = 0; i < merge->num_sources; i++)
+    {
+        free(merge->sources[i].block);
+    }
+    free(merge->entry);
+}
+
+/**
+ * manifest: the list of live runs, replaced atomically with rename()
+ */
+void lsm_write_manifest(Lsm* lsm)
+{
+    char name[WAL_PATH_MAX];
+    char temp_name[WAL_PATH_MAX];
+    lsm_file_name(name, lsm, "", -1);
+    lsm_file_name(temp_name, lsm, ".tmp", -1);
+
+    int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR);
+    if(fd == -1)
+    {
+        printf("Unable to write LSM manifest\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int manifest[3 + 2 * LSM_MAX_RUNS];
+    int length = 0;
+    manifest[length++] = lsm->sequence;
+    manifest[length++] = lsm->next_run_id;
+    manifest[length++] = lsm->num_runs;
+    for(int i = 0; i < lsm->num_runs; i++)
+    {
+        manifest[length++] = lsm->runs[i]->id;
+        manifest[length++] = lsm->runs[i]->level;
+    }
+
+    if(write(fd, manifest, length * sizeof(int)) !=
+           (ssize_t)(length * sizeof(int)) ||
+       fsync(fd) == -1 || close(fd) == -1 || rename(temp_name, name) == -1)
+    {
+        printf("Unable to write LSM manifest\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void lsm_add_run(Lsm* lsm, LsmRun* run)
+{
+    if(lsm->num_runs == LSM_MAX_RUNS)
+    {
+        printf("Too many sorted runs\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // keep search order: by level, newest first within a level
+    int i = lsm->num_runs;
+    while(i > 0 && (lsm->runs[i - 1]->level > run->level ||
+                    (lsm->runs[i - 1]->level == run->level &&
+                     lsm->runs[i - 1]->id < run->id)))
+    {
+        lsm->runs[i] = lsm->runs[i - 1];
+        i--;
+    }
+    lsm->runs[i] = run;
+    lsm->num_runs += 1;
+}
+
+/**
+ * take a run out of the live set. its file stays until lsm_unlink_run, so
+ * a manifest that still lists it keeps pointing at a whole run
+ */
+void lsm_detach_run(Lsm* lsm, LsmRun* run)
+{
+    for(int i = 0; i < lsm->num_runs; i++)
+    {
+        if(lsm->runs[i] == run)
+        {
+            memmove(&lsm->runs[i], &lsm->runs[i + 1],
+                    (lsm->num_runs - i - 1) * sizeof(LsmRun*));
+            lsm->num_runs -= 1;
+            break;
+        }
+    }
+}
+
+void lsm_unlink_run(Lsm* lsm, LsmRun* run)
+{
+    char name[WAL_PATH_MAX];
+    lsm_file_name(name, lsm, ".sst", run->id);
+
+    lsm_run_free(run);
+    unlink(name);
+}
+
+int lsm_level_entries(Lsm* lsm, int level, int* num_runs)
+{
+    int entries = 0;
+    *num_runs = 0;
+    for(int i = 0; i < lsm->num_runs; i++)
+    {
+        if(lsm->runs[i]->level == level)
+        {
+            entries += lsm->runs[i]->header.num_entries;
+            *num_runs += 1;
+        }
+    }
+
+    return entries;
+}
+
+int lsm_level_max_entries(int level)
+{
+    int max_entries = LSM_L0_COMPACTION_TRIGGER * LSM_MEMTABLE_MAX_ENTRIES;
+    for(int i = 1; i < level; i++)
+    {
+        max_entries *= LSM_LEVEL_SIZE_RATIO;
+    }
+
+    return max_entries;
+}
+
+/**
+ * level that must be merged into the next one, -1 if the tree is in shape
+ */
+int lsm_pick_compaction(Lsm* lsm)
+{
+    int num_runs;
+    lsm_level_entries(lsm, 0, &num_runs);
+    if(num_runs >= LSM_L0_COMPACTION_TRIGGER)
+    {
+        return 0;
+    }
+
+    for(int level = 1; level < LSM_MAX_LEVELS - 1; level++)
+    {
+        if(lsm_level_entries(lsm, level, &num_runs) >
+           lsm_level_max_entries(level))
+        {
+            return level;
+        }
+    }
+
+    return -1;
+}
+
+bool lsm_compaction_pending(Lsm* lsm)
+{
+    return lsm != NULL &&
+           (lsm->compaction != NULL || lsm_pick_compaction(lsm) != -1);
+}
+
+void lsm_compaction_begin(Lsm* lsm, int level)
+{
+    LsmCompaction* compaction = malloc(sizeof(LsmCompaction));
+    compaction->output_level = level + 1;
+    compaction->num_inputs = 0;
+
+    bool deepest = true;
+    int capacity = 0;
+    for(int i = 0; i < lsm->num_runs; i++)
+    {
+        LsmRun* run = lsm->runs[i];
+        if(run->level == level || run->level == level + 1)
+        {
+            compaction->inputs[compaction->num_inputs++] = run;
+            capacity += run->header.num_entries;
+        }
+        else if(run->level > level + 1)
+        {
+            deepest = false;
+        }
+    }
+
+    // tombstones can only be dropped once nothing older sits below them
+    lsm_merge_init(&compaction->merge, deepest);
+    for(int i = 0; i < compaction->num_inputs; i++)
+    {
+        lsm_merge_add_run(&compaction->merge, compaction->inputs[i]);
+    }
+    lsm_merge_next(&compaction->merge);
+
+    lsm_writer_begin(lsm, &compaction->writer, compaction->output_level,
+                     capacity);
+    lsm->compaction = compaction;
+}
+
+/**
+ * merge up to LSM_COMPACTION_ENTRIES_PER_STEP entries. the inputs stay
+ * live until the output run is complete, then they are swapped in the
+ * manifest. their files are removed only once the new manifest is in
+ * place, so a crash at any point leaves either set of runs whole
+ */
+void lsm_compact_step(Lsm* lsm)
+{
+    if(lsm == NULL)
+    {
+        return;
+    }
+    if(lsm->compaction == NULL)
+    {
+        int level = lsm_pick_compaction(lsm);
+        if(level == -1)
+        {
+            return;
+        }
+        lsm_compaction_begin(lsm, level);
+    }
+
+    LsmCompaction* compaction = lsm->compaction;
+    for(int i = 0;
+        i < LSM_COMPACTION_ENTRIES_PER_STEP && !compaction->merge.end; i++)
+    {
+        lsm_writer_add(&compaction->writer, compaction->merge.entry);
+        lsm_merge_next(&compaction->merge);
+    }
+    if(!compaction->merge.end)
+    {
+        return;
+    }
+
+    LsmRun* output = lsm_writer_finish(&compaction->writer);
+    lsm_merge_free(&compaction->merge);
+    for(int i = 0; i < compaction->num_inputs; i++)
+    {
+        lsm_detach_run(lsm, compaction->inputs[i]);
+    }
+    lsm_add_run(lsm, output);
+    lsm_write_manifest(lsm);
+    for(int i = 0; i < compaction->num_inputs; i++)
+    {
+        lsm_unlink_run(lsm, compaction->inputs[i]);
+    }
+
+    free(compaction);
+    lsm->compaction = NULL;
+}
+
+void lsm_compaction_abort(Lsm* lsm)
+{
+    LsmCompaction* compaction = lsm->compaction;
+    if(compaction == NULL)
+    {
+        return;
+    }
+
+    lsm_merge_free(&compaction->merge);
+    lsm_writer_abort(lsm, &compaction->writer);
+    free(compaction);
+    lsm->compaction = NULL;
+}
+
+/**
+ * write the memtable out as a new level 0 run and start a fresh log
+ */
+void lsm_flush_memtable(Lsm* lsm)
+{
+    if(lsm->memtable_entries == 0)
+    {
+        return;
+    }
+
+    LsmRunWriter writer;
+    lsm_writer_begin(lsm, &writer, 0, lsm->memtable_entries);
+    for(LsmMemtableNode* node = lsm->head.next[0]; node != NULL;
+        node = node->next[0])
+    {
+        lsm_writer_add(&writer, node->entry);
+    }
+    lsm_add_run(lsm, lsm_writer_finish(&writer));
+    lsm_write_manifest(lsm);
+
+    lsm_memtable_clear(lsm);
+    if(ftruncate(lsm->log_descriptor, 0) == -1)
+    {
+        printf("Error truncating LSM log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    // write stall: too many overlapping runs make every lookup slow
+    int num_runs;
+    lsm_level_entries(lsm, 0, &num_runs);
+    while(num_runs >= LSM_L0_STOP_WRITES && lsm_compaction_pending(lsm))
+    {
+        lsm_compact_step(lsm);
+        lsm_level_entries(lsm, 0, &num_runs);
+    }
+}
+
+Lsm* lsm_open(const char* path)
+{
+    Lsm* lsm = malloc(sizeof(Lsm));
+    snprintf(lsm->path, WAL_PATH_MAX, "%s", path);
+    lsm->head.entry = NULL;
+    lsm->head.height = LSM_SKIPLIST_MAX_HEIGHT;
+    for(int level = 0; level < LSM_SKIPLIST_MAX_HEIGHT; level++)
+    {
+        lsm->head.next[level] = NULL;
+    }
+    lsm->memtable_entries = 0;
+    lsm->sequence = 0;
+    lsm->next_run_id = 0;
+    lsm->num_runs = 0;
+    lsm->compaction = NULL;
+
+    char name[WAL_PATH_MAX];
+    lsm_file_name(name, lsm, "", -1);
+    int fd = open(name, O_RDONLY);
+    if(fd != -1)
+    {
+        int manifest[3 + 2 * LSM_MAX_RUNS];
+        ssize_t bytes_read = read(fd, manifest, sizeof(manifest));
+        close(fd);
+        if(bytes_read < 3 * (ssize_t)sizeof(int))
+        {
+            printf("LSM manifest is corrupt\n");
+            exit(EXIT_FAILURE);
+        }
+
+        lsm->sequence = manifest[0];
+        lsm->next_run_id = manifest[1];
+        for(int i = 0; i < manifest[2]; i++)
+        {
+            lsm_add_run(lsm,
+                        lsm_run_open(lsm, manifest[3 + 2 * i],
+                                     manifest[4 + 2 * i]));
+        }
+    }
+    else
+    {
+        lsm_write_manifest(lsm);
+    }
+
+    // redo the log into the memtable. each record is a sequence number
+    // followed by an entry
+    lsm_file_name(name, lsm, "-log", -1);
+    lsm->log_descriptor =
+        open(name, O_RDWR | O_CREAT | O_APPEND, S_IWUSR | S_IRUSR);
+    if(lsm->log_descriptor == -1)
+    {
+        printf("Unable to open LSM log\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int record_size = sizeof(int) + LSM_ENTRY_SIZE;
+    char* record = malloc(record_size);
+    off_t offset = 0;
+    while(pread(lsm->log_descriptor, record, record_size, offset) ==
+          record_size)
+    {
+        lsm_memtable_put(lsm, record + sizeof(int));
+        if(*(int*)record > lsm->sequence)
+        {
+            lsm->sequence = *(int*)record;
+        }
+        offset += record_size;
+    }
+    free(record);
+    // drop a torn record at the end
+    if(ftruncate(lsm->log_descriptor, offset) == -1)
+    {
+        printf("Error truncating LSM log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+
+    return lsm;
+}
+
+void lsm_close(Lsm* lsm)
+{
+    if(lsm == NULL)
+    {
+        return;
+    }
+
+    lsm_compaction_abort(lsm);
+    lsm_flush_memtable(lsm);
+    while(lsm->num_runs > 0)
+    {
+        lsm_run_free(lsm->runs[--lsm->num_runs]);
+    }
+    close(lsm->log_descriptor);
+    free(lsm);
+}
+
+/**
+ * remove every file of a dropped table: runs, manifest and log
+ */
+void lsm_destroy(Lsm* lsm)
+{
+    char name[WAL_PATH_MAX];
+
+    lsm_compaction_abort(lsm);
+    lsm_memtable_clear(lsm);
+    while(lsm->num_runs > 0)
+    {
+        LsmRun* run = lsm->runs[--lsm->num_runs];
+        lsm_file_name(name, lsm, ".sst", run->id);
+        unlink(name);
+        lsm_run_free(run);
+    }
+    lsm_file_name(name, lsm, "", -1);
+    unlink(name);
+    lsm_file_name(name, lsm, "-log", -1);
+    unlink(name);
+
+    close(lsm->log_descriptor);
+    free(lsm);
+}
+
+/**
+ * newest version of key. tombstones count as not found
+ */
+bool lsm_get(Lsm* lsm, const uint8_t* key, char* entry)
+{
+    LsmMemtableNode* node = lsm_memtable_find(lsm, key, NULL);
+    if(node != NULL)
+    {
+        memcpy(entry, node->entry, LSM_ENTRY_SIZE);
+        return !(*lsm_entry_flags(entry) & LSM_TOMBSTONE);
+    }
+
+    for(int i = 0; i < lsm->num_runs; i++)
+    {
+        if(lsm_run_get(lsm->runs[i], key, entry))
+        {
+            return !(*lsm_entry_flags(entry) & LSM_TOMBSTONE);
+        }
+    }
+
+    return false;
+}
+
+/**
+ * log the entry, then add it to the memtable. returns the sequence
+ * number given to the change
+ */
+int lsm_put(Lsm* lsm, char* entry)
+{
+    int record_size = sizeof(int) + LSM_ENTRY_SIZE;
+    char* record = malloc(record_size);
+    *(int*)record = ++lsm->sequence;
+    memcpy(record + sizeof(int), entry, LSM_ENTRY_SIZE);
+
+    if(write(lsm->log_descriptor, record, record_size) != record_size ||
+       fdatasync(lsm->log_descriptor) == -1)
+    {
+        printf("Error writing LSM log: %d\n", errno);
+        exit(EXIT_FAILURE);
+    }
+    free(record);
+
+    lsm_memtable_put(lsm, entry);
+    if(lsm->memtable_entries >= LSM_MEMTABLE_MAX_ENTRIES)
+    {
+        lsm_flush_memtable(lsm);
+    }
+
+    return lsm->sequence;
+}
+
+void print_lsm_stats(Lsm* lsm)
+{
+    printf("lsm sequence: %d memtable entries: %d\n", lsm->sequence,
+           lsm->memtable_entries);
+    for(int level = 0; level < LSM_MAX_LEVELS; level++)
+    {
+        int num_runs;
+        int entries = lsm_level_entries(lsm, level, &num_runs);
+        if(num_runs > 0)
+        {
+            printf("lsm level %d: %d runs, %d entries\n", level, num_runs,
+                   entries);
+        }
+    }
+    if(lsm->compaction != NULL)
+    {
+        printf("lsm compaction into level %d: %d entries written\n",
+               lsm->compaction->output_level,
+               lsm->compaction->writer.run->header.num_entries);
+    }
+}
+
+/**
+ * adaptive radix tree over a table's keys, kept in memory next to the
+ * B-tree. inner nodes grow from 4 to 16, 48 and 256 children as they
+ * fill, and store the bytes all their keys share (path compression).
+ * a child pointer with its low bit set is a leaf
+ */
+typedef enum
+{
+    ART_NODE4,
+    ART_NODE16,
+    ART_NODE48,
+    ART_NODE256
+} ArtNodeType;
+
+typedef struct
+{
+    ArtNodeType type;
+    int num_children;
+    int prefix_length;
+    uint8_t prefix[KEY_SIZE];
+} ArtNode;
+
+typedef struct
+{
+    ArtNode header;
+    uint8_t keys[4];
+    void* children[4];
+} ArtNode4;
+
+typedef struct
+{
+    ArtNode header;
+    uint8_t keys[16];
+    void* children[16];
+} ArtNode16;
+
+typedef struct
+{
+    ArtNode header;
+    uint8_t child_index[256]; // slot + 1, 0 for none
+    void* children[48];
+} ArtNode48;
+
+typedef struct
+{
+    ArtNode header;
+    void* children[256];
+} ArtNode256;
+
+/**
+ * where the row was last found, as in HotKey. lsn is -1 while unknown
+ */
+typedef struct
+{
+    uint8_t key[KEY_SIZE];
+    int page_num;
+    int lsn;
+    int offset;
+} ArtLeaf;
+
+bool art_is_leaf(void* node)
+{
+    return (uintptr_t)node & 1;
+}
+
+ArtLeaf* art_leaf(void* node)
+{
+    return (ArtLeaf*)((uintptr_t)node & ~(uintptr_t)1);
+}
+
+void* art_leaf_new(const uint8_t* key)
+{
+    ArtLeaf* leaf = malloc(sizeof(ArtLeaf));
+    memcpy(leaf->key, key, KEY_SIZE);
+    leaf->lsn = -1;
+
+    return (void*)((uintptr_t)leaf | 1);
+}
+
+ArtNode* art_node_new(ArtNodeType type)
+{
+    static const size_t sizes[] = {sizeof(ArtNode4), sizeof(ArtNode16),
+                                   sizeof(ArtNode48), sizeof(ArtNode256)};
+    ArtNode* node = calloc(1, sizes[type]);
+    node->type = type;
+
+    return node;
+}
+
+void** art_find_child(ArtNode* node, uint8_t byte)
+{
+    switch(node->type)
+    {
+    case ART_NODE4:
+    {
+        ArtNode4* node4 = (ArtNode4*)node;
+        for(int i = 0; i < node->num_children; i++)
+        {
+            if(node4->keys[i] == byte)
+            {
+                return &node4->children[i];
+            }
+        }
+        return NULL;
+    }
+    case ART_NODE16:
+    {
+        ArtNode16* node16 = (ArtNode16*)node;
+        for(int i = 0; i < node->num_children; i++)
+        {
+            if(node16->keys[i] == byte)
+            {
+                return &node16->children[i];
+            }
+        }
+        return NULL;
+    }
+    case ART_NODE48:
+    {
+        ArtNode48* node48 = (ArtNode48*)node;
+        int index = node48->child_index[byte];
+        return index == 0 ? NULL : &node48->children[index - 1];
+    }
+    case ART_NODE256:
+    {
+        ArtNode256* node256 = (ArtNode256*)node;
+        return node256->children[byte] == NULL ? NULL
+                                               : &node256->children[byte];
+    }
+    }
+
+    return NULL;
+}
+
+/**
+ * copy the children of a full node into the next larger type
+ */
+ArtNode* art_node_grow(ArtNode* node)
+{
+    ArtNode* grown = art_node_new(node->type + 1);
+    grown->num_children = node->num_children;
+    grown->prefix_length = node->prefix_length;
+    memcpy(grown->prefix, node->prefix, node->prefix_length);
+
+    switch(node->type)
+    {
+    case ART_NODE4:
+    {
+        ArtNode4* from = (ArtNode4*)node;
+        ArtNode16* to = (ArtNode16*)grown;
+        memcpy(to->keys, from->keys, sizeof(from->keys));
+        memcpy(to->children, from->children, sizeof(from->children));
+        break;
+    }
+    case ART_NODE16:
+    {
+        ArtNode16* from = (ArtNode16*)node;
+        ArtNode48* to = (ArtNode48*)grown;
+        for(int i = 0; i < node->num_children; i++)
+        {
+            to->child_index[from->keys[i]] = i + 1;
+            to->children[i] = from->children[i];
+        }
+        break;
+    }
+    case ART_NODE48:
+    {
+        ArtNode48* from = (ArtNode48*)node;
+        ArtNode256* to = (ArtNode256*)grown;
+        for(int byte = 0; byte < 256; byte++)
+        {
+            if(from->child_index[byte] != 0)
+            {
+                to->children[byte] = from->children[from->child_index[byte] - 1];
+            }
+        }
+        break;
+    }
+    case ART_NODE256:
+        break;
+    }
+
+    free(node);
+    return grown;
+}
+
+void art_add_child(ArtNode** node_ref, uint8_t byte, void* child)
+{
+    static const int capacities[] = {4, 16, 48, 256};
+    ArtNode* node = *node_ref;
+    if(node->num_children == capacities[node->type])
+    {
+        node = art_node_grow(node);
+        *node_ref = node;
+    }
+
+    switch(node->type)
+    {
+    case ART_NODE4:
+        ((ArtNode4*)node)->keys[node->num_children] = byte;
+        ((ArtNode4*)node)->children[node->num_children] = child;
+        break;
+    case ART_NODE16:
+        ((ArtNode16*)node)->keys[node->num_children] = byte;
+        ((ArtNode16*)node)->children[node->num_children] = child;
+        break;
+    case ART_NODE48:
+        ((ArtNode48*)node)->child_index[byte] = node->num_children + 1;
+        ((ArtNode48*)node)->children[node->num_children] = child;
+        break;
+    case ART_NODE256:
+        ((ArtNode256*)node)->children[byte] = child;
+        break;
+    }
+    node->num_children++;
+}
+
+ArtLeaf* art_search(void* node, const uint8_t* key)
+{
+    int depth = 0;
+    while(node != NULL)
+    {
+        if(art_is_leaf(node))
+        {
+            ArtLeaf* leaf = art_leaf(node);
+            return memcmp(leaf->key, key, KEY_SIZE) == 0 ? leaf : NULL;
+        }
+
+        ArtNode* inner = node;
+        if(memcmp(inner->prefix, key + depth, inner->prefix_length) != 0)
+        {
+            return NULL;
+        }
+        depth += inner->prefix_length;
+
+        void** child = art_find_child(inner, key[depth]);
+        if(child == NULL)
+        {
+            return NULL;
+        }
+        node = *child;
+        depth++;
+    }
+
+    return NULL;
+}
+
+/**
+ * the leaf for key, added if it is not there. keys all have KEY_SIZE
+ * bytes, so none is a prefix of another and two keys always part at
+ * some byte
+ */
+ArtLeaf* art_insert(void** node_ref, const uint8_t* key, int depth)
+{
+    void* node = *node_ref;
+    if(node == NULL)
+    {
+        *node_ref = art_leaf_new(key);
+        return art_leaf(*node_ref);
+    }
+
+    if(art_is_leaf(node))
+    {
+        ArtLeaf* existing = art_leaf(node);
+        if(memcmp(existing->key, key, KEY_SIZE) == 0)
+        {
+            return existing;
+        }
+
+        int split = depth;
+        while(existing->key[split] == key[split])
+        {
+            split++;
+        }
+
+        ArtNode* parent = art_node_new(ART_NODE4);
+        parent->prefix_length = split - depth;
+        memcpy(parent->prefix, key + depth, parent->prefix_length);
+        void* leaf = art_leaf_new(key);
+        art_add_child(&parent, existing->key[split], node);
+        art_add_child(&parent, key[split], leaf);
+        *node_ref = parent;
+        return art_leaf(leaf);
+    }
+
+    ArtNode* inner = node;
+    int matched = 0;
+    while(matched < inner->prefix_length &&
+          inner->prefix[matched] == key[depth + matched])
+    {
+        matched++;
+    }
+
+    if(matched < inner->prefix_length)
+    {
+        // the key leaves the shared prefix: split it at that byte
+        ArtNode* parent = art_node_new(ART_NODE4);
+        parent->prefix_length = matched;
+        memcpy(parent->prefix, inner->prefix, matched);
+        art_add_child(&parent, inner->prefix[matched], inner);
+
+        inner->prefix_length -= matched + 1;
+        memmove(inner->prefix, inner->prefix + matched + 1,
+                inner->prefix_length);
+
+        void* leaf = art_leaf_new(key);
+        art_add_child(&parent, key[depth + matched], leaf);
+        *node_ref = parent;
+        return art_leaf(leaf);
+    }
+
+    depth += inner->prefix_length;
+    void** child = art_find_child(inner, key[depth]);
+    if(child != NULL)
+    {
+        return art_insert(child, key, depth + 1);
+    }
+
+    void* leaf = art_leaf_new(key);
+    art_add_child((ArtNode**)node_ref, key[depth], leaf);
+    return art_leaf(leaf);
+}
+
+void art_free(void* node)
+{
+    if(node == NULL)
+    {
+        return;
+    }
+    if(art_is_leaf(node))
+    {
+        free(art_leaf(node));
+        return;
+    }
+
+    ArtNode* inner = node;
+    switch(inner->type)
+    {
+    case ART_NODE4:
+        for(int i = 0; i < inner->num_children; i++)
+        {
+            art_free(((ArtNode4*)inner)->children[i]);
+        }
+        break;
+    case ART_NODE16:
+        for(int i = 0; i < inner->num_children; i++)
+        {
+            art_free(((ArtNode16*)inner)->children[i]);
+        }
+        break;
+    case ART_NODE48:
+        for(int i = 0; i < inner->num_children; i++)
+        {
+            art_free(((ArtNode48*)inner)->children[i]);
+        }
+        break;
+    case ART_NODE256:
+        for(int i = 0; i < 256; i++)
+        {
+            art_free(((ArtNode256*)inner)->children[i]);
+        }
+        break;
+    }
+    free(inner);
+}
+
+/**
+ * where tree_lookup last found a key. the entry holds while the page
+ * still carries the LSN it had then: any change to the page, a split
+ * included, moves the LSN on. a newer version of the key would be queued
+ * above the page instead, so inserting a key drops its entry
+ */
+typedef struct
+{
+    bool used;
+    uint8_t key[KEY_SIZE];
+    int page_num;
+    int lsn;
+    int offset; // of the row within the page
+} HotKey;
+
+/**
+ * what analyze found in a table, for choosing how to read it. the row
+ * count is kept up by writes until the next analyze. the histogram holds
+ * the keys at equal steps through the rows, first and last included
+ */
+typedef struct
+{
+    bool analyzed;
+    int num_rows;
+    int distinct[MAX_COLUMNS];
+    int num_bounds;
+    uint8_t bounds[STATS_HISTOGRAM_BUCKETS + 1][KEY_SIZE];
+} TableStats;
+
+typedef struct Table
+{
+    int num_rows;
+    int id;
+    char name[TABLE_NAME_MAX + 1];
+    Pager* pager;
+    int root_page_num;
+    TableEngine engine;
+    RowFormat format;
+    Lsm* lsm; // only for TABLE_ENGINE_LSM
+    HotKey* hot_keys; // direct mapped, only for TABLE_ENGINE_BTREE
+    bool has_art;     // --index art
+    void* art;        // every key of the table
+    int hot_key_hits;
+    int hot_key_misses;
+    int version; // bumped by every write, for the result cache
+    TableStats stats;
+    // a range partitioned table has no tree of its own. each partition is
+    // a table with its own file, pager and WAL, holding the keys from its
+    // lower bound up to the next partition's
+    int num_partitions;
+    struct Table* partitions[MAX_PARTITIONS];
+    uint8_t partition_bounds[MAX_PARTITIONS][KEY_SIZE];
+} Table;
+
+/**
+ * rows a select returned, valid while the table's version is unchanged
+ */
+typedef struct
+{
+    bool used;
+    char statement[STATEMENT_TEXT_MAX]; // normalized
+    int table_id;
+    int version;
+    int num_rows;
+    char* rows;
+} CachedResult;
+
+/**
+ * a prepared statement, found again by its normalized text. it holds as
+ * long as its table is still the one it was prepared against
+ */
+typedef struct
+{
+    bool used;
+    unsigned int used_at;
+    int table_id;
+    int executions; // compiled once it reaches JIT_HOT_EXECUTIONS
+    Statement statement;
+} CachedPlan;
+
+/**
+ * every table of a database lives in the same file and shares its pager.
+ * the catalog is a B-tree of its own, rooted at page 0, that maps a table
+ * id to a CatalogEntry. it is read into tables[] when the database opens
+ */
+typedef struct
+{
+    char path[WAL_PATH_MAX];
+    Pager* pager;
+    Table* catalog;
+    int num_tables;
+    Table* tables[MAX_TABLES];
+    int next_table_id;
+    Cdc* cdc; // NULL unless changes are captured
+    int cache_pages; // page cache size of every pager
+    struct Router* router; // NULL unless this process routes to shards
+    bool is_shard; // rows are printed after their key, for the router
+    bool art_index;
+    CachedResult results[RESULT_CACHE_SLOTS]; // direct mapped
+    int result_hits;
+    int result_misses;
+    CachedPlan plans[PLAN_CACHE_SLOTS]; // least recently used goes first
+    unsigned int plan_clock;
+    int plan_hits;
+    int plan_misses;
+    bool jit; // compile the predicates of hot plans
+    int jit_compiled;
+} Database;
+
+typedef struct Router
+{
+    int num_shards;
+    int sockets[MAX_SHARDS];
+    pid_t pids[MAX_SHARDS];
+    // shards of the inserts sent but not answered yet, oldest first. a
+    // shard has one at most, as reading an answer may read into the next
+    int in_flight[MAX_SHARDS];
+    int num_in_flight;
+} Router;
+
+/**
+ * catalog row, stored in the value of the catalog's cells. a dropped
+ * table keeps its row, marked dropped, until a new table takes its id.
+ * each partition of a partitioned table has a row of its own after the
+ * table's, which holds its lower bound where tables hold their schema
+ */
+typedef struct
+{
+    char name[TABLE_NAME_MAX + 1];
+    int engine;
+    int root_page_num; // unused by LSM and partitioned tables
+    int dropped;
+    union
+    {
+        Schema schema;
+        uint8_t lower_bound[KEY_SIZE]; // partition rows
+    };
+    int num_partitions; // 0 unless range partitioned
+    int partition_of;   // id of the partitioned table, 0 for tables
+} CatalogEntry;
+
+typedef struct
+{
+    Table* table;
+    int row_num;
+    int page_num;
+    int cell_num;
+    bool end_of_table;
+    bool end_of_leaves; // the leaf position is past the last cell
+    char* messages;     // buffered rows a scan merges with the leaves
+    int num_messages;
+    int message_num;
+    LsmMerge* lsm_merge; // position of an LSM cursor
+} Cursor;
+
+Cursor* leaf_node_find(Table* table, int page_num, const void* key)
+{
+    void* node = get_page(table->pager, page_num);
+    int num_cells = *leaf_node_num_cells(node);
+
+    Cursor* cursor = malloc(sizeof(Cursor));
+    cursor->table = table;
+    cursor->page_num = page_num;
+    cursor->end_of_leaves = false;
+    cursor->messages = NULL;
+    cursor->num_messages = 0;
+    cursor->message_num = 0;
+    cursor->lsm_merge = NULL;
+    cursor->cell_num = key_lower_bound(leaf_node_key(node, 0),
+                                       LEAF_NODE_CELL_SIZE, num_cells, key);
+
+    return cursor;
+}
+
+/**
+ * return the index of the child which should contain the given key
+ */
+int internal_node_find_child(void* node, const void* key)
+{
+    int num_keys = *internal_node_num_keys(node);
+
+    // binary search
+    int min_index = 0;
+    int max_index = num_keys; // there is one more child than key
+    while(min_index != max_index)
+    {
+        int index = (min_index + max_index) / 2;
+        if(key_compare(internal_node_key(node, index), key) >= 0)
+        {
+            max_index = index;
+        }
+        else
+        {
+            min_index = index + 1;
+        }
+    }
+
+    return min_index;
+}
+
+/**
+ * lay the keys of node out in Eytzinger order: an in-order walk of the
+ * implicit tree visits positions in key order
+ */
+int node_search_tree_fill(NodeSearchTree* tree, void* node, int index,
+                          int position)
+{
+    if(position > tree->num_keys)
+    {
+        return index;
+    }
+
+    index = node_search_tree_fill(tree, node, index, 2 * position);
+    memcpy(tree->keys + position * KEY_SIZE, internal_node_key(node, index),
+           KEY_SIZE);
+    tree->sorted_index[position] = index;
+    return node_search_tree_fill(tree, node, index + 1, 2 * position + 1);
+}
+
+NodeSearchTree* node_search_tree_build(void* node)
+{
+    NodeSearchTree* tree = malloc(sizeof(NodeSearchTree));
+    tree->num_keys = *internal_node_num_keys(node);
+    tree->keys = malloc((tree->num_keys + 1) * KEY_SIZE);
+    tree->sorted_index = malloc((tree->num_keys + 1) * sizeof(int));
+    node_search_tree_fill(tree, node, 0, 1);
+
+    return tree;
+}
+
+/**
+ * internal_node_find_child for the search paths. large nodes are searched
+ * through their Eytzinger copy: the descent is branch free and the keys
+ * four levels down are fetched while the current one is compared
+ */
+int internal_node_search(Pager* pager, int page_num, const void* key)
+{
+    void* node = get_page(pager, page_num);
+    int num_keys = *internal_node_num_keys(node);
+    if(num_keys < NODE_SEARCH_TREE_MIN_KEYS)
+    {
+        return internal_node_find_child(node, key);
+    }
+
+    NodeSearchTree* tree = pager->search_trees[page_num];
+    if(tree == NULL)
+    {
+        tree = node_search_tree_build(node);
+        pager->search_trees[page_num] = tree;
+    }
+
+    int position = 1;
+    while(position <= num_keys)
+    {
+        __builtin_prefetch(tree->keys + 16 * position * KEY_SIZE);
+        position = 2 * position +
+                   (key_compare(tree->keys + position * KEY_SIZE, key) < 0);
+    }
+
+    // undo the right turns after the last left turn, which was at the
+    // first key >= key
+    position >>= __builtin_ffs(~position);
+
+    return position == 0 ? num_keys : tree->sorted_index[position];
+}
+
+Cursor* internal_node_find(Table* table, int page_num, const void* key)
+{
+    void* node = get_page(table->pager, page_num);
+
+    int child_index = internal_node_search(table->pager, page_num, key);
+    int child_num = *internal_node_child(node, child_index);
+    void* child = get_page(table->pager, child_num);
+
+    switch(get_node_type(child))
+    {
+    case NODE_LEAF:
+        return leaf_node_find(table, child_num, key);
+    case NODE_INTERNAL:
+        return internal_node_find(table, child_num, key);
+    }
+
+    return NULL;
+}
+
+/**
+ * queued message for key in an internal node's buffer, NULL if none
+ */
+void* internal_node_find_message(void* node, const void* key)
+{
+    int num_messages = *internal_node_num_messages(node);
+    for(int i = 0; i < num_messages; i++)
+    {
+        void* message = internal_node_message(node, i);
+        if(key_compare(message_key(message), key) == 0)
+        {
+            return message;
+        }
+    }
+
+    return NULL;
+}
+
+HotKey* hot_key_slot(Table* table, const void* key)
+{
+    return &table->hot_keys[lsm_hash(key) % HOT_KEY_CACHE_SLOTS];
+}
+
+void hot_key_forget(Table* table, const void* key)
+{
+    HotKey* slot = hot_key_slot(table, key);
+    if(slot->used && key_compare(slot->key, key) == 0)
+    {
+        slot->used = false;
+    }
+}
+
+/**
+ * point lookup. the newest version of a row is the first one met on the
+ * way down: a message in a buffer, otherwise the leaf cell.
+ * returns the serialized row or NULL
+ */
+void* tree_lookup_uncached(Table* table, const void* key, int* found_page_num)
+{
+    int page_num = table->root_page_num;
+    void* node = get_page(table->pager, page_num);
+
+    while(get_node_type(node) == NODE_INTERNAL)
+    {
+        void* message = internal_node_find_message(node, key);
+        if(message != NULL)
+        {
+            *found_page_num = page_num;
+            return message_value(message);
+        }
+
+        page_num = *internal_node_child(
+            node, internal_node_search(table->pager, page_num, key));
+        node = get_page(table->pager, page_num);
+    }
+
+    Cursor* cursor = leaf_node_find(table, page_num, key);
+    void* value = NULL;
+    if(cursor->cell_num < *leaf_node_num_cells(node) &&
+       key_compare(leaf_node_key(node, cursor->cell_num), key) == 0)
+    {
+        value = leaf_node_value(node, cursor->cell_num);
+    }
+    free(cursor);
+
+    *found_page_num = page_num;
+    return value;
+}
+
+/**
+ * the ART holds every key, so a key it lacks is not in the table and
+ * costs no page at all. a key it has is read where it was last found
+ * while that page is unchanged
+ */
+void* art_tree_lookup(Table* table, const void* key)
+{
+    ArtLeaf* leaf = art_search(table->art, key);
+    if(leaf == NULL)
+    {
+        return NULL;
+    }
+    if(leaf->lsn >= 0)
+    {
+        void* page = get_page(table->pager, leaf->page_num);
+        if(*page_lsn(page) == leaf->lsn)
+        {
+            return page + leaf->offset;
+        }
+    }
+
+    int page_num;
+    void* value = tree_lookup_uncached(table, key, &page_num);
+    if(value == NULL)
+    {
+        return NULL;
+    }
+    void* page = get_page(table->pager, page_num);
+    leaf->page_num = page_num;
+    leaf->lsn = *page_lsn(page);
+    leaf->offset = value - page;
+
+    return value;
+}
+
+/**
+ * tree_lookup_uncached behind the table's hot key cache. a hit costs one
+ * page instead of a descent
+ */
+void* tree_lookup(Table* table, const void* key)
+{
+    if(table->has_art)
+    {
+        return art_tree_lookup(table, key);
+    }
+
+    HotKey* slot = hot_key_slot(table, key);
+    if(slot->used && key_compare(slot->key, key) == 0)
+    {
+        void* page = get_page(table->pager, slot->page_num);
+        if(*page_lsn(page) == slot->lsn)
+        {
+            table->hot_key_hits++;
+            return page + slot->offset;
+        }
+    }
+    table->hot_key_misses++;
+
+    int page_num;
+    void* value = tree_lookup_uncached(table, key, &page_num);
+    if(value != NULL)
+    {
+        void* page = get_page(table->pager, page_num);
+        slot->used = true;
+        memcpy(slot->key, key, KEY_SIZE);
+        slot->page_num = page_num;
+        slot->lsn = *page_lsn(page);
+        slot->offset = value - page;
+    }
+
+    return value;
+}
+
+/**
+ * number of internal levels above the leaves
+ */
+int tree_height(Table* table)
+{
+    void* node = get_page(table->pager, table->root_page_num);
+    int height = 0;
+
+    while(get_node_type(node) == NODE_INTERNAL)
+    {
+        node = get_page(table->pager, *internal_node_child(node, 0));
+        height += 1;
+    }
+
+    return height;
+}
+
+/**
+ * a merge from the first entry whose key is at least key. the memtable
+ * is searched as a skip list, each run starts at the block its sparse
+ * index points to
+ */
+Cursor* lsm_table_seek(Table* table, const uint8_t* key)
+{
+    Cursor* cursor = malloc(sizeof(Cursor));
+    Lsm* lsm = table->lsm;
+
+    cursor->table = table;
+    cursor->messages = NULL;
+    cursor->lsm_merge = malloc(sizeof(LsmMerge));
+    lsm_merge_init(cursor->lsm_merge, true);
+    lsm_merge_add_memtable(cursor->lsm_merge, lsm);
+    LsmMemtableNode* update[LSM_SKIPLIST_MAX_HEIGHT];
+    lsm_memtable_find(lsm, key, update);
+    cursor->lsm_merge->sources[0].node = update[0]->next[0];
+    for(int i = 0; i < lsm->num_runs; i++)
+    {
+        LsmRun* run = lsm->runs[i];
+        lsm_merge_add_run(cursor->lsm_merge, run);
+
+        // last index key <= key
+        int index =
+            key_lower_bound(run->index, KEY_SIZE, run->header.num_index, key);
+        if(index == run->header.num_index ||
+           key_compare(run->index + index * KEY_SIZE, key) > 0)
+        {
+            index--;
+        }
+        if(index > 0)
+        {
+            cursor->lsm_merge->sources[i + 1].position =
+                index * LSM_INDEX_INTERVAL;
+        }
+    }
+
+    LsmMerge* merge = cursor->lsm_merge;
+    do
+    {
+        lsm_merge_next(merge);
+    } while(!merge->end && key_compare(lsm_entry_key(merge->entry), key) < 0);
+    cursor->end_of_table = merge->end;
+
+    return cursor;
+}
+
+/**
+ * gather the messages from lower to upper (NULL for no bound) buffered in
+ * the subtree at page_num, whose internal levels number height. only the
+ * children whose keys can fall in the bounds are visited, and the leaves
+ * are not read at all
+ */
+void collect_messages(Cursor* cursor, int page_num, int depth, int height,
+                      const uint8_t* lower, const uint8_t* upper)
+{
+    Pager* pager = cursor->table->pager;
+    void* node = get_page(pager, page_num);
+
+    // each collected message is prefixed with the depth it was found at
+    int record_size = sizeof(int) + MESSAGE_SIZE;
+    int num_messages = *internal_node_num_messages(node);
+    cursor->messages = realloc(cursor->messages, (cursor->num_messages +
+                                                  num_messages) *
+                                                     record_size);
+    for(int i = 0; i < num_messages; i++)
+    {
+        void* message = internal_node_message(node, i);
+        if(key_compare(message_key(message), lower) < 0 ||
+           (upper != NULL && key_compare(message_key(message), upper) > 0))
+        {
+            continue;
+        }
+        char* record = cursor->messages + cursor->num_messages * record_size;
+        memcpy(record, &depth, sizeof(int));
+        memcpy(record + sizeof(int), message, MESSAGE_SIZE);
+        cursor->num_messages += 1;
+    }
+
+    if(height == 1)
+    {
+        return;
+    }
+    int first = internal_node_search(pager, page_num, lower);
+    int last = upper != NULL ? internal_node_search(pager, page_num, upper)
+                             : *internal_node_num_keys(node);
+    for(int i = first; i <= last; i++)
+    {
+        node = get_page(pager, page_num);
+        collect_messages(cursor, *internal_node_child(node, i), depth + 1,
+                         height - 1, lower, upper);
+    }
+}
+
+int compare_collected_messages(const void* a, const void* b)
+{
+    int comparison = key_compare(message_key((char*)a + sizeof(int)),
+                                 message_key((char*)b + sizeof(int)));
+    if(comparison != 0)
+    {
+        return comparison;
+    }
+
+    int depth_a;
+    int depth_b;
+    memcpy(&depth_a, a, sizeof(int));
+    memcpy(&depth_b, b, sizeof(int));
+
+    return depth_a - depth_b;
+}
+
+/**
+ * a scan has to see the rows still queued in internal node buffers.
+ * those from lower to upper are gathered, sorted and merged with the
+ * leaves; when a key is queued more than once the message nearest the
+ * root is the newest
+ */
+void cursor_load_messages(Cursor* cursor, const uint8_t* lower,
+                          const uint8_t* upper)
+{
+    Table* table = cursor->table;
+    cursor->messages = NULL;
+    cursor->num_messages = 0;
+    cursor->message_num = 0;
+
+    // the internal levels, counted down the path the seek just took
+    int height = 0;
+    int page_num = table->root_page_num;
+    void* node = get_page(table->pager, page_num);
+    while(get_node_type(node) == NODE_INTERNAL)
+    {
+        page_num = *internal_node_child(
+            node, internal_node_search(table->pager, page_num, lower));
+        node = get_page(table->pager, page_num);
+        height++;
+    }
+    if(height > 0)
+    {
+        collect_messages(cursor, table->root_page_num, 0, height, lower,
+                         upper);
+    }
+
+    if(cursor->num_messages == 0)
+    {
+        return;
+    }
+    int record_size = sizeof(int) + MESSAGE_SIZE;
+    qsort(cursor->messages, cursor->num_messages, record_size,
+          compare_collected_messages);
+
+    int num_unique = 0;
+    for(int i = 0; i < cursor->num_messages; i++)
+    {
+        char* message = cursor->messages + i * record_size + sizeof(int);
+        if(num_unique > 0 &&
+           key_compare(message_key(cursor->messages +
+                                   (num_unique - 1) * MESSAGE_SIZE),
+                       message_key(message)) == 0)
+        {
+            continue;
+        }
+        memmove(cursor->messages + num_unique * MESSAGE_SIZE, message,
+                MESSAGE_SIZE);
+        num_unique += 1;
+    }
+    cursor->num_messages = num_unique;
+}
+
+/**
+ * a scan position is on a buffered message when the message sorts before
+ * the leaf cell, or replaces it
+ */
+bool cursor_on_message(Cursor* cursor)
+{
+    if(cursor->message_num >= cursor->num_messages)
+    {
+        return false;
+    }
+    if(cursor->end_of_leaves)
+    {
+        return true;
+    }
+
+    void* node = get_page(cursor->table->pager, cursor->page_num);
+    void* message = cursor->messages + cursor->message_num * MESSAGE_SIZE;
+
+    return key_compare(message_key(message),
+                       leaf_node_key(node, cursor->cell_num)) <= 0;
+}
+
+void cursor_update_end(Cursor* cursor)
+{
+    cursor->end_of_table = cursor->end_of_leaves &&
+                           cursor->message_num >= cursor->num_messages;
+}
+
+/**
+ * return the position of the given key
+ * if the key is not present, return the position where it should be inserted
+ */
+Cursor* table_find(Table* table, const void* key)
+{
+    int root_page_num = table->root_page_num;
+    void* root_node = get_page(table->pager, root_page_num);
+
+    if(get_node_type(root_node) == NODE_LEAF)
+    {
+        return leaf_node_find(table, root_page_num, key);
+    }
+    else
+    {
+        return internal_node_find(table, root_page_num, key);
+    }
+}
+
+/**
+ * a scan from the first row whose key is at least key. with upper set,
+ * the messages past it are left out: the caller stops there anyway
+ */
+Cursor* table_seek(Table* table, const uint8_t* key, const uint8_t* upper)
+{
+    if(table->engine == TABLE_ENGINE_LSM)
+    {
+        return lsm_table_seek(table, key);
+    }
+
+    Cursor* cursor = table_find(table, key);
+
+    // past the last cell of its leaf, the row is the next leaf's first
+    void* node = get_page(table->pager, cursor->page_num);
+    cursor->end_of_leaves = false;
+    if(cursor->cell_num >= *leaf_node_num_cells(node))
+    {
+        int next_page_num = *leaf_node_next_leaf(node);
+        cursor->end_of_leaves = next_page_num == 0;
+        if(next_page_num != 0)
+        {
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
+        }
+    }
+
+    cursor_load_messages(cursor, key, upper);
+    while(cursor->message_num < cursor->num_messages &&
+          key_compare(message_key(cursor->messages +
+                                  cursor->message_num * MESSAGE_SIZE),
+                      key) < 0)
+    {
+        cursor->message_num++;
+    }
+    cursor_update_end(cursor);
+
+    return cursor;
+}
+
+Cursor* table_start(Table* table)
+{
+    // no encoded key sorts below all zeroes
+    uint8_t first_key[KEY_SIZE] = {0};
+
+    return table_seek(table, first_key, NULL);
+}
+
+void leaf_cursor_advance(Cursor* cursor)
+{
+    int page_num = cursor->page_num;
+    void* node = get_page(cursor->table->pager, page_num);
+
+    cursor->cell_num += 1;
+    if(cursor->cell_num >= (*leaf_node_num_cells(node)))
+    {
+        // advance to next leaf node
+        int next_page_num = *leaf_node_next_leaf(node);
+        pager_use_once(cursor->table->pager, page_num);
+        if(next_page_num == 0)
+        {
+            // this was the rightmost leaf
+            cursor->end_of_leaves = true;
+        }
+        else
+        {
+            cursor->page_num = next_page_num;
+            cursor->cell_num = 0;
+        }
+    }
+}
+
+void cursor_advance(Cursor* cursor)
+{
+    if(cursor->lsm_merge != NULL)
+    {
+        lsm_merge_next(cursor->lsm_merge);
+        cursor->end_of_table = cursor->lsm_merge->end;
+        return;
+    }
+
+    if(cursor_on_message(cursor))
+    {
+        void* message = cursor->messages + cursor->message_num * MESSAGE_SIZE;
+        void* node = get_page(cursor->table->pager, cursor->page_num);
+        if(!cursor->end_of_leaves &&
+           key_compare(leaf_node_key(node, cursor->cell_num),
+                       message_key(message)) == 0)
+        {
+            leaf_cursor_advance(cursor);
+        }
+        cursor->message_num += 1;
+    }
+    else
+    {
+        leaf_cursor_advance(cursor);
+    }
+
+    cursor_update_end(cursor);
+}
+
+void* cursor_value(Cursor* cursor)
+{
+    if(cursor->lsm_merge != NULL)
+    {
+        return lsm_entry_value(cursor->lsm_merge->entry);
+    }
+    if(cursor_on_message(cursor))
+    {
+        return message_value(cursor->messages +
+                             cursor->message_num * MESSAGE_SIZE);
+    }
+
+    int page_num = cursor->page_num;
+    void* page = get_page(cursor->table->pager, page_num);
+
+    return leaf_node_value(page, cursor->cell_num);
+}
+
+void* cursor_key(Cursor* cursor)
+{
+    if(cursor->lsm_merge != NULL)
+    {
+        return lsm_entry_key(cursor->lsm_merge->entry);
+    }
+    if(cursor_on_message(cursor))
+    {
+        return message_key(cursor->messages +
+                           cursor->message_num * MESSAGE_SIZE);
+    }
+
+    void* page = get_page(cursor->table->pager, cursor->page_num);
+
+    return leaf_node_key(page, cursor->cell_num);
+}
+
+void cursor_close(Cursor* cursor)
+{
+    if(cursor->lsm_merge != NULL)
+    {
+        lsm_merge_free(cursor->lsm_merge);
+        free(cursor->lsm_merge);
+    }
+    free(cursor->messages);
+    free(cursor);
+}
+
+/**
+ * pages left behind by dropped tables are handed out before the file grows
+ */
+int get_unused_page_num(Pager* pager)
+{
+    if(pager->num_free_pages > 0)
+    {
+        return pager->free_pages[--pager->num_free_pages];
+    }
+
+    return pager->num_pages;
+}
+
+void create_new_root(Table* table, int right_child_page_num)
+{
+    /**
+     * handle splitting the root.
+     * old root copied to new page, becomes left child.
+     * address of right child passed in.
+     * re-initialize root page to contain the new root node.
+     * new root node points to two children.
+     */
+    Pager* pager = table->pager;
+    void* root = get_page(pager, table->root_page_num);
+
+    int left_child_page_num = get_unused_page_num(pager);
+
+    void* right_child = get_page(pager, right_child_page_num);
+    void* left_child = get_page(pager, left_child_page_num);
+
+    pager_mark_dirty(pager, table->root_page_num);
+    pager_mark_dirty(pager, right_child_page_num);
+    memcpy(left_child, root, PAGE_SIZE);
+    set_node_root(left_child, false);
+    pager_mark_dirty(pager, left_child_page_num);
+
+    // the old root's buffer moved with it, its children get a new parent
+    if(get_node_type(left_child) == NODE_INTERNAL)
+    {
+        for(int i = 0; i <= *internal_node_num_keys(left_child); i++)
+        {
+            int child_page_num = *internal_node_child(left_child, i);
+            pager_mark_dirty(pager, child_page_num);
+            *node_parent(get_page(pager, child_page_num)) =
+                left_child_page_num;
+        }
+    }
+
+    initialize_internal_node(root);
+    set_node_root(root, true);
+    *internal_node_num_keys(root) = 1;
+    *internal_node_child(root, 0) = left_child_page_num;
+    memcpy(internal_node_key(root, 0), get_node_max_key(pager, left_child),
+           KEY_SIZE);
+    *internal_node_right_child(root) = right_child_page_num;
+    *node_parent(left_child) = table->root_page_num;
+    *node_parent(right_child) = table->root_page_num;
+}
+
+void update_internal_node_key(Pager* pager, int page_num,
+                              const void* old_key, const void* new_key)
+{
+    void* node = get_page(pager, page_num);
+    int old_child_index = internal_node_find_child(node, old_key);
+
+    // the right child has no key of its own
+    if(old_child_index < *internal_node_num_keys(node))
+    {
+        pager_mark_dirty(pager, page_num);
+        memcpy(internal_node_key(node, old_child_index), new_key, KEY_SIZE);
+    }
+}
+
+void internal_node_split_and_insert(Table* table, int page_num,
+                                    int child_page_num);
+
+/**
+ * add a new child/key pair to parent that corresponds to child
+ */
+void internal_node_insert(Table* table, int parent_page_num,
+                          int child_page_num)
+{
+    Pager* pager = table->pager;
+    void* parent = get_page(pager, parent_page_num);
+    void* child = get_page(pager, child_page_num);
+    uint8_t child_max_key[KEY_SIZE];
+    memcpy(child_max_key, get_node_max_key(pager, child), KEY_SIZE);
+    int index = internal_node_find_child(parent, child_max_key);
+
+    int original_num_keys = *internal_node_num_keys(parent);
+    if(original_num_keys >= INTERNAL_NODE_MAX_CELLS)
+    {
+        internal_node_split_and_insert(table, parent_page_num,
+                                       child_page_num);
+        return;
+    }
+
+    pager_mark_dirty(pager, parent_page_num);
+    pager_mark_dirty(pager, child_page_num);
+    *node_parent(child) = parent_page_num;
+
+    int right_child_page_num = *internal_node_right_child(parent);
+    void* right_child = get_page(pager, right_child_page_num);
+
+    *internal_node_num_keys(parent) = original_num_keys + 1;
+    if(key_compare(child_max_key, get_node_max_key(pager, right_child)) > 0)
+    {
+        // replace right child
+        *internal_node_child(parent, original_num_keys) = right_child_page_num;
+        memcpy(internal_node_key(parent, original_num_keys),
+               get_node_max_key(pager, right_child), KEY_SIZE);
+        *internal_node_right_child(parent) = child_page_num;
+    }
+    else
+    {
+        // make room for the new cell
+        for(int i = original_num_keys; i > index; i--)
+        {
+            memcpy(internal_node_cell(parent, i),
+                   internal_node_cell(parent, i - 1), INTERNAL_NODE_CELL_SIZE);
+        }
+        *internal_node_child(parent, index) = child_page_num;
+        memcpy(internal_node_key(parent, index), child_max_key, KEY_SIZE);
+    }
+}
+
+/**
+ * rewrite an internal node to hold the given children. keys[i] is the
+ * max key of children[i]; the last child becomes the right child
+ */
+void internal_node_set_children(Pager* pager, int page_num, int* children,
+                                uint8_t* keys, int num_children)
+{
+    void* node = get_page(pager, page_num);
+
+    *internal_node_num_keys(node) = num_children - 1;
+    for(int i = 0; i < num_children - 1; i++)
+    {
+        *internal_node_child(node, i) = children[i];
+        memcpy(internal_node_key(node, i), keys + i * KEY_SIZE, KEY_SIZE);
+    }
+    *internal_node_right_child(node) = children[num_children - 1];
+
+    for(int i = 0; i < num_children; i++)
+    {
+        void* child = get_page(pager, children[i]);
+        if(*node_parent(child) != page_num)
+        {
+            pager_mark_dirty(pager, children[i]);
+            *node_parent(child) = page_num;
+        }
+    }
+}
+
+void internal_node_split_and_insert(Table* table, int page_num,
+                                    int child_page_num)
+{
+    /**
+     * create a new node and move the upper half of the children over,
+     * together with the messages queued for them.
+     * update parent or create a new parent
+     */
+    Pager* pager = table->pager;
+    void* old_node = get_page(pager, page_num);
+    uint8_t old_max[KEY_SIZE];
+    uint8_t child_max[KEY_SIZE];
+    memcpy(old_max, get_node_max_key(pager, old_node), KEY_SIZE);
+    memcpy(child_max,
+           get_node_max_key(pager, get_page(pager, child_page_num)), KEY_SIZE);
+
+    int num_keys = *internal_node_num_keys(old_node);
+    int num_children = num_keys + 2;
+    int* children = malloc(num_children * sizeof(int));
+    uint8_t* keys = malloc(num_children * KEY_SIZE);
+
+    int count = 0;
+    bool inserted = false;
+    for(int i = 0; i <= num_keys; i++)
+    {
+        int page = *internal_node_child(old_node, i);
+        void* key = i < num_keys
+                        ? internal_node_key(old_node, i)
+                        : get_node_max_key(pager, get_page(pager, page));
+        if(!inserted && key_compare(child_max, key) < 0)
+        {
+            children[count] = child_page_num;
+            memcpy(keys + count++ * KEY_SIZE, child_max, KEY_SIZE);
+            inserted = true;
+        }
+        children[count] = page;
+        memcpy(keys + count++ * KEY_SIZE, key, KEY_SIZE);
+    }
+    if(!inserted)
+    {
+        children[count] = child_page_num;
+        memcpy(keys + count++ * KEY_SIZE, child_max, KEY_SIZE);
+    }
+
+    int new_page_num = get_unused_page_num(pager);
+    void* new_node = get_page(pager, new_page_num);
+    old_node = get_page(pager, page_num);
+    pager_mark_dirty(pager, page_num);
+    pager_mark_dirty(pager, new_page_num);
+    initialize_internal_node(new_node);
+    *node_parent(new_node) = *node_parent(old_node);
+
+    int left_count = num_children / 2;
+    uint8_t left_max[KEY_SIZE];
+    memcpy(left_max, keys + (left_count - 1) * KEY_SIZE, KEY_SIZE);
+    internal_node_set_children(pager, page_num, children, keys, left_count);
+    internal_node_set_children(pager, new_page_num, children + left_count,
+                               keys + left_count * KEY_SIZE,
+                               num_children - left_count);
+    free(children);
+    free(keys);
+
+    int num_messages = *internal_node_num_messages(old_node);
+    int num_kept = 0;
+    for(int i = 0; i < num_messages; i++)
+    {
+        void* message = internal_node_message(old_node, i);
+        void* destination;
+        if(key_compare(message_key(message), left_max) > 0)
+        {
+            destination = internal_node_message(
+                new_node, (*internal_node_num_messages(new_node))++);
+        }
+        else
+        {
+            destination = internal_node_message(old_node, num_kept++);
+        }
+        memmove(destination, message, MESSAGE_SIZE);
+    }
+    *internal_node_num_messages(old_node) = num_kept;
+
+    if(is_node_root(old_node))
+    {
+        create_new_root(table, new_page_num);
+    }
+    else
+    {
+        int parent_page_num = *node_parent(old_node);
+        update_internal_node_key(pager, parent_page_num, old_max, left_max);
+        internal_node_insert(table, parent_page_num, new_page_num);
+    }
+}
+
+void leaf_node_split_and_insert(Cursor* cursor, const void* key, void* value)
+{
+    /**
+     * create a new node and move half the cells over
+     * insert the new value in one of the two nodes
+     * update parent or create a new parent
+     */
+    Pager* pager = cursor->table->pager;
+    void* old_node = get_page(pager, cursor->page_num);
+    uint8_t old_max[KEY_SIZE];
+    memcpy(old_max, get_node_max_key(pager, old_node), KEY_SIZE);
+    int new_num_page = get_unused_page_num(pager);
+
+    void* new_node = get_page(pager, new_num_page);
+
+    pager_mark_dirty(pager, cursor->page_num);
+    pager_mark_dirty(pager, new_num_page);
+    initialize_leaf_node(new_node);
+    *node_parent(new_node) = *node_parent(old_node);
+    *leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
+    *leaf_node_next_leaf(old_node) = new_num_page;
+
+    for(int i = LEAF_NODE_MAX_CELLS; i >= 0; i--)
+    {
+        void* destination_node;
+
+        if(i >= LEAF_NODE_LEFT_SPLIT_COUNT)
+        {
+            destination_node = new_node;
+        }
+        else
+        {
+            destination_node = old_node;
+        }
+
+        int index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
+        void* destination = leaf_node_cell(destination_node, index_within_node);
+
+        if(i == cursor->cell_num)
+        {
+            memcpy(destination + LEAF_NODE_KEY_OFFSET, key, KEY_SIZE);
+            memcpy(destination + LEAF_NODE_VALUE_OFFSET, value,
+                   LEAF_NODE_VALUE_SIZE);
+        }
+        else if(i > cursor->cell_num)
+        {
+            memcpy(destination, leaf_node_cell(old_node, i - 1),
+                   LEAF_NODE_CELL_SIZE);
+        }
+        else
+        {
+            memcpy(destination, leaf_node_cell(old_node, i),
+                   LEAF_NODE_CELL_SIZE);
+        }
+    }
+
+    /**
+     * update cell count on both leaf nodes
+     */
+    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
+    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+
+    if(is_node_root(old_node))
+    {
+        create_new_root(cursor->table, new_num_page);
+    }
+    else
+    {
+        int parent_page_num = *node_parent(old_node);
+        update_internal_node_key(pager, parent_page_num, old_max,
+                                 get_node_max_key(pager, old_node));
+        internal_node_insert(cursor->table, parent_page_num, new_num_page);
+    }
+}
+
+void leaf_node_insert(Cursor* cursor, const void* key, void* value)
+{
+    void* node = get_page(cursor->table->pager, cursor->page_num);
+
+    int num_cells = *leaf_node_num_cells(node);
+    if(num_cells >= LEAF_NODE_MAX_CELLS)
+    {
+        // node full
+        leaf_node_split_and_insert(cursor, key, value);
+        return;
+    }
+
+    pager_mark_dirty(cursor->table->pager, cursor->page_num);
+
+    if(cursor->cell_num < num_cells)
+    {
+        // make room for new cell
+        for(int i = num_cells; i > cursor->cell_num; i--)
+        {
+            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
+                   LEAF_NODE_CELL_SIZE);
+        }
+    }
+
+    *(leaf_node_num_cells(node)) += 1;
+    memcpy(leaf_node_key(node, cursor->cell_num), key, KEY_SIZE);
+
+    memcpy(leaf_node_value(node, cursor->cell_num), value,
+           LEAF_NODE_VALUE_SIZE);
+}
+
+/**
+ * apply a message to the leaf holding its key: insert the row, or
+ * replace an older version of it
+ */
+void leaf_node_apply_message(Table* table, int page_num, void* message)
+{
+    void* key = message_key(message);
+    void* node = get_page(table->pager, page_num);
+    Cursor* cursor = leaf_node_find(table, page_num, key);
+
+    if(cursor->cell_num < *leaf_node_num_cells(node) &&
+       key_compare(leaf_node_key(node, cursor->cell_num), key) == 0)
+    {
+        pager_mark_dirty(table->pager, page_num);
+        memcpy(leaf_node_value(node, cursor->cell_num), message_value(message),
+               LEAF_NODE_VALUE_SIZE);
+    }
+    else
+    {
+        leaf_node_insert(cursor, key, message_value(message));
+    }
+
+    free(cursor);
+}
+
+/**
+ * queue a message in an internal node that has room for it. a message
+ * for a key that is already queued replaces the older one
+ */
+void internal_node_buffer_message(Pager* pager, int page_num, void* message)
+{
+    void* node = get_page(pager, page_num);
+    void* destination = internal_node_find_message(node, message_key(message));
+
+    pager_mark_buffer_dirty(pager, page_num);
+    if(destination == NULL)
+    {
+        int* num_messages = internal_node_num_messages(node);
+        destination = internal_node_message(node, (*num_messages)++);
+    }
+    memcpy(destination, message, MESSAGE_SIZE);
+}
+
+void internal_node_flush(Table* table, int page_num, int height);
+
+/**
+ * place a message at the node of the given height (levels above the
+ * leaves) on its key's path: a leaf applies it, an internal node queues
+ * it. a full buffer is flushed first and the descent restarted, since the
+ * flush can split nodes on the path
+ */
+void tree_insert_message(Table* table, void* message, int height)
+{
+    void* key = message_key(message);
+    hot_key_forget(table, key);
+    if(table->has_art)
+    {
+        art_insert(&table->art, key, 0)->lsn = -1;
+    }
+
+    while(true)
+    {
+        int page_num = table->root_page_num;
+        void* node = get_page(table->pager, page_num);
+        for(int node_height = tree_height(table); node_height > height;
+            node_height--)
+        {
+            page_num = *internal_node_child(
+                node, internal_node_search(table->pager, page_num, key));
+            node = get_page(table->pager, page_num);
+        }
+
+        if(get_node_type(node) == NODE_LEAF)
+        {
+            leaf_node_apply_message(table, page_num, message);
+            return;
+        }
+        if(*internal_node_num_messages(node) < INTERNAL_NODE_MAX_MESSAGES)
+        {
+            internal_node_buffer_message(table->pager, page_num, message);
+            return;
+        }
+
+        internal_node_flush(table, page_num, height);
+    }
+}
+
+/**
+ * move the messages for the child with the most of them one level down,
+ * as one batch. this is what makes random inserts cheap: a page write on
+ * the way down carries several rows instead of one
+ */
+void internal_node_flush(Table* table, int page_num, int height)
+{
+    void* node = get_page(table->pager, page_num);
+    int num_messages = *internal_node_num_messages(node);
+
+    int* child_indexes = malloc(num_messages * sizeof(int));
+    int busiest_child = 0;
+    int busiest_count = 0;
+    for(int i = 0; i < num_messages; i++)
+    {
+        void* key = message_key(internal_node_message(node, i));
+        child_indexes[i] = internal_node_search(table->pager, page_num, key);
+
+        int count = 0;
+        for(int j = 0; j <= i; j++)
+        {
+            count += child_indexes[j] == child_indexes[i];
+        }
+        if(count > busiest_count)
+        {
+            busiest_child = child_indexes[i];
+            busiest_count = count;
+        }
+    }
+
+    // take the batch out of the buffer before anything below can split
+    pager_mark_buffer_dirty(table->pager, page_num);
+    char* batch = malloc(busiest_count * MESSAGE_SIZE);
+    int batch_size = 0;
+    int num_kept = 0;
+    for(int i = 0; i < num_messages; i++)
+    {
+        void* message = internal_node_message(node, i);
+        if(child_indexes[i] == busiest_child)
+        {
+            memcpy(batch + batch_size++ * MESSAGE_SIZE, message, MESSAGE_SIZE);
+        }
+        else
+        {
+            memmove(internal_node_message(node, num_kept++), message,
+                    MESSAGE_SIZE);
+        }
+    }
+    *internal_node_num_messages(node) = num_kept;
+    free(child_indexes);
+
+    for(int i = 0; i < batch_size; i++)
+    {
+        tree_insert_message(table, batch + i * MESSAGE_SIZE, height - 1);
+    }
+    free(batch);
+}
+
+/**
+ * whether the pages a worst-case insert may allocate are still available:
+ * a split per applied message at every level, plus a new root, plus
+ * new_pages the statement needs for itself
+ */
+bool tree_has_room(Table* table, int new_pages)
+{
+    Pager* pager = table->pager;
+    int pages_in_use = pager->num_pages - pager->num_free_pages;
+
+    return pages_in_use + new_pages +
+               INTERNAL_NODE_MAX_MESSAGES * (tree_height(table) + 1) + 1 <=
+           TABLE_MAX_PAGES;
+}
+
+void tree_mark_pages(Pager* pager, int page_num, bool* in_use)
+{
+    void* node = get_page(pager, page_num);
+
+    in_use[page_num] = true;
+    if(get_node_type(node) == NODE_INTERNAL)
+    {
+        for(int i = 0; i <= *internal_node_num_keys(node); i++)
+        {
+            tree_mark_pages(pager, *internal_node_child(node, i), in_use);
+        }
+    }
+}
+
+void tree_free_pages(Pager* pager, int page_num)
+{
+    void* node = get_page(pager, page_num);
+
+    if(get_node_type(node) == NODE_INTERNAL)
+    {
+        for(int i = 0; i <= *internal_node_num_keys(node); i++)
+        {
+            tree_free_pages(pager, *internal_node_child(node, i));
+        }
+    }
+    pager->free_pages[pager->num_free_pages++] = page_num;
+}
+
+/**
+ * a pager with its WAL replayed. a new file gets page 0 as the root leaf,
+ * at LSN 0 so that any logged image of it replaces it
+ */
+Pager* pager_open_logged(const char* filename, const char* wal_path,
+                         bool read_only, bool* is_new)
+{
+    Pager* pager = pager_open(filename);
+    pager->lsn = file_max_lsn(pager->file_descriptor);
+    wal_open(pager, wal_path, read_only);
+
+    *is_new = pager->num_pages == 0;
+    if(*is_new)
+    {
+        void* root_node = get_page(pager, 0);
+        initialize_leaf_node(root_node);
+        set_node_root(root_node, true);
+    }
+
+    return pager;
+}
+
+/**
+ * write every page back and release the pager
+ */
+void pager_close(Pager* pager)
+{
+    while(pager->backup != NULL)
+    {
+        backup_step(pager);
+    }
+
+    for(int i = 0; i < pager->num_pages; i++)
+    {
+        if(pager->pages[i] == NULL)
+        {
+            continue;
+        }
+
+        pager_flush(pager, i);
+        free(pager->pages[i]);
+        pager->pages[i] = NULL;
+        node_search_tree_drop(pager, i);
+    }
+    for(int i = 0; i < pager->num_free_frames; i++)
+    {
+        free(pager->free_frames[i]);
+    }
+    pager->num_free_frames = 0;
+
+    // everything is written back, so the next open replays nothing
+    if(pager->wal != NULL && !pager->wal->read_only)
+    {
+        wal_checkpoint(pager);
+    }
+    wal_close(pager);
+
+    int result = close(pager->file_descriptor);
+    if(result == -1)
+    {
+        printf("Error closing db file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    free(pager);
+}
+
+/**
+ * close a pager and remove its file and WAL segments
+ */
+void pager_destroy(Pager* pager)
+{
+    char path[WAL_PATH_MAX];
+    char name[WAL_PATH_MAX];
+    snprintf(path, WAL_PATH_MAX, "%s", pager->wal->path);
+    int num_segments = pager->wal->segment + 1;
+
+    pager_close(pager);
+    unlink(path);
+    for(int i = 0; i < num_segments; i++)
+    {
+        wal_segment_name(name, path, i);
+        unlink(name);
+    }
+    wal_file_name(name, path, "checkpoint");
+    unlink(name);
+}
+
+void db_set_cache_pages(Database* db, int cache_pages)
+{
+    db->cache_pages = cache_pages;
+    db->pager->max_cached_pages = cache_pages;
+    for(int i = 0; i < db->num_tables; i++)
+    {
+        for(int j = 0; j < db->tables[i]->num_partitions; j++)
+        {
+            db->tables[i]->partitions[j]->pager->max_cached_pages =
+                cache_pages;
+        }
+    }
+}
+
+void db_trim_cache(Database* db)
+{
+    pager_trim(db->pager);
+    for(int i = 0; i < db->num_tables; i++)
+    {
+        for(int j = 0; j < db->tables[i]->num_partitions; j++)
+        {
+            pager_trim(db->tables[i]->partitions[j]->pager);
+        }
+    }
+}
+
+/**
+ * index every key the scan meets. rows found in their leaf keep that
+ * location, rows still queued in a buffer are looked up on first use
+ */
+void table_build_art(Table* table)
+{
+    Cursor* cursor = table_start(table);
+    while(!(cursor->end_of_table))
+    {
+        ArtLeaf* leaf = art_insert(&table->art, cursor_key(cursor), 0);
+        void* page = get_page(table->pager, cursor->page_num);
+        void* value = cursor_value(cursor);
+        if(value >= page && value < page + PAGE_SIZE)
+        {
+            leaf->page_num = cursor->page_num;
+            leaf->lsn = *page_lsn(page);
+            leaf->offset = value - page;
+        }
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+}
+
+Table* table_open(Database* db, Pager* pager, int id, CatalogEntry* entry)
+{
+    Table* table = malloc(sizeof(Table));
+    table->id = id;
+    snprintf(table->name, sizeof(table->name), "%s", entry->name);
+    table->pager = pager;
+    table->root_page_num = entry->root_page_num;
+    table->engine = entry->engine;
+    row_format_compile(&table->format, &entry->schema);
+    table->lsm = NULL;
+    table->hot_keys = NULL;
+    table->has_art = false;
+    table->art = NULL;
+    table->hot_key_hits = 0;
+    table->hot_key_misses = 0;
+    table->version = 0;
+    memset(&table->stats, 0, sizeof(TableStats));
+    table->num_partitions = 0;
+
+    if(table->engine == TABLE_ENGINE_LSM)
+    {
+        // runs, log and manifest are named after the db file and the table
+        char path[WAL_PATH_MAX];
+        if(snprintf(path, WAL_PATH_MAX, "%s-%s", db->path, table->name) >=
+           WAL_PATH_MAX)
+        {
+            printf("Table path is too long: %s\n", db->path);
+            exit(EXIT_FAILURE);
+        }
+        table->lsm = lsm_open(path);
+    }
+    else
+    {
+        table->hot_keys = calloc(HOT_KEY_CACHE_SLOTS, sizeof(HotKey));
+        if(db->art_index && id != 0 && entry->num_partitions == 0)
+        {
+            table->has_art = true;
+            table_build_art(table);
+        }
+    }
+
+    return table;
+}
+
+void table_close(Table* table)
+{
+    for(int i = 0; i < table->num_partitions; i++)
+    {
+        pager_close(table->partitions[i]->pager);
+        table_close(table->partitions[i]);
+    }
+    lsm_close(table->lsm);
+    free(table->hot_keys);
+    art_free(table->art);
+    free(table);
+}
+
+/**
+ * open the next partition of table from its catalog row. partitions are
+ * numbered in the order of their ids, which is the order of their bounds
+ */
+void table_open_partition(Database* db, Table* table, int id,
+                          CatalogEntry* entry)
+{
+    int index = table->num_partitions++;
+    memcpy(table->partition_bounds[index], entry->lower_bound, KEY_SIZE);
+
+    char path[WAL_PATH_MAX];
+    if(snprintf(path, WAL_PATH_MAX, "%s-%s.%d", db->path, table->name,
+                index) >= WAL_PATH_MAX)
+    {
+        printf("Table path is too long: %s\n", db->path);
+        exit(EXIT_FAILURE);
+    }
+    bool is_new;
+    Pager* pager = pager_open_logged(path, path, false, &is_new);
+    pager->max_cached_pages = db->cache_pages;
+
+    CatalogEntry partition_entry = *entry;
+    partition_entry.schema = table->format.schema;
+    partition_entry.root_page_num = 0;
+    table->partitions[index] = table_open(db, pager, id, &partition_entry);
+}
+
+/**
+ * the partition holding key, or table itself if it is not partitioned
+ */
+Table* table_partition(Table* table, const void* key)
+{
+    if(table->num_partitions == 0)
+    {
+        return table;
+    }
+
+    int index = 0;
+    while(index + 1 < table->num_partitions &&
+          key_compare(key, table->partition_bounds[index + 1]) >= 0)
+    {
+        index++;
+    }
+
+    return table->partitions[index];
+}
+
+Table* db_find_table_by_id(Database* db, int id)
+{
+    for(int i = 0; i < db->num_tables; i++)
+    {
+        if(db->tables[i]->id == id)
+        {
+            return db->tables[i];
+        }
+    }
+
+    return NULL;
+}
+
+Table* db_find_table(Database* db, const char* name)
+{
+    for(int i = 0; i < db->num_tables; i++)
+    {
+        if(strcmp(db->tables[i]->name, name) == 0)
+        {
+            return db->tables[i];
+        }
+    }
+
+    return NULL;
+}
+
+void result_cache_clear(Database* db)
+{
+    for(int i = 0; i < RESULT_CACHE_SLOTS; i++)
+    {
+        free(db->results[i].rows);
+        db->results[i].rows = NULL;
+        db->results[i].used = false;
+    }
+}
+
+/**
+ * the predicates of a statement as x86-64 code, one compare of the row in
+ * place per predicate. only int32 and int64 columns are compiled: their
+ * key encoding sorts like the signed values the row holds. NULL for any
+ * other statement, which stays with the interpreter
+ */
+NativeFilter jit_compile_filter(Table* table, Statement* statement)
+{
+#if defined(__x86_64__)
+    RowFormat* format = &table->format;
+    // the condition code of the jump taken when a predicate fails
+    static const uint8_t fails[NUM_COMPARE_OPERATORS] = {
+        [COMPARE_EQUAL] = 0x85,        // jne
+        [COMPARE_NOT_EQUAL] = 0x84,    // je
+        [COMPARE_LESS] = 0x8d,         // jge
+        [COMPARE_LESS_EQUAL] = 0x8f,   // jg
+        [COMPARE_GREATER] = 0x8e,      // jle
+        [COMPARE_GREATER_EQUAL] = 0x8c // jl
+    };
+
+    if(statement->num_predicates == 0)
+    {
+        return NULL;
+    }
+    for(int i = 0; i < statement->num_predicates; i++)
+    {
+        ColumnType type =
+            format->schema.columns[statement->predicates[i].column].type;
+        if(type != COLUMN_INT32 && type != COLUMN_INT64)
+        {
+            return NULL;
+        }
+    }
+
+    uint8_t* code = mmap(NULL, JIT_CODE_MAX, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(code == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    int length = 0;
+    int jumps[MAX_PREDICATES];
+    for(int i = 0; i < statement->num_predicates; i++)
+    {
+        Predicate* predicate = &statement->predicates[i];
+        ColumnDefinition* column = &format->schema.columns[predicate->column];
+        int32_t offset = format->offsets[predicate->column];
+
+        if(column->type == COLUMN_INT32)
+        {
+            int32_t value;
+            int32_decode_key(column, predicate->value, &value);
+            // cmp dword [rdi + offset], value
+            code[length++] = 0x81;
+            code[length++] = 0xbf;
+            memcpy(code + length, &offset, 4);
+            memcpy(code + length + 4, &value, 4);
+            length += 8;
+        }
+        else
+        {
+            int64_t value;
+            int64_decode_key(column, predicate->value, &value);
+            // mov rax, value; cmp qword [rdi + offset], rax
+            code[length++] = 0x48;
+            code[length++] = 0xb8;
+            memcpy(code + length, &value, 8);
+            length += 8;
+            code[length++] = 0x48;
+            code[length++] = 0x39;
+            code[length++] = 0x87;
+            memcpy(code + length, &offset, 4);
+            length += 4;
+        }
+        code[length++] = 0x0f;
+        code[length++] = fails[predicate->op];
+        jumps[i] = length;
+        length += 4;
+    }
+
+    // mov eax, 1; ret
+    const uint8_t holds[] = {0xb8, 0x01, 0x00, 0x00, 0x00, 0xc3};
+    memcpy(code + length, holds, sizeof(holds));
+    length += sizeof(holds);
+    for(int i = 0; i < statement->num_predicates; i++)
+    {
+        int32_t distance = length - (jumps[i] + 4);
+        memcpy(code + jumps[i], &distance, 4);
+    }
+    // xor eax, eax; ret
+    const uint8_t fail[] = {0x31, 0xc0, 0xc3};
+    memcpy(code + length, fail, sizeof(fail));
+
+    if(mprotect(code, JIT_CODE_MAX, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(code, JIT_CODE_MAX);
+        return NULL;
+    }
+
+    return (NativeFilter)code;
+#else
+    return NULL;
+#endif
+}
+
+void plan_release(CachedPlan* plan)
+{
+    if(plan->statement.native_filter != NULL)
+    {
+        munmap((void*)plan->statement.native_filter, JIT_CODE_MAX);
+        plan->statement.native_filter = NULL;
+    }
+    plan->used = false;
+}
+
+/**
+ * read the catalog into tables[]. a replica reads it again after every
+ * catch-up, since the primary may have created or dropped tables.
+ * LSM and partitioned tables are left out there: their files are not in
+ * the WAL
+ */
+void db_load_catalog(Database* db)
+{
+    bool read_only = db->pager->wal->read_only;
+
+    while(db->num_tables > 0)
+    {
+        table_close(db->tables[--db->num_tables]);
+    }
+    db->next_table_id = 1;
+    // reopened tables start again at version 0
+    result_cache_clear(db);
+    for(int i = 0; i < PLAN_CACHE_SLOTS; i++)
+    {
+        plan_release(&db->plans[i]);
+    }
+
+    Cursor* cursor = table_start(db->catalog);
+    while(!(cursor->end_of_table))
+    {
+        int id = key_to_int(cursor_key(cursor));
+        CatalogEntry entry;
+        memcpy(&entry, cursor_value(cursor), sizeof(entry));
+
+        if(id >= db->next_table_id)
+        {
+            db->next_table_id = id + 1;
+        }
+        if(entry.partition_of != 0)
+        {
+            Table* table = db_find_table_by_id(db, entry.partition_of);
+            if(table != NULL)
+            {
+                table_open_partition(db, table, id, &entry);
+            }
+        }
+        else if(!entry.dropped &&
+                !(read_only && (entry.engine == TABLE_ENGINE_LSM ||
+                                entry.num_partitions > 0)))
+        {
+            db->tables[db->num_tables++] =
+                table_open(db, db->pager, id, &entry);
+        }
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+}
+
+/**
+ * pages no tree reaches belonged to dropped tables. the free list is not
+ * stored anywhere, it is rebuilt here every time the database opens
+ */
+void db_find_free_pages(Database* db)
+{
+    Pager* pager = db->pager;
+    bool in_use[TABLE_MAX_PAGES] = {false};
+
+    tree_mark_pages(pager, db->catalog->root_page_num, in_use);
+    for(int i = 0; i < db->num_tables; i++)
+    {
+        if(db->tables[i]->engine == TABLE_ENGINE_BTREE &&
+           db->tables[i]->num_partitions == 0)
+        {
+            tree_mark_pages(pager, db->tables[i]->root_page_num, in_use);
+        }
+    }
+
+    // highest first, so that the lowest page is reused first
+    pager->num_free_pages = 0;
+    for(int i = pager->num_pages - 1; i >= 0; i--)
+    {
+        if(!in_use[i])
+        {
+            pager->free_pages[pager->num_free_pages++] = i;
+        }
+    }
+}
+
+void catalog_put(Database* db, int id, CatalogEntry* entry)
+{
+    char* message = calloc(1, MESSAGE_SIZE);
+    key_from_int(id, message_key(message));
+    memcpy(message_value(message), entry, sizeof(CatalogEntry));
+
+    tree_insert_message(db->catalog, message, tree_height(db->catalog));
+    free(message);
+}
+
+/**
+ * the id for a new table or partition. a dropped table's row is taken
+ * over when there is one, so the catalog does not grow with every create
+ * and drop. ids a partition row still points at are left alone
+ */
+int db_take_table_id(Database* db)
+{
+    bool* referenced = calloc(db->next_table_id + 1, sizeof(bool));
+    int* dropped = malloc((db->next_table_id + 1) * sizeof(int));
+    int num_dropped = 0;
+
+    Cursor* cursor = table_start(db->catalog);
+    while(!(cursor->end_of_table))
+    {
+        int id = key_to_int(cursor_key(cursor));
+        CatalogEntry entry;
+        memcpy(&entry, cursor_value(cursor), sizeof(entry));
+        if(entry.dropped)
+        {
+            dropped[num_dropped++] = id;
+        }
+        else if(entry.partition_of > 0 &&
+                entry.partition_of < db->next_table_id)
+        {
+            referenced[entry.partition_of] = true;
+        }
+        cursor_advance(cursor);
+    }
+    cursor_close(cursor);
+
+    int id = db->next_table_id;
+    for(int i = 0; i < num_dropped && id == db->next_table_id; i++)
+    {
+        if(!referenced[dropped[i]])
+        {
+            id = dropped[i];
+        }
+    }
+    if(id == db->next_table_id)
+    {
+        db->next_table_id++;
+    }
+    free(referenced);
+    free(dropped);
+
+    return id;
+}
+
+/**
+ * bounds holds the lower bound of each of num_partitions partitions, the
+ * first is unused. 0 partitions makes an ordinary table
+ */
+ExecuteResult db_create_table(Database* db, const char* name,
+                              TableEngine engine, Schema* schema,
+                              int num_partitions,
+                              uint8_t bounds[][KEY_SIZE])
+{
+    Pager* pager = db->pager;
+
+    if(pager->wal->read_only)
+    {
+        return EXECUTE_READ_ONLY;
+    }
+    if(db_find_table(db, name) != NULL)
+    {
+        return EXECUTE_TABLE_EXISTS;
+    }
+    if(db->num_tables >= MAX_TABLES || !tree_has_room(db->catalog, 1))
+    {
+        return EXECUTE_TABLE_FULL;
+    }
+
+    CatalogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    snprintf(entry.name, sizeof(entry.name), "%s", name);
+    entry.engine = engine;
+    entry.schema = *schema;
+    entry.num_partitions = num_partitions;
+
+    if(num_partitions > 0)
+    {
+        entry.root_page_num = -1;
+    }
+    else if(engine == TABLE_ENGINE_BTREE)
+    {
+        entry.root_page_num = get_unused_page_num(pager);
+        void* root_node = get_page(pager, entry.root_page_num);
+        pager_mark_dirty(pager, entry.root_page_num);
+        initialize_leaf_node(root_node);
+        set_node_root(root_node, true);
+    }
+
+    int id = db_take_table_id(db);
+    catalog_put(db, id, &entry);
+
+    CatalogEntry partition_entries[MAX_PARTITIONS];
+    int partition_ids[MAX_PARTITIONS];
+    for(int i = 0; i < num_partitions; i++)
+    {
+        CatalogEntry* partition_entry = &partition_entries[i];
+        memset(partition_entry, 0, sizeof(CatalogEntry));
+        snprintf(partition_entry->name, sizeof(partition_entry->name), "%s",
+                 name);
+        partition_entry->engine = TABLE_ENGINE_BTREE;
+        partition_entry->partition_of = id;
+        memcpy(partition_entry->lower_bound, bounds[i], KEY_SIZE);
+
+        partition_ids[i] = db_take_table_id(db);
+        catalog_put(db, partition_ids[i], partition_entry);
+    }
+    wal_commit(pager);
+
+    Table* table = table_open(db, pager, id, &entry);
+    for(int i = 0; i < num_partitions; i++)
+    {
+        table_open_partition(db, table, partition_ids[i],
+                             &partition_entries[i]);
+    }
+    db->tables[db->num_tables++] = table;
+
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult db_drop_table(Database* db, const char* name)
+{
+    Pager* pager = db->pager;
+
+    if(pager->wal->read_only)
+    {
+        return EXECUTE_READ_ONLY;
+    }
+    Table* table = db_find_table(db, name);
+    if(table == NULL)
+    {
+        return EXECUTE_NO_SUCH_TABLE;
+    }
+    if(!tree_has_room(db->catalog, 0))
+    {
+        return EXECUTE_TABLE_FULL;
+    }
+
+    CatalogEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    snprintf(entry.name, sizeof(entry.name), "%s", table->name);
+    entry.engine = table->engine;
+    entry.dropped = true;
+    catalog_put(db, table->id, &entry);
+    for(int i = 0; i < table->num_partitions; i++)
+    {
+        catalog_put(db, table->partitions[i]->id, &entry);
+    }
+    wal_commit(pager);
+
+    // the id may be handed out again: nothing cached may outlive it
+    for(int i = 0; i < RESULT_CACHE_SLOTS; i++)
+    {
+        if(db->results[i].table_id == table->id)
+        {
+            free(db->results[i].rows);
+            db->results[i].rows = NULL;
+            db->results[i].used = false;
+        }
+    }
+    for(int i = 0; i < PLAN_CACHE_SLOTS; i++)
+    {
+        if(db->plans[i].used && db->plans[i].table_id == table->id)
+        {
+            plan_release(&db->plans[i]);
+        }
+    }
+
+    // only once the drop is durable can the table's storage go
+    if(table->num_partitions > 0)
+    {
+        for(int i = 0; i < table->num_partitions; i++)
+        {
+            pager_destroy(table->partitions[i]->pager);
+            table_close(table->partitions[i]);
+        }
+        table->num_partitions = 0;
+    }
+    else if(table->engine == TABLE_ENGINE_BTREE)
+    {
+        tree_free_pages(pager, table->root_page_num);
+    }
+    else
+    {
+        lsm_destroy(table->lsm);
+        table->lsm = NULL;
+    }
+
+    int i = 0;
+    while(db->tables[i] != table)
+    {
+        i++;
+    }
+    db->num_tables -= 1;
+    memmove(db->tables + i, db->tables + i + 1,
+            (db->num_tables - i) * sizeof(Table*));
+    table_close(table);
+
+    return EXECUTE_SUCCESS;
+}
+
+bool db_compaction_pending(Database* db)
+{
+    for(int i = 0; i < db->num_tables; i++)
+    {
+        if(lsm_compaction_pending(db->tables[i]->lsm))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * the numbers of a sysfs list such as "0-15,32-47", at most max of them
+ */
+int sysfs_read_list(const char* path, int* numbers, int max)
+{
+    FILE* file = fopen(path, "r");
+    if(file == NULL)
+    {
+        return 0;
+    }
+
+    int count = 0;
+    int first;
+    while(fscanf(file, "%d", &first) == 1)
+    {
+        int last = first;
+        int matched = fscanf(file, "-%d", &last);
+        for(int number = first; number <= last && count < max; number++)
+        {
+            numbers[count++] = number;
+        }
+        if(matched == EOF || fgetc(file) != ',')
+        {
+            break;
+        }
+    }
+    fclose(file);
+
+    return count;
+}
+
+/**
+ * the ids of the online NUMA nodes, which need not be contiguous.
+ * node 0 alone where the kernel does not say
+ */
+int numa_online_nodes(int* nodes)
+{
+    int num_nodes = sysfs_read_list("/sys/devices/system/node/online", nodes,
+                                    NUMA_MAX_NODES);
+    if(num_nodes == 0)
+    {
+        nodes[0] = 0;
+        num_nodes = 1;
+    }
+
+    return num_nodes;
+}
+
+/**
+ * run this process on the CPUs of node and allocate its memory there, so
+ * that the pages a shard's pager touches first stay local to it
+ */
+void numa_bind_node(int node)
+{
+    if(node < 0 || node >= NUMA_MAX_NODES)
+    {
+        return;
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    int cpu_list[CPU_SETSIZE];
+    int num_cpus = sysfs_read_list(path, cpu_list, CPU_SETSIZE);
+    if(num_cpus == 0)
+    {
+        return;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for(int i = 0; i < num_cpus; i++)
+    {
+        if(cpu_list[i] >= 0 && cpu_list[i] < CPU_SETSIZE)
+        {
+            CPU_SET(cpu_list[i], &cpus);
+        }
+    }
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    // preferred rather than bound: a full node falls back to the others
+    int bits = sizeof(unsigned long) * CHAR_BIT;
+    unsigned long nodes[NUMA_MAX_NODES / (sizeof(unsigned long) * CHAR_BIT)] =
+        {0};
+    nodes[node / bits] |= 1UL << (node % bits);
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes, NUMA_MAX_NODES);
+}
+
+/**
+ * sharded mode: the process that reads statements is a router in front
+ * of num_shards engine processes. each shard is a copy of this program
+ * with its own database file and pager, talking the REPL protocol over a
+ * unix socket pair. the router's own database only holds the catalog,
+ * which it needs to find the key of a row. on a NUMA host the shards are
+ * spread over the nodes round robin
+ */
+void router_send(Router* router, int shard, const char* line)
+{
+    size_t length = strlen(line);
+    int fd = router->sockets[shard];
+    if(write(fd, line, length) != (ssize_t)length || write(fd, "\n", 1) != 1)
+    {
+        printf("Error writing to shard %d: %d\n", shard, errno);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * everything a shard printed for a statement, up to its next prompt
+ */
+char* router_read_response(Router* router, int shard)
+{
+    size_t capacity = 4096;
+    size_t length = 0;
+    char* response = malloc(capacity);
+    size_t prompt_length = strlen(SHARD_PROMPT);
+
+    while(length < prompt_length ||
+          memcmp(response + length - prompt_length, SHARD_PROMPT,
+                 prompt_length) != 0)
+    {
+        if(capacity - length < 4096)
+        {
+            capacity *= 2;
+            response = realloc(response, capacity);
+        }
+        ssize_t bytes_read =
+            read(router->sockets[shard], response + length, capacity - length);
+        if(bytes_read <= 0)
+        {
+            printf("Shard %d is gone\n", shard);
+            exit(EXIT_FAILURE);
+        }
+        length += bytes_read;
+    }
+
+    response[length - prompt_length] = '\0';
+    return response;
+}
+
+/**
+ * fork the shards. returns the router in this process; each shard returns
+ * NULL with filename pointed at its own database file
+ */
+Router* router_start(int num_shards, char** filename)
+{
+    Router* router = malloc(sizeof(Router));
+    router->num_shards = 0;
+    router->num_in_flight = 0;
+    int nodes[NUMA_MAX_NODES];
+    int num_nodes = numa_online_nodes(nodes);
+
+    for(int i = 0; i < num_shards; i++)
+    {
+        int sockets[2];
+        if(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) == -1)
+        {
+            printf("Unable to create shard socket: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+
+        pid_t pid = fork();
+        if(pid == -1)
+        {
+            printf("Unable to start shard: %d\n", errno);
+            exit(EXIT_FAILURE);
+        }
+        if(pid == 0)
+        {
+            for(int j = 0; j < router->num_shards; j++)
+            {
+                close(router->sockets[j]);
+            }
+            free(router);
+            close(sockets[0]);
+            dup2(sockets[1], STDIN_FILENO);
+            dup2(sockets[1], STDOUT_FILENO);
+            close(sockets[1]);
+            if(num_nodes > 1)
+            {
+                numa_bind_node(nodes[i % num_nodes]);
+            }
+
+            char* shard_filename = malloc(WAL_PATH_MAX);
+            snprintf(shard_filename, WAL_PATH_MAX, "%s.shard%d", *filename, i);
+            *filename = shard_filename;
+            return NULL;
+        }
+
+        close(sockets[1]);
+        router->sockets[i] = sockets[0];
+        router->pids[i] = pid;
+        router->num_shards++;
+    }
+
+    // the prompt each shard prints before its first statement
+    for(int i = 0; i < num_shards; i++)
+    {
+        free(router_read_response(router, i));
+    }
+
+    return router;
+}
+
+void router_close(Router* router)
+{
+    if(router == NULL)
+    {
+        return;
+    }
+
+    for(int i = 0; i < router->num_shards; i++)
+    {
+        router_send(router, i, ".exit");
+        close(router->sockets[i]);
+        waitpid(router->pids[i], NULL, 0);
+    }
+    free(router);
+}
+
+/**
+ * send line to every shard at once, then collect the answers
+ */
+char** router_broadcast(Router* router, const char* line)
+{
+    char** responses = malloc(router->num_shards * sizeof(char*));
+    for(int i = 0; i < router->num_shards; i++)
+    {
+        router_send(router, i, line);
+    }
+    for(int i = 0; i < router->num_shards; i++)
+    {
+        responses[i] = router_read_response(router, i);
+    }
+
+    return responses;
+}
+
+void router_free_responses(Router* router, char** responses)
+{
+    for(int i = 0; i < router->num_shards; i++)
+    {
+        free(responses[i]);
+    }
+    free(responses);
+}
+
+/**
+ * open a database. with replica_of set, the database is a read-only copy
+ * kept up to date from the primary's WAL instead of having its own.
+ * a new database starts out with one table, DEFAULT_TABLE_NAME, using the
+ * given engine
+ */
+Database* db_open(const char* filename, const char* replica_of,
+                  TableEngine engine, bool art_index)
+{
+    // page 0 of a new file is the catalog's leaf
+    bool is_new;
+    Pager* pager = pager_open_logged(
+        filename, replica_of != NULL ? replica_of : filename,
+        replica_of != NULL, &is_new);
+
+    Database* db = malloc(sizeof(Database));
+    snprintf(db->path, WAL_PATH_MAX, "%s", filename);
+    db->pager = pager;
+    db->num_tables = 0;
+    db->cdc = NULL;
+    db->cache_pages = TABLE_MAX_PAGES;
+    db->router = NULL;
+    db->is_shard = false;
+    db->art_index = art_index;
+    memset(db->results, 0, sizeof(db->results));
+    db->result_hits = 0;
+    db->result_misses = 0;
+    memset(db->plans, 0, sizeof(db->plans));
+    db->plan_clock = 0;
+    db->plan_hits = 0;
+    db->plan_misses = 0;
+    db->jit = false;
+    db->jit_compiled = 0;
+
+    // catalog keys are table ids
+    CatalogEntry catalog_entry;
+    memset(&catalog_entry, 0, sizeof(catalog_entry));
+    strcpy(catalog_entry.name, "catalog");
+    catalog_entry.engine = TABLE_ENGINE_BTREE;
+    catalog_entry.schema.num_columns = 1;
+    catalog_entry.schema.columns[0] =
+        (ColumnDefinition){"id", COLUMN_INT32, 0};
+    catalog_entry.schema.num_key_columns = 1;
+    db->catalog = table_open(db, pager, 0, &catalog_entry);
+    db_load_catalog(db);
+
+    if(!pager->wal->read_only)
+    {
+        db_find_free_pages(db);
+        if(is_new)
+        {
+            Schema schema;
+            schema_default(&schema);
+            db_create_table(db, DEFAULT_TABLE_NAME, engine, &schema, 0, NULL);
+        }
+    }
+
+    return db;
+}
+
+void db_close(Database* db)
+{
+    router_close(db->router);
+    pager_close(db->pager);
+    while(db->num_tables > 0)
+    {
+        table_close(db->tables[--db->num_tables]);
+    }
+    table_close(db->catalog);
+    cdc_close(db->cdc);
+    result_cache_clear(db);
+    for(int i = 0; i < PLAN_CACHE_SLOTS; i++)
+    {
+        plan_release(&db->plans[i]);
+    }
+
+    free(db);
+}
+
+/**
+ * stdin is read here directly rather than through stdio, so that what was
+ * read ahead of the current line is known: it sits in read_ahead from
+ * read_start to read_end
+ */
+typedef struct
+{
+    char* buffer;
+    size_t buffer_length;
+    ssize_t input_length;
+    char* read_ahead;
+    size_t read_ahead_length;
+    size_t read_start;
+    size_t read_end;
+} InputBuffer;
+
+InputBuffer* new_input_buffer()
+{
+    InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
+
+    input_buffer->buffer = NULL;
+    input_buffer->buffer_length = 0;
+    input_buffer->input_length = 0;
+    input_buffer->read_ahead = malloc(INPUT_READ_SIZE);
+    input_buffer->read_ahead_length = INPUT_READ_SIZE;
+    input_buffer->read_start = 0;
+    input_buffer->read_end = 0;
+
+    return input_buffer;
+}
+
+void print_prompt()
+{
+    printf("db > ");
+}
+
+/**
+ * next line of stdin, without its newline. a last line that has none is
+ * taken as it is
+ */
+void read_input(InputBuffer* input_buffer)
+{
+    char* newline = NULL;
+    while(true)
+    {
+        char* start = input_buffer->read_ahead + input_buffer->read_start;
+        size_t length = input_buffer->read_end - input_buffer->read_start;
+        newline = memchr(start, '\n', length);
+        if(newline != NULL)
+        {
+            break;
+        }
+
+        // make room behind what is left of the current line
+        memmove(input_buffer->read_ahead, start, length);
+        input_buffer->read_start = 0;
+        input_buffer->read_end = length;
+        if(length == input_buffer->read_ahead_length)
+        {
+            input_buffer->read_ahead_length *= 2;
+            input_buffer->read_ahead =
+                realloc(input_buffer->read_ahead,
+                        input_buffer->read_ahead_length);
+        }
+
+        ssize_t bytes_read =
+            read(STDIN_FILENO, input_buffer->read_ahead + length,
+                 input_buffer->read_ahead_length - length);
+        if(bytes_read == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(bytes_read == 0 && length > 0)
+        {
+            break;
+        }
+        if(bytes_read <= 0)
+        {
+            printf("Error reading input\n");
+            exit(EXIT_FAILURE);
+        }
+        input_buffer->read_end += bytes_read;
+    }
+
+    char* start = input_buffer->read_ahead + input_buffer->read_start;
+    size_t length = newline != NULL ? (size_t)(newline - start)
+                                    : input_buffer->read_end -
+                                          input_buffer->read_start;
+    if(length + 1 > input_buffer->buffer_length)
+    {
+        input_buffer->buffer_length = length + 1;
+        input_buffer->buffer =
+            realloc(input_buffer->buffer, input_buffer->buffer_length);
+    }
+    memcpy(input_buffer->buffer, start, length);
+    input_buffer->buffer[length] = 0;
+    input_buffer->input_length = length;
+    input_buffer->read_start += newline != NULL ? length + 1 : length;
+}
+
+/**
+ * whether a statement is waiting: either already read ahead, or on stdin
+ */
+bool input_pending(InputBuffer* input_buffer)
+{
+    if(input_buffer->read_start < input_buffer->read_end)
+    {
+        return true;
+    }
+    struct pollfd stdin_poll = {.fd = STDIN_FILENO, .events = POLLIN};
+
+    return poll(&stdin_poll, 1, 0) > 0 && (stdin_poll.revents & POLLIN);
+}
+
+/**
+ * serve change data capture consumers until the next statement comes in,
+ * so that one that connects or falls behind meanwhile is not kept waiting
+ * for it
+ */
+void cdc_serve_until_input(Cdc* cdc, InputBuffer* input_buffer)
+{
+    if(cdc == NULL || cdc->listen_descriptor == -1)
+    {
+        return;
+    }
+
+    // the prompt, before blocking
+    fflush(stdout);
+    while(!input_pending(input_buffer))
+    {
+        struct pollfd fds[CDC_MAX_CONSUMERS + 2];
+        fds[0] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
+        fds[1] = (struct pollfd){
+            .fd = cdc->listen_descriptor,
+            .events = cdc->num_consumers < CDC_MAX_CONSUMERS ? POLLIN : 0};
+        for(int i = 0; i < cdc->num_consumers; i++)
+        {
+            // a consumer is read until it sent its offset, then written
+            // while it is behind
+            short events = cdc->consumer_offsets[i] == -1 ? POLLIN
+                           : cdc->consumer_offsets[i] < cdc->length
+                               ? POLLOUT
+                               : 0;
+            fds[i + 2] = (struct pollfd){.fd = cdc->consumers[i],
+                                         .events = events};
+        }
+
+        if(poll(fds, cdc->num_consumers + 2, -1) == -1 && errno != EINTR)
+        {
+            return;
+        }
+        if(fds[0].revents != 0)
+        {
+            // a statement, or the end of input
+            return;
+        }
+        for(int i = cdc->num_consumers - 1; i >= 0; i--)
+        {
+            if(fds[i + 2].revents & (POLLERR | POLLHUP))
+            {
+                cdc_drop_consumer(cdc, i);
+            }
+        }
+        cdc_serve(cdc);
+    }
+}
+
+void close_input_buffer(InputBuffer* input_buffer)
+{
+    free(input_buffer->buffer);
+    free(input_buffer->read_ahead);
+    free(input_buffer);
+}
+
+void indent(int level)
+{
+    for(int i = 0; i < level; i++)
+    {
+        printf(" ");
+    }
+}
+
+void print_tree(Table* table, int page_num, int indentation_level)
+{
+    void* node = get_page(table->pager, page_num);
+    int num_keys, child;
+
+    switch(get_node_type(node))
+    {
+    case(NODE_LEAF):
+        num_keys = *leaf_node_num_cells(node);
+        indent(indentation_level);
+
+        printf("- leaf (size %d)\n", num_keys);
+        for(int i = 0; i < num_keys; i++)
+        {
+            indent(indentation_level + 1);
+            printf("- ");
+            key_print(&table->format, leaf_node_key(node, i));
+            printf("\n");
+        }
+        break;
+
+    case(NODE_INTERNAL):
+        num_keys = *internal_node_num_keys(node);
+        indent(indentation_level);
+
+        printf("- internal (size %d, buffered %d)\n", num_keys,
+               *internal_node_num_messages(node));
+
+        for(int i = 0; i < num_keys; i++)
+        {
+            child = *internal_node_child(node, i);
+            print_tree(table, child, indentation_level + 1);
+
+            indent(indentation_level + 1);
+            printf("- ");
+            key_print(&table->format, internal_node_key(node, i));
+            printf("\n");
+        }
+        child = *internal_node_right_child(node);
+        print_tree(table, child, indentation_level + 1);
+        break;
+    }
+}
+
+void print_stats(Database* db)
+{
+    Pager* pager = db->pager;
+    Wal* wal = pager->wal;
+
+    printf("pages: %d\n", pager->num_pages);
+    printf("page cache: %d of %d pages, hits: %d misses: %d evictions: %u\n",
+           pager->num_cached_pages, pager->max_cached_pages, pager->cache_hits,
+           pager->cache_misses, pager->num_evictions);
+    printf("lsn: %d\n", pager->lsn);
+    printf("wal segment: %d offset: %lld\n", wal->segment,
+           (long long)wal->offset);
+    printf("wal checkpoint lsn: %d\n", wal->checkpoint_lsn);
+    if(wal->read_only)
+    {
+        int primary_lsn = wal_peek_lsn(wal);
+        printf("replica of: %s\n", wal->path);
+        printf("primary lsn: %d\n", primary_lsn);
+        printf("replication lag: %d lsn, %lld s since last apply\n",
+               primary_lsn - wal->applied_lsn,
+               wal->last_applied == 0
+                   ? -1LL
+                   : (long long)(time(NULL) - wal->last_applied));
+    }
+    printf("free pages: %d\n", pager->num_free_pages);
+    for(int i = 0; i < db->num_tables; i++)
+    {
+        Table* table = db->tables[i];
+        printf("table %s:\n", table->name);
+        if(table->lsm != NULL)
+        {
+            print_lsm_stats(table->lsm);
+        }
+        else
+        {
+            printf("hot key cache hits: %d misses: %d\n", table->hot_key_hits,
+                   table->hot_key_misses);
+        }
+        if(table->stats.analyzed)
+        {
+            printf("rows: %d distinct:", table->stats.num_rows);
+            for(int j = 0; j < table->format.schema.num_columns; j++)
+            {
+                printf(" %d", table->stats.distinct[j]);
+            }
+            printf("\n");
+        }
+    }
+    printf("result cache hits: %d misses: %d\n", db->result_hits,
+           db->result_misses);
+    printf("plan cache hits: %d misses: %d\n", db->plan_hits,
+           db->plan_misses);
+    if(db->jit)
+    {
+        printf("jit compiled plans: %d\n", db->jit_compiled);
+    }
+    if(db->cdc != NULL)
+    {
+        printf("cdc bytes: %lld consumers: %d\n", (long long)db->cdc->length,
+               db->cdc->num_consumers);
+    }
+}
+
+MetaCommandResult do_meta_command(InputBuffer* input_buffer, Database* db)
+{
+    if(strcmp(input_buffer->buffer, ".exit") == 0)
+    {
+        db_close(db);
+        exit(EXIT_SUCCESS);
+    }
+    else if(db->router != NULL)
+    {
+        char** responses = router_broadcast(db->router, input_buffer->buffer);
+        for(int i = 0; i < db->router->num_shards; i++)
+        {
+            printf("shard %d:\n%s", i, responses[i]);
+        }
+        router_free_responses(db->router, responses);
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strcmp(input_buffer->buffer, ".btree") == 0 ||
+            strncmp(input_buffer->buffer, ".btree ", 7) == 0)
+    {
+        const char* name = input_buffer->buffer[6] == ' '
+                               ? input_buffer->buffer + 7
+                               : DEFAULT_TABLE_NAME;
+        Table* table = strcmp(name, "catalog") == 0 ? db->catalog
+                                                    : db_find_table(db, name);
+        if(table == NULL || table->engine != TABLE_ENGINE_BTREE)
+        {
+            printf("No B-tree table '%s'\n", name);
+            return META_COMMAND_SUCCESS;
+        }
+        if(table->num_partitions > 0)
+        {
+            for(int i = 0; i < table->num_partitions; i++)
+            {
+                printf("Partition %d:\n", i);
+                print_tree(table->partitions[i], 0, 0);
+            }
+            return META_COMMAND_SUCCESS;
+        }
+        printf("Tree:\n");
+        print_tree(table, table->root_page_num, 0);
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strcmp(input_buffer->buffer, ".tables") == 0)
+    {
+        for(int i = 0; i < db->num_tables; i++)
+        {
+            Table* table = db->tables[i];
+            if(table->num_partitions > 0)
+            {
+                printf("%s (%d partitions)\n", table->name,
+                       table->num_partitions);
+                continue;
+            }
+            printf("%s%s\n", table->name,
+                   table->engine == TABLE_ENGINE_LSM ? " (lsm)" : "");
+        }
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strncmp(input_buffer->buffer, ".backup ", 8) == 0)
+    {
+        if(backup_begin(db->pager, input_buffer->buffer + 8))
+        {
+            printf("Backup started\n");
+            for(int i = 0; i < db->num_tables; i++)
+            {
+                if(db->tables[i]->engine == TABLE_ENGINE_LSM)
+                {
+                    printf("Table '%s' is an LSM table, not included\n",
+                           db->tables[i]->name);
+                }
+                else if(db->tables[i]->num_partitions > 0)
+                {
+                    printf("Table '%s' is partitioned, not included\n",
+                           db->tables[i]->name);
+                }
+            }
+        }
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strcmp(input_buffer->buffer, ".stats") == 0)
+    {
+        print_stats(db);
+        return META_COMMAND_SUCCESS;
+    }
+    else if(strcmp(input_buffer->buffer, ".constants") == 0)
+    {
+        printf("Constants:\n");
+        print_constants();
+        return META_COMMAND_SUCCESS;
+    }
+    else
+    {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+}
+
+/**
+ * the statement tokenizer. tokens point into the input line, nothing is
+ * copied until a value is handed to its codec
+ */
+typedef enum
+{
+    TOKEN_END,
+    TOKEN_WORD,   // a run of anything but spaces, quotes and symbols
+    TOKEN_STRING, // quoted with ' or ", the quote doubled inside
+    TOKEN_SYMBOL, // one of ( ) , = != <> < <= > >=
+    TOKEN_ERROR   // a string without its closing quote
+} TokenType;
+
+typedef struct
+{
+    TokenType type;
+    const char* start; // for strings, just inside the quotes
+    int length;
+} Token;
+
+typedef struct
+{
+    const char* next;
+    Token token; // the current token
+} Tokenizer;
+
+void tokenizer_next(Tokenizer* tokenizer)
+{
+    const char* p = tokenizer->next;
+    Token* token = &tokenizer->token;
+
+    while(*p == ' ' || *p == '\t')
+    {
+        p++;
+    }
+    token->start = p;
+    token->length = 0;
+
+    if(*p == '\0')
+    {
+        token->type = TOKEN_END;
+    }
+    else if(strchr("(),=!<>", *p) != NULL)
+    {
+        token->type = TOKEN_SYMBOL;
+        bool two_characters = (strchr("!<>", *p) != NULL && p[1] == '=') ||
+                              (*p == '<' && p[1] == '>');
+        token->length = two_characters ? 2 : 1;
+        p += token->length;
+    }
+    else if(*p == '\'' || *p == '"')
+    {
+        char quote = *p++;
+        token->type = TOKEN_ERROR;
+        token->start = p;
+        while(*p != '\0')
+        {
+            if(*p == quote && p[1] != quote)
+            {
+                token->type = TOKEN_STRING;
+                token->length = p - token->start;
+                p++;
+                break;
+            }
+            p += *p == quote ? 2 : 1;
+        }
+    }
+    else
+    {
+        token->type = TOKEN_WORD;
+        while(*p != '\0' && strchr(" \t(),=!<>'\"", *p) == NULL)
+        {
+            p++;
+        }
+        token->length = p - token->start;
+    }
+
+    tokenizer->next = p;
+}
+
+void tokenizer_start(Tokenizer* tokenizer, const char* text)
+{
+    tokenizer->next = text;
+    tokenizer_next(tokenizer);
+}
+
+/**
+ * whether token is the keyword or symbol text. keywords are not case
+ * sensitive
+ */
+bool token_is(Token* token, const char* text)
+{
+    return (token->type == TOKEN_WORD || token->type == TOKEN_SYMBOL) &&
+           strncasecmp(token->start, text, token->length) == 0 &&
+           text[token->length] == '\0';
+}
+
+/**
+ * whether the current token is the keyword or symbol text, and if it is,
+ * move past it
+ */
+bool tokenizer_accept(Tokenizer* tokenizer, const char* text)
+{
+    if(!token_is(&tokenizer->token, text))
+    {
+        return false;
+    }
+    tokenizer_next(tokenizer);
+
+    return true;
+}
+
+/**
+ * copy the current word or string into text, of size bytes with its
+ * terminator, and move past it
+ */
+PrepareResult tokenizer_value(Tokenizer* tokenizer, char* text, int size)
+{
+    Token* token = &tokenizer->token;
+    if(token->type != TOKEN_WORD && token->type != TOKEN_STRING)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    int length = 0;
+    for(int i = 0; i < token->length; i++)
+    {
+        if(length == size - 1)
+        {
+            return PREPARE_STRING_TOO_LONG;
+        }
+        text[length++] = token->start[i];
+        // a doubled quote stands for one
+        if(token->type == TOKEN_STRING && token->start[i] == token->start[-1])
+        {
+            i++;
+        }
+    }
+    text[length] = '\0';
+    tokenizer_next(tokenizer);
+
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * copy the current word into name if it is a name of at most max
+ * letters, digits and underscores, and move past it
+ */
+bool tokenizer_name(Tokenizer* tokenizer, char* name, int max)
+{
+    Token* token = &tokenizer->token;
+    if(token->type != TOKEN_WORD || token->length > max)
+    {
+        return false;
+    }
+    for(int i = 0; i < token->length; i++)
+    {
+        char c = token->start[i];
+        if(!isalnum((unsigned char)c) && c != '_')
+        {
+            return false;
+        }
+    }
+    memcpy(name, token->start, token->length);
+    name[token->length] = '\0';
+    tokenizer_next(tokenizer);
+
+    return true;
+}
+
+/**
+ * the statement as the plan cache knows it: its tokens one space apart,
+ * strings in single quotes. empty if it does not fit in text
+ */
+void statement_normalize(const char* input, char* text)
+{
+    Tokenizer tokenizer;
+    int length = 0;
+
+    for(tokenizer_start(&tokenizer, input); tokenizer.token.type != TOKEN_END;
+        tokenizer_next(&tokenizer))
+    {
+        Token* token = &tokenizer.token;
+        bool quoted = token->type == TOKEN_STRING;
+        // a token grows by at most twice its length and three characters
+        if(token->type == TOKEN_ERROR ||
+           length + 2 * token->length + 3 >= STATEMENT_TEXT_MAX)
+        {
+            text[0] = '\0';
+            return;
+        }
+
+        if(length > 0)
+        {
+            text[length++] = ' ';
+        }
+        if(quoted)
+        {
+            text[length++] = '\'';
+        }
+        for(int i = 0; i < token->length; i++)
+        {
+            char c = token->start[i];
+            if(quoted && c == token->start[-1])
+            {
+                i++;
+            }
+            if(quoted && c == '\'')
+            {
+                text[length++] = c;
+            }
+            text[length++] = c;
+        }
+        if(quoted)
+        {
+            text[length++] = '\'';
+        }
+    }
+    text[length] = '\0';
+}
+
+/**
+ * parse the current word or string as a value of column into destination
+ */
+PrepareResult prepare_value(Tokenizer* tokenizer, ColumnDefinition* column,
+                            void* destination)
+{
+    // the longest text a value can take is a blob's hex digits
+    char text[2 * ROW_SIZE + 1];
+    PrepareResult result = tokenizer_value(tokenizer, text, sizeof(text));
+    if(result != PREPARE_SUCCESS)
+    {
+        return result;
+    }
+
+    return COLUMN_CODECS[column->type].parse(column, text, destination);
+}
+
+/**
+ * the column the current word names, -1 if there is none
+ */
+int prepare_column(Tokenizer* tokenizer, RowFormat* format)
+{
+    char name[COLUMN_NAME_MAX + 1];
+    if(!tokenizer_name(tokenizer, name, COLUMN_NAME_MAX))
+    {
+        return -1;
+    }
+
+    for(int i = 0; i < format->schema.num_columns; i++)
+    {
+        if(strcmp(format->schema.columns[i].name, name) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * parse "where column op value and ...", if the statement has one
+ */
+PrepareResult prepare_where(Tokenizer* tokenizer, Statement* statement,
+                            RowFormat* format)
+{
+    static const char* operators[NUM_COMPARE_OPERATORS] = {
+        [COMPARE_EQUAL] = "=",        [COMPARE_NOT_EQUAL] = "!=",
+        [COMPARE_LESS] = "<",         [COMPARE_LESS_EQUAL] = "<=",
+        [COMPARE_GREATER] = ">",      [COMPARE_GREATER_EQUAL] = ">="};
+
+    statement->num_predicates = 0;
+    if(!tokenizer_accept(tokenizer, "where"))
+    {
+        return PREPARE_SUCCESS;
+    }
+
+    do
+    {
+        if(statement->num_predicates == MAX_PREDICATES)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        Predicate* predicate =
+            &statement->predicates[statement->num_predicates++];
+
+        predicate->column = prepare_column(tokenizer, format);
+        if(predicate->column == -1)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        predicate->op = tokenizer_accept(tokenizer, "<>")
+                            ? COMPARE_NOT_EQUAL
+                            : NUM_COMPARE_OPERATORS;
+        for(int i = 0; i < NUM_COMPARE_OPERATORS &&
+                       predicate->op == NUM_COMPARE_OPERATORS;
+            i++)
+        {
+            if(tokenizer_accept(tokenizer, operators[i]))
+            {
+                predicate->op = i;
+            }
+        }
+        if(predicate->op == NUM_COMPARE_OPERATORS)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        ColumnDefinition* column =
+            &format->schema.columns[predicate->column];
+        char value[ROW_SIZE] = {0};
+        PrepareResult result = prepare_value(tokenizer, column, value);
+        if(result != PREPARE_SUCCESS)
+        {
+            return result;
+        }
+        predicate->length = column_sort_key(column, value, predicate->value);
+    } while(tokenizer_accept(tokenizer, "and"));
+
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * encode the values of an insert into the row image for the table. they
+ * follow each other, or are listed as "values (a, b, ...)"
+ */
+PrepareResult prepare_insert(Tokenizer* tokenizer, Statement* statement,
+                             RowFormat* format)
+{
+    statement->type = STATEMENT_INSERT;
+    memset(statement->row_to_insert, 0, ROW_SIZE);
+
+    Schema* schema = &format->schema;
+    bool listed = tokenizer_accept(tokenizer, "values");
+    if(listed && !tokenizer_accept(tokenizer, "("))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    for(int i = 0; i < schema->num_columns; i++)
+    {
+        if(listed && i > 0 && !tokenizer_accept(tokenizer, ","))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        PrepareResult result =
+            prepare_value(tokenizer, &schema->columns[i],
+                          statement->row_to_insert + format->offsets[i]);
+        if(result != PREPARE_SUCCESS)
+        {
+            return result;
+        }
+    }
+    if((listed && !tokenizer_accept(tokenizer, ")")) ||
+       tokenizer->token.type != TOKEN_END)
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    // ids are positive
+    for(int i = 0; i < schema->num_key_columns; i++)
+    {
+        int column = schema->key_columns[i];
+        void* value = statement->row_to_insert + format->offsets[column];
+        int64_t id = 0;
+        if(schema->columns[column].type == COLUMN_INT32)
+        {
+            int32_t id32;
+            memcpy(&id32, value, sizeof(id32));
+            id = id32;
+        }
+        else if(schema->columns[column].type == COLUMN_INT64)
+        {
+            memcpy(&id, value, sizeof(id));
+        }
+        if(id < 0)
+        {
+            return PREPARE_NEGATIVE_ID;
+        }
+    }
+    row_key(format, statement->row_to_insert, statement->key);
+
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * parse "name, ...)" naming the primary key columns
+ */
+PrepareResult prepare_primary_key(Tokenizer* tokenizer, Schema* schema)
+{
+    do
+    {
+        char name[COLUMN_NAME_MAX + 1];
+        if(!tokenizer_name(tokenizer, name, COLUMN_NAME_MAX))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        int column = -1;
+        for(int i = 0; i < schema->num_columns; i++)
+        {
+            if(strcmp(schema->columns[i].name, name) == 0)
+            {
+                column = i;
+            }
+        }
+        for(int i = 0; i < schema->num_key_columns; i++)
+        {
+            if(schema->key_columns[i] == column)
+            {
+                column = -1;
+            }
+        }
+        if(column == -1)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        schema->key_columns[schema->num_key_columns++] = column;
+    } while(tokenizer_accept(tokenizer, ","));
+
+    return tokenizer_accept(tokenizer, ")") ? PREPARE_SUCCESS
+                                            : PREPARE_SYNTAX_ERROR;
+}
+
+/**
+ * parse a column list, "(name type, ...)". types are int32, int64,
+ * double, varchar(n) and blob(n). the list may end with
+ * "primary key (name, ...)", otherwise the first column is the key
+ */
+PrepareResult prepare_schema(Tokenizer* tokenizer, Schema* schema)
+{
+    memset(schema, 0, sizeof(Schema));
+    if(!tokenizer_accept(tokenizer, "("))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    do
+    {
+        if(schema->num_columns > 0 && tokenizer_accept(tokenizer, "primary"))
+        {
+            if(!tokenizer_accept(tokenizer, "key") ||
+               !tokenizer_accept(tokenizer, "("))
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            PrepareResult result = prepare_primary_key(tokenizer, schema);
+            if(result != PREPARE_SUCCESS)
+            {
+                return result;
+            }
+            break;
+        }
+
+        if(schema->num_columns == MAX_COLUMNS)
+        {
+            return PREPARE_ROW_TOO_WIDE;
+        }
+        ColumnDefinition* column = &schema->columns[schema->num_columns++];
+
+        char type_name[16];
+        if(!tokenizer_name(tokenizer, column->name, COLUMN_NAME_MAX) ||
+           !tokenizer_name(tokenizer, type_name, sizeof(type_name) - 1))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        column->type = -1;
+        for(int i = 0; i < NUM_COLUMN_TYPES; i++)
+        {
+            if(strcmp(type_name, COLUMN_CODECS[i].name) == 0)
+            {
+                column->type = i;
+            }
+        }
+        if(column->type == -1)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        bool sized = tokenizer_accept(tokenizer, "(");
+        if(COLUMN_CODECS[column->type].sized != sized)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if(sized)
+        {
+            char length[16];
+            long long value;
+            if(tokenizer_value(tokenizer, length, sizeof(length)) !=
+                   PREPARE_SUCCESS ||
+               parse_integer(length, 0, INT_MAX, &value) != PREPARE_SUCCESS ||
+               !tokenizer_accept(tokenizer, ")"))
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            if(value > ROW_SIZE)
+            {
+                return PREPARE_ROW_TOO_WIDE;
+            }
+            column->length = value;
+        }
+
+        for(int i = 0; i < schema->num_columns - 1; i++)
+        {
+            if(strcmp(schema->columns[i].name, column->name) == 0)
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+        }
+    } while(tokenizer_accept(tokenizer, ","));
+
+    if(!tokenizer_accept(tokenizer, ")"))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if(schema->num_key_columns == 0)
+    {
+        schema->num_key_columns = 1;
+        schema->key_columns[0] = 0;
+    }
+    int key_size = 0;
+    for(int i = 0; i < schema->num_key_columns; i++)
+    {
+        key_size += column_max_key_size(&schema->columns[schema->key_columns[i]]);
+    }
+    if(key_size > KEY_SIZE)
+    {
+        return PREPARE_KEY_TOO_WIDE;
+    }
+
+    RowFormat format;
+    row_format_compile(&format, schema);
+    if(format.row_size > ROW_SIZE)
+    {
+        return PREPARE_ROW_TOO_WIDE;
+    }
+
+    return PREPARE_SUCCESS;
+}
+
+/**
+ * parse "value, ..." giving the first key column's value at which each
+ * partition after the first starts
+ */
+PrepareResult prepare_partitions(Tokenizer* tokenizer, Statement* statement)
+{
+    Schema* schema = &statement->schema;
+    ColumnDefinition* column = &schema->columns[schema->key_columns[0]];
+    const ColumnCodec* codec = &COLUMN_CODECS[column->type];
+
+    statement->num_partitions = 1;
+    memset(statement->partition_bounds[0], 0, KEY_SIZE);
+    do
+    {
+        if(statement->num_partitions == MAX_PARTITIONS)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        char column_value[ROW_SIZE] = {0};
+        PrepareResult result = prepare_value(tokenizer, column, column_value);
+        if(result != PREPARE_SUCCESS)
+        {
+            return result;
+        }
+
+        // a bound on the first column alone sorts before every key that
+        // starts with its value
+        uint8_t* bound = statement->partition_bounds[statement->num_partitions];
+        memset(bound, 0, KEY_SIZE);
+        codec->encode_key(column, column_value, bound);
+        if(key_compare(bound, bound - KEY_SIZE) <= 0)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->num_partitions++;
+    } while(tokenizer_accept(tokenizer, ","));
+
+    return tokenizer->token.type == TOKEN_END ? PREPARE_SUCCESS
+                                              : PREPARE_SYNTAX_ERROR;
+}
+
+/**
+ * select [* | column, ...] [from table] [where ...]
+ *        [order by column [asc | desc]] [limit n]
+ */
+PrepareResult prepare_select(Tokenizer* tokenizer, Statement* statement,
+                             Database* db)
+{
+    statement->type = STATEMENT_SELECT;
+    statement->num_projections = 0;
+    statement->order_column = -1;
+    statement->order_descending = false;
+    statement->limit = -1;
+
+    // the columns are named before their table is
+    Tokenizer columns = *tokenizer;
+    Token* token = &tokenizer->token;
+    if(!tokenizer_accept(tokenizer, "*") && token->type == TOKEN_WORD &&
+       !token_is(token, "from") && !token_is(token, "where") &&
+       !token_is(token, "order") && !token_is(token, "limit"))
+    {
+        do
+        {
+            tokenizer_next(tokenizer);
+        } while(tokenizer_accept(tokenizer, ","));
+    }
+    else
+    {
+        columns.token.type = TOKEN_END;
+    }
+
+    if(tokenizer_accept(tokenizer, "from") &&
+       !tokenizer_name(tokenizer, statement->table_name, TABLE_NAME_MAX))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    Table* table = db_find_table(db, statement->table_name);
+    if(table == NULL)
+    {
+        return PREPARE_NO_SUCH_TABLE;
+    }
+    RowFormat* format = &table->format;
+
+    if(columns.token.type != TOKEN_END)
+    {
+        do
+        {
+            if(statement->num_projections == MAX_COLUMNS)
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            int column = prepare_column(&columns, format);
+            if(column == -1)
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            statement->projections[statement->num_projections++] = column;
+        } while(tokenizer_accept(&columns, ","));
+    }
+
+    PrepareResult result = prepare_where(tokenizer, statement, format);
+    if(result != PREPARE_SUCCESS)
+    {
+        return result;
+    }
+
+    if(tokenizer_accept(tokenizer, "order"))
+    {
+        if(!tokenizer_accept(tokenizer, "by"))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->order_column = prepare_column(tokenizer, format);
+        if(statement->order_column == -1)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->order_descending = tokenizer_accept(tokenizer, "desc");
+        if(!statement->order_descending)
+        {
+            tokenizer_accept(tokenizer, "asc");
+        }
+    }
+    if(tokenizer_accept(tokenizer, "limit"))
+    {
+        char text[16];
+        long long limit;
+        if(tokenizer_value(tokenizer, text, sizeof(text)) != PREPARE_SUCCESS ||
+           parse_integer(text, 0, INT_MAX, &limit) != PREPARE_SUCCESS)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->limit = limit;
+    }
+
+    return tokenizer->token.type == TOKEN_END ? PREPARE_SUCCESS
+                                              : PREPARE_SYNTAX_ERROR;
+}
+/**
+ * update table set column = value, ... [where ...]. key columns cannot
+ * be set: an update never moves a row
+ */
+PrepareResult prepare_update(Tokenizer* tokenizer, Statement* statement,
+                             Database* db)
+{
+    statement->type = STATEMENT_UPDATE;
+    if(!tokenizer_name(tokenizer, statement->table_name, TABLE_NAME_MAX))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    Table* table = db_find_table(db, statement->table_name);
+    if(table == NULL)
+    {
+        return PREPARE_NO_SUCH_TABLE;
+    }
+    RowFormat* format = &table->format;
+    Schema* schema = &format->schema;
+    if(!tokenizer_accept(tokenizer, "set"))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    memset(statement->row_to_insert, 0, ROW_SIZE);
+    statement->num_assignments = 0;
+    do
+    {
+        int column = prepare_column(tokenizer, format);
+        if(column == -1 || !tokenizer_accept(tokenizer, "="))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        for(int i = 0; i < schema->num_key_columns; i++)
+        {
+            if(schema->key_columns[i] == column)
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+        }
+        for(int i = 0; i < statement->num_assignments; i++)
+        {
+            if(statement->assignments[i] == column)
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+        }
+        statement->assignments[statement->num_assignments++] = column;
+
+        PrepareResult result =
+            prepare_value(tokenizer, &schema->columns[column],
+                          statement->row_to_insert + format->offsets[column]);
+        if(result != PREPARE_SUCCESS)
+        {
+            return result;
+        }
+    } while(tokenizer_accept(tokenizer, ","));
+
+    PrepareResult result = prepare_where(tokenizer, statement, format);
+    if(result != PREPARE_SUCCESS)
+    {
+        return result;
+    }
+
+    return tokenizer->token.type == TOKEN_END ? PREPARE_SUCCESS
+                                              : PREPARE_SYNTAX_ERROR;
+}
+
+/**
+ * delete from table [where ...]
+ */
+PrepareResult prepare_delete(Tokenizer* tokenizer, Statement* statement,
+                             Database* db)
+{
+    statement->type = STATEMENT_DELETE;
+    if(!tokenizer_accept(tokenizer, "from") ||
+       !tokenizer_name(tokenizer, statement->table_name, TABLE_NAME_MAX))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    Table* table = db_find_table(db, statement->table_name);
+    if(table == NULL)
+    {
+        return PREPARE_NO_SUCH_TABLE;
+    }
+
+    PrepareResult result = prepare_where(tokenizer, statement, &table->format);
+    if(result != PREPARE_SUCCESS)
+    {
+        return result;
+    }
+
+    return tokenizer->token.type == TOKEN_END ? PREPARE_SUCCESS
+                                              : PREPARE_SYNTAX_ERROR;
+}
+
+PrepareResult prepare_tokens(Tokenizer* tokenizer, Statement* statement,
+                             Database* db)
+{
+    // explain is for the statements that read rows
+    statement->explain = tokenizer_accept(tokenizer, "explain");
+    if(statement->explain && !token_is(&tokenizer->token, "select") &&
+       !token_is(&tokenizer->token, "update") &&
+       !token_is(&tokenizer->token, "delete"))
+    {
+        return PREPARE_SYNTAX_ERROR;
+    }
+
+    if(tokenizer_accept(tokenizer, "insert"))
+    {
+        statement->type = STATEMENT_INSERT;
+
+        if(tokenizer_accept(tokenizer, "into") &&
+           !tokenizer_name(tokenizer, statement->table_name, TABLE_NAME_MAX))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        Table* table = db_find_table(db, statement->table_name);
+        if(table == NULL)
+        {
+            return PREPARE_NO_SUCH_TABLE;
+        }
+
+        return prepare_insert(tokenizer, statement, &table->format);
+    }
+    if(tokenizer_accept(tokenizer, "select"))
+    {
+        return prepare_select(tokenizer, statement, db);
+    }
+    if(tokenizer_accept(tokenizer, "update"))
+    {
+        return prepare_update(tokenizer, statement, db);
+    }
+    if(tokenizer_accept(tokenizer, "delete"))
+    {
+        return prepare_delete(tokenizer, statement, db);
+    }
+    if(tokenizer_accept(tokenizer, "create"))
+    {
+        statement->type = STATEMENT_CREATE_TABLE;
+        statement->engine = TABLE_ENGINE_BTREE;
+        if(!tokenizer_accept(tokenizer, "table") ||
+           !tokenizer_name(tokenizer, statement->table_name, TABLE_NAME_MAX))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+
+        statement->num_partitions = 0;
+        schema_default(&statement->schema);
+        if(tokenizer->token.type == TOKEN_SYMBOL)
+        {
+            PrepareResult result =
+                prepare_schema(tokenizer, &statement->schema);
+            if(result != PREPARE_SUCCESS)
+            {
+                return result;
+            }
+        }
+        if(tokenizer_accept(tokenizer, "lsm"))
+        {
+            statement->engine = TABLE_ENGINE_LSM;
+        }
+        else if(tokenizer_accept(tokenizer, "partition"))
+        {
+            if(!tokenizer_accept(tokenizer, "at"))
+            {
+                return PREPARE_SYNTAX_ERROR;
+            }
+            return prepare_partitions(tokenizer, statement);
+        }
+        return tokenizer->token.type == TOKEN_END ? PREPARE_SUCCESS
+                                                  : PREPARE_SYNTAX_ERROR;
+    }
+    if(tokenizer_accept(tokenizer, "drop"))
+    {
+        statement->type = STATEMENT_DROP_TABLE;
+        if(!tokenizer_accept(tokenizer, "table") ||
+           !tokenizer_name(tokenizer, statement->table_name, TABLE_NAME_MAX) ||
+           tokenizer->token.type != TOKEN_END)
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        return PREPARE_SUCCESS;
+    }
+    if(tokenizer_accept(tokenizer, "analyze"))
+    {
+        statement->type = STATEMENT_ANALYZE;
+        statement->table_name[0] = '\0';
+        if(tokenizer->token.type != TOKEN_END &&
+           (!tokenizer_name(tokenizer, statement->table_name, TABLE_NAME_MAX) ||
+            tokenizer->token.type != TOKEN_END))
+        {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        return PREPARE_SUCCESS;
+    }
+
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+CachedPlan* plan_cache_find(Database* db, const char* text)
+{
+    if(text[0] == '\0')
+    {
+        return NULL;
+    }
+
+    for(int i = 0; i < PLAN_CACHE_SLOTS; i++)
+    {
+        CachedPlan* plan = &db->plans[i];
+        if(plan->used && strcmp(plan->statement.text, text) == 0)
+        {
+            Table* table = db_find_table(db, plan->statement.table_name);
+            if(table == NULL || table->id != plan->table_id)
+            {
+                plan_release(plan);
+                break;
+            }
+            plan->used_at = ++db->plan_clock;
+            db->plan_hits++;
+            if(db->jit && ++plan->executions == JIT_HOT_EXECUTIONS)
+            {
+                plan->statement.native_filter =
+                    jit_compile_filter(table, &plan->statement);
+                db->jit_compiled += plan->statement.native_filter != NULL;
+            }
+            return plan;
+        }
+    }
+
+    db->plan_misses++;
+    return NULL;
+}
+
+void plan_cache_put(Database* db, Statement* statement)
+{
+    Table* table = db_find_table(db, statement->table_name);
+    if(statement->text[0] == '\0' || table == NULL)
+    {
+        return;
+    }
+
+    CachedPlan* victim = &db->plans[0];
+    for(int i = 0; i < PLAN_CACHE_SLOTS && victim->used; i++)
+    {
+        CachedPlan* plan = &db->plans[i];
+        if(!plan->used || plan->used_at < victim->used_at)
+        {
+            victim = plan;
+        }
+    }
+
+    plan_release(victim);
+    victim->used = true;
+    victim->used_at = ++db->plan_clock;
+    victim->table_id = table->id;
+    victim->executions = 0;
+    victim->statement = *statement;
+}
+
+/**
+ * parse the line in one pass, unless the same text was prepared before.
+ * the input buffer is left as it was
+ */
+PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement,
+                                Database* db)
+{
+    statement_normalize(input_buffer->buffer, statement->text);
+    CachedPlan* plan = plan_cache_find(db, statement->text);
+    if(plan != NULL)
+    {
+        *statement = plan->statement;
+        return PREPARE_SUCCESS;
+    }
+
+    Tokenizer tokenizer;
+    tokenizer_start(&tokenizer, input_buffer->buffer);
+    strcpy(statement->table_name, DEFAULT_TABLE_NAME);
+    statement->native_filter = NULL;
+
+    PrepareResult result = prepare_tokens(&tokenizer, statement, db);
+    // inserts hardly ever repeat their text, and table definitions run
+    // once. caching them would only push out plans that do get reused
+    if(result == PREPARE_SUCCESS &&
+       (statement->type == STATEMENT_SELECT ||
+        statement->type == STATEMENT_UPDATE ||
+        statement->type == STATEMENT_DELETE))
+    {
+        plan_cache_put(db, statement);
+    }
+
+    return result;
+}
+
+
+ExecuteResult lsm_execute_insert(Statement* statement, Database* db,
+                                 Table* table)
+{
+    uint8_t* key_to_insert = statement->key;
+    char* entry = malloc(LSM_ENTRY_SIZE);
+
+    if(lsm_get(table->lsm, key_to_insert, entry))
+    {
+        free(entry);
+        return EXECUTE_DUPLICATE_KEY;
+    }
+
+    memcpy(lsm_entry_key(entry), key_to_insert, KEY_SIZE);
+    *lsm_entry_flags(entry) = 0;
+    memcpy(lsm_entry_value(entry), statement->row_to_insert, ROW_SIZE);
+    int sequence = lsm_put(table->lsm, entry);
+    table->version++;
+    table->stats.num_rows++;
+
+    cdc_emit(db->cdc, sequence, table->id, CDC_INSERT, key_to_insert,
+             lsm_entry_value(entry), table->format.row_size);
+    cdc_flush(db->cdc);
+
+    free(entry);
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert(Statement* statement, Database* db)
+{
+    Table* table = db_find_table(db, statement->table_name);
+    if(table == NULL)
+    {
+        return EXECUTE_NO_SUCH_TABLE;
+    }
+    if(table->pager->wal->read_only)
+    {
+        return EXECUTE_READ_ONLY;
+    }
+    if(table->engine == TABLE_ENGINE_LSM)
+    {
+        return lsm_execute_insert(statement, db, table);
+    }
+
+    uint8_t* key_to_insert = statement->key;
+    Table* partition = table_partition(table, key_to_insert);
+    if(tree_lookup(partition, key_to_insert) != NULL)
+    {
+        return EXECUTE_DUPLICATE_KEY;
+    }
+
+    if(!tree_has_room(partition, 0))
+    {
+        return EXECUTE_TABLE_FULL;
+    }
+
+    char* message = malloc(MESSAGE_SIZE);
+    memcpy(message_key(message), key_to_insert, KEY_SIZE);
+    memcpy(message_value(message), statement->row_to_insert, ROW_SIZE);
+
+    // inserts are queued at the root and only reach a leaf when the
+    // buffers on the way flush
+    tree_insert_message(partition, message, tree_height(partition));
+    wal_commit(partition->pager);
+    table->version++;
+    table->stats.num_rows++;
+
+    // partitions count LSNs each on their own
+    cdc_emit(db->cdc, partition->pager->lsn, table->id, CDC_INSERT,
+             key_to_insert, message_value(message), table->format.row_size);
+    cdc_flush(db->cdc);
+
+    free(message);
+
+    return EXECUTE_SUCCESS;
+}
+
+CachedResult* result_cache_slot(Database* db, const char* statement)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for(const char* c = statement; *c != '\0'; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+
+    return &db->results[hash % RESULT_CACHE_SLOTS];
+}
+
+CachedResult* result_cache_find(Database* db, Table* table,
+                                const char* statement)
+{
+    CachedResult* result = result_cache_slot(db, statement);
+    if(result->used && result->table_id == table->id &&
+       result->version == table->version &&
+       strcmp(result->statement, statement) == 0)
+    {
+        db->result_hits++;
+        return result;
+    }
+
+    db->result_misses++;
+    return NULL;
+}
+
+/**
+ * takes ownership of rows
+ */
+void result_cache_put(Database* db, Table* table, const char* statement,
+                      char* rows, int num_rows)
+{
+    CachedResult* result = result_cache_slot(db, statement);
+    free(result->rows);
+
+    result->used = true;
+    snprintf(result->statement, STATEMENT_TEXT_MAX, "%s", statement);
+    result->table_id = table->id;
+    result->version = table->version;
+    result->num_rows = num_rows;
+    result->rows = rows;
+}
+
+/**
+ * a row and where it sorts for order by. ties keep the order the rows
+ * were found in
+ */
+typedef struct
+{
+    uint8_t key[COLUMN_SORT_KEY_MAX];
+    int index;
+} SortedRow;
+
+int compare_sorted_rows(const void* a, const void* b)
+{
+    const SortedRow* row_a = a;
+    const SortedRow* row_b = b;
+    int order = memcmp(row_a->key, row_b->key, COLUMN_SORT_KEY_MAX);
+
+    return order != 0 ? order : row_a->index - row_b->index;
+}
+
+/**
+ * sort rows, each ROW_SIZE bytes, on a column. returns the sorted copy
+ * and frees rows
+ */
+char* rows_sort(RowFormat* format, char* rows, int num_rows, int column,
+                bool descending)
+{
+    if(num_rows < 2)
+    {
+        return rows;
+    }
+
+    SortedRow* sorted = malloc(num_rows * sizeof(SortedRow));
+    for(int i = 0; i < num_rows; i++)
+    {
+        column_sort_key(&format->schema.columns[column],
+                        rows + i * ROW_SIZE + format->offsets[column],
+                        sorted[i].key);
+        // descending order is read back to front, ties still go first
+        // to last
+        sorted[i].index = descending ? num_rows - 1 - i : i;
+    }
+    qsort(sorted, num_rows, sizeof(SortedRow), compare_sorted_rows);
+
+    char* sorted_rows = malloc(num_rows * ROW_SIZE);
+    for(int i = 0; i < num_rows; i++)
+    {
+        int index = descending ? num_rows - 1 - sorted[num_rows - 1 - i].index
+                               : sorted[i].index;
+        memcpy(sorted_rows + i * ROW_SIZE, rows + index * ROW_SIZE, ROW_SIZE);
+    }
+    free(sorted);
+    free(rows);
+
+    return sorted_rows;
+}
+
+typedef enum
+{
+    ACCESS_FULL_SCAN,
+    ACCESS_KEY_RANGE,  // a seek to the lower bound, a scan to the upper
+    ACCESS_KEY_LOOKUP, // every key column is given
+    NUM_ACCESS_METHODS
+} AccessMethod;
+
+/**
+ * how the rows of a statement are read, with its estimated cost in pages
+ */
+typedef struct
+{
+    AccessMethod method;
+    bool has_lower;
+    uint8_t lower[KEY_SIZE]; // the key itself for a lookup
+    bool has_upper;
+    uint8_t upper[KEY_SIZE]; // inclusive
+    double num_rows;
+    double cost;
+} AccessPath;
+
+/**
+ * the share of the rows analyze saw whose keys sort before key
+ */
+double table_stats_position(TableStats* stats, const uint8_t* key)
+{
+    int below = 0;
+    for(int i = 0; i < stats->num_bounds; i++)
+    {
+        below += key_compare(stats->bounds[i], key) < 0;
+    }
+
+    return stats->num_bounds > 0 ? (double)below / stats->num_bounds : 0;
+}
+
+/**
+ * the key bounds the predicates put on the first key column. a bound on
+ * that column alone is its encoding padded with zeroes, or with 0xff to
+ * also cover every key that starts with it
+ */
+void access_path_bounds(Table* table, Statement* statement, AccessPath* path)
+{
+    int column = table->format.schema.key_columns[0];
+
+    path->has_lower = false;
+    path->has_upper = false;
+    for(int i = 0; i < statement->num_predicates; i++)
+    {
+        Predicate* predicate = &statement->predicates[i];
+        CompareOperator op = predicate->op;
+        if(predicate->column != column || op == COMPARE_NOT_EQUAL)
+        {
+            continue;
+        }
+
+        uint8_t bound[KEY_SIZE];
+        if(op != COMPARE_LESS && op != COMPARE_LESS_EQUAL)
+        {
+            memset(bound, op == COMPARE_GREATER ? 0xff : 0, KEY_SIZE);
+            memcpy(bound, predicate->value, predicate->length);
+            if(!path->has_lower || key_compare(bound, path->lower) > 0)
+            {
+                memcpy(path->lower, bound, KEY_SIZE);
+                path->has_lower = true;
+            }
+        }
+        if(op != COMPARE_GREATER && op != COMPARE_GREATER_EQUAL)
+        {
+            memset(bound, op == COMPARE_LESS ? 0 : 0xff, KEY_SIZE);
+            memcpy(bound, predicate->value, predicate->length);
+            if(op == COMPARE_LESS)
+            {
+                // the last key below the value's: subtract one
+                int i = KEY_SIZE - 1;
+                while(i >= 0 && bound[i] == 0)
+                {
+                    bound[i--] = 0xff;
+                }
+                if(i < 0)
+                {
+                    // nothing sorts below, read an empty range
+                    memset(bound, 0, KEY_SIZE);
+                    memset(path->lower, 0xff, KEY_SIZE);
+                    path->has_lower = true;
+                }
+                else
+                {
+                    bound[i]--;
+                }
+            }
+            if(!path->has_upper || key_compare(bound, path->upper) < 0)
+            {
+                memcpy(path->upper, bound, KEY_SIZE);
+                path->has_upper = true;
+            }
+        }
+    }
+}
+
+/**
+ * the whole key, when an equality predicate gives every key column
+ */
+bool access_path_key(Table* table, Statement* statement, uint8_t* key)
+{
+    Schema* schema = &table->format.schema;
+    int length = 0;
+
+    memset(key, 0, KEY_SIZE);
+    for(int i = 0; i < schema->num_key_columns; i++)
+    {
+        Predicate* equal = NULL;
+        for(int j = 0; j < statement->num_predicates; j++)
+        {
+            Predicate* predicate = &statement->predicates[j];
+            if(predicate->column == schema->key_columns[i] &&
+               predicate->op == COMPARE_EQUAL)
+            {
+                equal = predicate;
+            }
+        }
+        if(equal == NULL || length + equal->length > KEY_SIZE)
+        {
+            return false;
+        }
+        memcpy(key + length, equal->value, equal->length);
+        length += equal->length;
     }
-}
 
-int* internal_node_key(void* node, int key_num)
-{
-    return internal_node_cell(node, key_num) + INTERNAL_NODE_CHILD_SIZE;
+    return true;
 }
 
-int get_node_max_key(void* node)
+/**
+ * pick the cheapest way to read the rows of statement. costs count pages:
+ * a descent to the first row, then the rows it reads at a page's worth
+ * of rows per page. without analyze there is no row count to go on, and
+ * a lookup is taken over a range and a range over a scan
+ */
+void access_path_choose(Table* table, Statement* statement, AccessPath* path)
 {
-    switch(get_node_type(node))
+    TableStats* stats = &table->stats;
+    bool is_lsm = table->engine == TABLE_ENGINE_LSM;
+    double rows_per_page = is_lsm ? LSM_INDEX_INTERVAL : LEAF_NODE_MAX_CELLS;
+    double descent = is_lsm ? table->lsm->num_runs + 1
+                     : table->num_partitions > 0
+                         ? tree_height(table->partitions[0]) + 1
+                         : tree_height(table) + 1;
+    double num_rows = stats->num_rows > 0 ? stats->num_rows : 0;
+
+    AccessPath candidates[NUM_ACCESS_METHODS];
+    int num_candidates = 0;
+
+    AccessPath* scan = &candidates[num_candidates++];
+    scan->method = ACCESS_FULL_SCAN;
+    scan->has_lower = false;
+    scan->has_upper = false;
+    scan->num_rows = num_rows;
+    scan->cost = 1 + num_rows / rows_per_page;
+
+    AccessPath* range = &candidates[num_candidates];
+    access_path_bounds(table, statement, range);
+    if(range->has_lower || range->has_upper)
     {
-    case NODE_INTERNAL:
-        return *internal_node_key(node, *internal_node_num_keys(node) - 1);
-    case NODE_LEAF:
-        return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+        double from = range->has_lower
+                          ? table_stats_position(stats, range->lower)
+                          : 0;
+        double to = range->has_upper ? table_stats_position(stats, range->upper)
+                                     : 1;
+        range->method = ACCESS_KEY_RANGE;
+        range->num_rows = to > from ? (to - from) * num_rows : 0;
+        // a range between two histogram bounds still holds some rows
+        if(range->num_rows < 1)
+        {
+            range->num_rows = 1;
+        }
+        range->cost = descent + range->num_rows / rows_per_page;
+        num_candidates++;
     }
-}
 
-bool is_node_root(void* node)
-{
-    int value = *((int*)(node + IS_ROOT_OFFSET));
-    return (bool)value;
-}
+    AccessPath* lookup = &candidates[num_candidates];
+    if(access_path_key(table, statement, lookup->lower))
+    {
+        lookup->method = ACCESS_KEY_LOOKUP;
+        lookup->has_lower = true;
+        lookup->has_upper = false;
+        lookup->num_rows = 1;
+        lookup->cost = descent;
+        num_candidates++;
+    }
 
-void set_node_root(void* node, bool is_root)
-{
-    int value = is_root;
-    *((int*)(node + IS_ROOT_OFFSET)) = value;
+    *path = candidates[0];
+    for(int i = 1; i < num_candidates; i++)
+    {
+        if(!stats->analyzed || candidates[i].cost < path->cost)
+        {
+            *path = candidates[i];
+        }
+    }
 }
 
-void initialize_leaf_node(void* node)
+/**
+ * the row with the given key, NULL if there is none. entry holds an LSM
+ * table's row
+ */
+void* table_lookup_row(Table* table, const uint8_t* key, char* entry)
 {
-    set_node_type(node, NODE_LEAF);
-    set_node_root(node, false);
-    *leaf_node_num_cells(node) = 0;
+    if(table->engine == TABLE_ENGINE_LSM)
+    {
+        return lsm_get(table->lsm, key, entry) ? lsm_entry_value(entry)
+                                               : NULL;
+    }
+
+    return tree_lookup(table_partition(table, key), key);
 }
 
-void initialize_internal_node(void* node)
+/**
+ * the row source of a select, update or delete runs as a program of these
+ * on a few registers. p3 is the instruction a jump goes to
+ */
+typedef enum
 {
-    set_node_type(node, NODE_INTERNAL);
-    set_node_root(node, false);
-    *internal_node_num_keys(node) = 0;
-}
+    OP_REWIND,      // p1: partition to open at its first row, p3: if empty
+    OP_SEEK_GE,     // p1: partition to open at the lower bound, p3: if empty
+    OP_KEY_LOOKUP,  // p3: when no row has the lookup key
+    OP_AT_LIMIT,    // p1: row count, p3: when that many rows are out
+    OP_PAST_UPPER,  // p3: when the cursor's key is past the upper bound
+    OP_COLUMN,      // p1: register, p2: column, loaded in the key encoding
+    OP_EQ,          // p1: register, p2: predicate, p3: unless it holds
+    OP_NE,          // the same for each of the other operators
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_NATIVE_FILTER, // p3: unless the compiled predicates hold
+    OP_RESULT_ROW,
+    OP_NEXT,        // p3: when the cursor has another row
+    OP_CLOSE,
+    OP_HALT,
+    NUM_OPCODES
+} Opcode;
 
 typedef struct
 {
-    int num_rows;
-    Pager* pager;
-    int root_page_num;
-} Table;
+    Opcode opcode;
+    int p1;
+    int p2;
+    int p3;
+} Instruction;
 
-Table* db_open(const char* filename)
+typedef struct
 {
-    Pager* pager = pager_open(filename);
-
-    Table* table = malloc(sizeof(Table));
-    table->pager = pager;
-    table->root_page_num = 0;
+    Instruction instructions[VM_MAX_INSTRUCTIONS];
+    int num_instructions;
+} Program;
 
-    if(pager->num_pages == 0)
-    {
-        // new db file. initialize page 0 as leaf node
-        void* root_node = get_page(pager, 0);
-        initialize_leaf_node(root_node);
-        set_node_root(root_node, true);
-    }
+// jump targets not emitted yet
+#define JUMP_TO_NEXT_ROW -1
+#define JUMP_TO_END -2
 
-    return table;
+int program_emit(Program* program, Opcode opcode, int p1, int p2, int p3)
+{
+    Instruction* instruction =
+        &program->instructions[program->num_instructions];
+    instruction->opcode = opcode;
+    instruction->p1 = p1;
+    instruction->p2 = p2;
+    instruction->p3 = p3;
+
+    return program->num_instructions++;
 }
 
-void db_close(Table* table)
+void program_patch(Program* program, int from, int placeholder, int target)
 {
-    Pager* pager = table->pager;
-    int num_full_pages = table->num_rows / ROWS_PER_PAGE;
-
-    for(int i = 0; i < pager->num_pages; i++)
+    for(int i = from; i < program->num_instructions; i++)
     {
-        if(pager->pages[i] == NULL)
+        if(program->instructions[i].p3 == placeholder)
         {
-            continue;
+            program->instructions[i].p3 = target;
         }
-
-        pager_flush(pager, i);
-        free(pager->pages[i]);
-        pager->pages[i] == NULL;
     }
+}
 
-    int result = close(pager->file_descriptor);
-    if(result == -1)
+/**
+ * load the columns the predicates test and test them, failing to the
+ * next row. predicates on the same column share its register
+ */
+void program_filter(Program* program, Statement* statement)
+{
+    if(statement->native_filter != NULL)
     {
-        printf("Error closing db file\n");
-        exit(EXIT_FAILURE);
+        program_emit(program, OP_NATIVE_FILTER, 0, 0, JUMP_TO_NEXT_ROW);
+        return;
     }
 
-    for(int i = 0; i < TABLE_MAX_PAGES; i++)
+    int columns[MAX_PREDICATES];
+    int num_registers = 0;
+
+    for(int i = 0; i < statement->num_predicates; i++)
     {
-        void* page = pager->pages[i];
-        if(page)
+        Predicate* predicate = &statement->predicates[i];
+        int reg = 0;
+        while(reg < num_registers && columns[reg] != predicate->column)
+        {
+            reg++;
+        }
+        if(reg == num_registers)
         {
-            free(page);
-            pager->pages[i] = NULL;
+            columns[num_registers++] = predicate->column;
+            program_emit(program, OP_COLUMN, reg, predicate->column, 0);
         }
+        program_emit(program, OP_EQ + predicate->op, reg, i,
+                     JUMP_TO_NEXT_ROW);
     }
-
-    free(pager);
-    free(table);
 }
 
-typedef struct
-{
-    Table* table;
-    int row_num;
-    int page_num;
-    int cell_num;
-    bool end_of_table;
-} Cursor;
-
-Cursor* leaf_node_find(Table* table, int page_num, int key)
+/**
+ * the program reading the rows of statement along path. partitions hold
+ * consecutive key ranges, scanning them in turn keeps the rows in key
+ * order, and those wholly below the lower bound are left out
+ */
+void program_compile(Table* table, Statement* statement, AccessPath* path,
+                     Program* program)
 {
-    void* node = get_page(table->pager, page_num);
-    int num_cells = *leaf_node_num_cells(node);
-
-    Cursor* cursor = malloc(sizeof(Cursor));
-    cursor->table = table;
-    cursor->page_num = page_num;
+    bool is_select = statement->type == STATEMENT_SELECT;
+    bool ordered = is_select && statement->order_column != -1;
+    // without an order the scan can stop at the limit
+    int limit = is_select && !ordered ? statement->limit : -1;
 
-    // binary search
-    int min_index = 0;
-    int one_past_max_index = num_cells;
-    while(one_past_max_index != min_index)
+    program->num_instructions = 0;
+    if(path->method == ACCESS_KEY_LOOKUP)
     {
-        int index = (min_index + one_past_max_index) / 2;
-        int ket_at_index = *leaf_node_key(node, index);
-
-        if(key == ket_at_index)
+        if(limit != -1)
         {
-            cursor->cell_num = index;
-            return cursor;
+            program_emit(program, OP_AT_LIMIT, limit, 0, JUMP_TO_END);
         }
+        program_emit(program, OP_KEY_LOOKUP, 0, 0, JUMP_TO_END);
+        program_filter(program, statement);
+        program_patch(program, 0, JUMP_TO_NEXT_ROW, JUMP_TO_END);
+        program_emit(program, OP_RESULT_ROW, 0, 0, 0);
+    }
 
-        if(key < ket_at_index)
+    int num_scans = table->num_partitions > 0 ? table->num_partitions : 1;
+    for(int i = 0; i < num_scans && path->method != ACCESS_KEY_LOOKUP; i++)
+    {
+        if(path->has_lower && i + 1 < table->num_partitions &&
+           key_compare(path->lower, table->partition_bounds[i + 1]) >= 0)
         {
-            one_past_max_index = index;
+            continue;
         }
-        else
+        int open = program_emit(program,
+                                path->has_lower ? OP_SEEK_GE : OP_REWIND, i,
+                                0, 0);
+        int loop = program->num_instructions;
+        if(limit != -1)
         {
-            min_index = index + 1;
+            program_emit(program, OP_AT_LIMIT, limit, 0, JUMP_TO_END);
+        }
+        if(path->has_upper)
+        {
+            program_emit(program, OP_PAST_UPPER, 0, 0, JUMP_TO_END);
         }
+        program_filter(program, statement);
+        program_emit(program, OP_RESULT_ROW, 0, 0, 0);
+        int next = program_emit(program, OP_NEXT, 0, 0, loop);
+        program_patch(program, loop, JUMP_TO_NEXT_ROW, next);
+        program->instructions[open].p3 =
+            program_emit(program, OP_CLOSE, 0, 0, 0);
     }
 
-    cursor->cell_num = min_index;
-
-    return cursor;
+    int end = program_emit(program, OP_CLOSE, 0, 0, 0);
+    program_emit(program, OP_HALT, 0, 0, 0);
+    program_patch(program, 0, JUMP_TO_END, end);
 }
 
-Cursor* table_start(Table* table)
+/**
+ * run program, collecting the rows it puts out, ROW_SIZE bytes each.
+ * each instruction jumps straight to the next one's code
+ */
+int program_run(Program* program, Table* table, Statement* statement,
+                AccessPath* path, char** rows)
 {
-    Cursor* cursor = malloc(sizeof(Cursor));
+    static void* const dispatch[NUM_OPCODES] = {
+        [OP_REWIND] = &&rewind,         [OP_SEEK_GE] = &&seek_ge,
+        [OP_KEY_LOOKUP] = &&key_lookup, [OP_AT_LIMIT] = &&at_limit,
+        [OP_PAST_UPPER] = &&past_upper, [OP_COLUMN] = &&column,
+        [OP_EQ] = &&eq,                 [OP_NE] = &&ne,
+        [OP_LT] = &&lt,                 [OP_LE] = &&le,
+        [OP_GT] = &&gt,                 [OP_GE] = &&ge,
+        [OP_NATIVE_FILTER] = &&native_filter,
+        [OP_RESULT_ROW] = &&result_row, [OP_NEXT] = &&next,
+        [OP_CLOSE] = &&close,           [OP_HALT] = &&halt};
+
+    RowFormat* format = &table->format;
+    uint8_t registers[MAX_PREDICATES][COLUMN_SORT_KEY_MAX];
+    int lengths[MAX_PREDICATES];
+    char entry[LSM_ENTRY_SIZE];
+    Cursor* cursor = NULL;
+    void* row = NULL;
+    int order = 0;
+    int capacity = 64;
+    int num_rows = 0;
+    *rows = malloc(capacity * ROW_SIZE);
+
+    Instruction* pc = program->instructions;
+
+#define DISPATCH() goto *dispatch[pc->opcode]
+#define STEP()                                                                 \
+    do                                                                         \
+    {                                                                          \
+        pc++;                                                                  \
+        DISPATCH();                                                            \
+    } while(0)
+#define JUMP()                                                                 \
+    do                                                                         \
+    {                                                                          \
+        pc = program->instructions + pc->p3;                                   \
+        DISPATCH();                                                            \
+    } while(0)
+#define COMPARE()                                                              \
+    order = memcmp(registers[pc->p1], statement->predicates[pc->p2].value,     \
+                   lengths[pc->p1] > statement->predicates[pc->p2].length      \
+                       ? lengths[pc->p1]                                       \
+                       : statement->predicates[pc->p2].length)
+
+    DISPATCH();
+
+rewind:
+seek_ge:
+{
+    // no encoded key sorts below all zeroes
+    static const uint8_t first_key[KEY_SIZE] = {0};
+    Table* source =
+        table->num_partitions > 0 ? table->partitions[pc->p1] : table;
+    cursor = table_seek(source,
+                        pc->opcode == OP_SEEK_GE ? path->lower : first_key,
+                        path->has_upper ? path->upper : NULL);
+    if(cursor->end_of_table)
+    {
+        JUMP();
+    }
+    row = cursor_value(cursor);
+    STEP();
+}
 
-    cursor->table = table;
-    cursor->page_num = table->root_page_num;
-    cursor->cell_num = 0;
+key_lookup:
+    row = table_lookup_row(table, path->lower, entry);
+    if(row == NULL)
+    {
+        JUMP();
+    }
+    STEP();
+
+at_limit:
+    if(num_rows >= pc->p1)
+    {
+        JUMP();
+    }
+    STEP();
 
-    void* root_node = get_page(table->pager, table->root_page_num);
-    int num_cells = *leaf_node_num_cells(root_node);
-    cursor->end_of_table = (num_cells == 0);
+past_upper:
+    if(key_compare(cursor_key(cursor), path->upper) > 0)
+    {
+        JUMP();
+    }
+    STEP();
 
-    return cursor;
-}
+column:
+    lengths[pc->p1] =
+        column_sort_key(&format->schema.columns[pc->p2],
+                        row + format->offsets[pc->p2], registers[pc->p1]);
+    STEP();
 
-/**
- * return the position of the given key
- * if the key is not present, return the position where it should be inserted
- */
-Cursor* table_find(Table* table, int key)
-{
-    int root_page_num = table->root_page_num;
-    void* root_node = get_page(table->pager, root_page_num);
+eq:
+    COMPARE();
+    if(order != 0)
+    {
+        JUMP();
+    }
+    STEP();
 
-    if(get_node_type(root_node) == NODE_LEAF)
+ne:
+    COMPARE();
+    if(order == 0)
     {
-        return leaf_node_find(table, root_page_num, key);
+        JUMP();
     }
-    else
+    STEP();
+
+lt:
+    COMPARE();
+    if(order >= 0)
     {
-        printf("Need to to implement serching an internal node\n");
-        exit(EXIT_FAILURE);
+        JUMP();
     }
-}
+    STEP();
 
-void cursor_advance(Cursor* cursor)
-{
-    int page_num = cursor->page_num;
-    void* node = get_page(cursor->table->pager, page_num);
+le:
+    COMPARE();
+    if(order > 0)
+    {
+        JUMP();
+    }
+    STEP();
 
-    cursor->cell_num += 1;
-    if(cursor->cell_num >= (*leaf_node_num_cells(node)))
+gt:
+    COMPARE();
+    if(order <= 0)
     {
-        cursor->end_of_table = true;
+        JUMP();
     }
-}
+    STEP();
 
-void* cursor_value(Cursor* cursor)
-{
-    int page_num = cursor->page_num;
-    void* page = get_page(cursor->table->pager, page_num);
+ge:
+    COMPARE();
+    if(order < 0)
+    {
+        JUMP();
+    }
+    STEP();
 
-    return leaf_node_value(page, cursor->cell_num);
-}
+native_filter:
+    if(!statement->native_filter(row))
+    {
+        JUMP();
+    }
+    STEP();
 
-void leaf_node_insert(Cursor* cursor, int key, Row* value)
-{
-    void* node = get_page(cursor->table->pager, cursor->page_num);
+result_row:
+    if(num_rows == capacity)
+    {
+        capacity *= 2;
+        *rows = realloc(*rows, capacity * ROW_SIZE);
+    }
+    memcpy(*rows + num_rows++ * ROW_SIZE, row, ROW_SIZE);
+    STEP();
 
-    int num_cells = *leaf_node_num_cells(node);
-    if(num_cells >= LEAF_NODE_MAX_CELLS)
+next:
+    cursor_advance(cursor);
+    if(!(cursor->end_of_table))
     {
-        // node full
-        printf("Need to implement splitting a leaf node\n");
-        exit(EXIT_FAILURE);
+        row = cursor_value(cursor);
+        JUMP();
     }
+    STEP();
 
-    if(cursor->cell_num < num_cells)
+close:
+    if(cursor != NULL)
     {
-        // make room for new cell
-        for(int i = num_cells; i > cursor->cell_num; i--)
-        {
-            memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i - 1),
-                   LEAF_NODE_CELL_SIZE);
-        }
+        cursor_close(cursor);
+        cursor = NULL;
     }
+    STEP();
 
-    *(leaf_node_num_cells(node)) += 1;
-    *(leaf_node_key(node, cursor->cell_num)) = key;
+halt:
+    return num_rows;
 
-    serialize_row(value, leaf_node_value(node, cursor->cell_num));
+#undef DISPATCH
+#undef STEP
+#undef JUMP
+#undef COMPARE
 }
 
-typedef struct
-{
-    char* buffer;
-    size_t buffer_length;
-    ssize_t input_length;
-} InputBuffer;
-
-InputBuffer* new_input_buffer()
+/**
+ * the rows of table a select, update or delete applies to, ROW_SIZE
+ * bytes each. they are in key order unless a select orders them
+ */
+int table_select_rows(Table* table, Statement* statement, char** rows)
 {
-    InputBuffer* input_buffer = malloc(sizeof(InputBuffer));
+    AccessPath path;
+    access_path_choose(table, statement, &path);
 
-    input_buffer->buffer = NULL;
-    input_buffer->buffer_length = 0;
-    input_buffer->input_length = 0;
+    Program program;
+    program_compile(table, statement, &path, &program);
+    int num_rows = program_run(&program, table, statement, &path, rows);
 
-    return input_buffer;
-}
+    if(statement->type == STATEMENT_SELECT && statement->order_column != -1)
+    {
+        *rows = rows_sort(&table->format, *rows, num_rows,
+                          statement->order_column, statement->order_descending);
+        if(statement->limit != -1 && num_rows > statement->limit)
+        {
+            num_rows = statement->limit;
+        }
+    }
 
-void print_prompt()
-{
-    printf("db > ");
+    return num_rows;
 }
 
-void read_input(InputBuffer* input_buffer)
+uint64_t hash_bytes(const uint8_t* bytes, int length)
 {
-    ssize_t bytes_read =
-        getline(&(input_buffer->buffer), &(input_buffer->buffer_length), stdin);
-    if(bytes_read <= 0)
+    // FNV-1a
+    uint64_t hash = 14695981039346656037u;
+    for(int i = 0; i < length; i++)
     {
-        printf("Error reading input\n");
-        exit(EXIT_FAILURE);
+        hash = (hash ^ bytes[i]) * 1099511628211u;
     }
 
-    // Ignore trailing newline
-    input_buffer->input_length = bytes_read - 1;
-    input_buffer->buffer[bytes_read - 1] = 0;
+    return hash;
 }
 
-void close_input_buffer(InputBuffer* input_buffer)
+int compare_hashes(const void* a, const void* b)
 {
-    free(input_buffer->buffer);
-    free(input_buffer);
+    uint64_t hash_a = *(const uint64_t*)a;
+    uint64_t hash_b = *(const uint64_t*)b;
+
+    return hash_a < hash_b ? -1 : hash_a > hash_b;
 }
 
-void indent(int level)
+/**
+ * read every row of table to count them, the distinct values of each
+ * column and the histogram of their keys
+ */
+void table_analyze(Table* table)
 {
-    for(int i = 0; i < level; i++)
+    RowFormat* format = &table->format;
+    TableStats* stats = &table->stats;
+    Statement all = {.type = STATEMENT_SELECT, .order_column = -1,
+                     .limit = -1};
+    char* rows;
+    int num_rows = table_select_rows(table, &all, &rows);
+
+    stats->analyzed = true;
+    stats->num_rows = num_rows;
+
+    // distinct values counted by hash, a collision now and then only
+    // makes the count a little low
+    uint64_t* hashes = malloc((num_rows + 1) * sizeof(uint64_t));
+    for(int column = 0; column < format->schema.num_columns; column++)
     {
-        printf(" ");
+        for(int i = 0; i < num_rows; i++)
+        {
+            uint8_t key[COLUMN_SORT_KEY_MAX];
+            int length = column_sort_key(&format->schema.columns[column],
+                                         rows + i * ROW_SIZE +
+                                             format->offsets[column],
+                                         key);
+            hashes[i] = hash_bytes(key, length);
+        }
+        qsort(hashes, num_rows, sizeof(uint64_t), compare_hashes);
+
+        stats->distinct[column] = 0;
+        for(int i = 0; i < num_rows; i++)
+        {
+            stats->distinct[column] += i == 0 || hashes[i] != hashes[i - 1];
+        }
+    }
+    free(hashes);
+
+    stats->num_bounds = num_rows > 0 ? STATS_HISTOGRAM_BUCKETS + 1 : 0;
+    for(int i = 0; i < stats->num_bounds; i++)
+    {
+        int row = (long long)i * (num_rows - 1) / STATS_HISTOGRAM_BUCKETS;
+        row_key(format, rows + row * ROW_SIZE, stats->bounds[i]);
     }
+    free(rows);
 }
 
-void print_tree(Pager* pager, int page_num, int indentation_level)
+ExecuteResult execute_analyze(Statement* statement, Database* db)
 {
-    void* node = get_page(pager, page_num);
-    int num_keys, child;
-
-    switch(get_node_type(node))
+    if(statement->table_name[0] == '\0')
     {
-    case(NODE_LEAF):
-        num_keys = *leaf_node_num_cells(node);
-        indent(indentation_level);
-
-        printf("- leaf (size %d)\n", num_keys);
-        for(int i = 0; i < num_keys; i++)
+        for(int i = 0; i < db->num_tables; i++)
         {
-            indent(indentation_level + 1);
-            printf("- %d\n", leaf_node_key(node, i));
+            table_analyze(db->tables[i]);
         }
-        break;
-
-    case(NODE_INTERNAL):
-        num_keys = *internal_node_num_keys(node);
-        indent(indentation_level);
+        return EXECUTE_SUCCESS;
+    }
 
-        printf("- internal (size %d)\n", num_keys);
+    Table* table = db_find_table(db, statement->table_name);
+    if(table == NULL)
+    {
+        return EXECUTE_NO_SUCH_TABLE;
+    }
+    table_analyze(table);
 
-        for(int i = 0; i < num_keys; i++)
-        {
-            child = *internal_node_child(node, i);
-            print_tree(pager, child, indentation_level + 1);
+    return EXECUTE_SUCCESS;
+}
 
-            indent(indentation_level + 1);
-            printf("- %d\n", *internal_node_key(node, i));
-        }
-        child = *internal_node_right_child(node);
-        print_tree(pager, child, indentation_level + 1);
-        break;
+ExecuteResult execute_explain(Statement* statement, Database* db)
+{
+    static const char* methods[NUM_ACCESS_METHODS] = {
+        [ACCESS_FULL_SCAN] = "full scan",
+        [ACCESS_KEY_RANGE] = "key range",
+        [ACCESS_KEY_LOOKUP] = "key lookup"};
+    static const char* opcodes[NUM_OPCODES] = {
+        [OP_REWIND] = "Rewind",         [OP_SEEK_GE] = "SeekGE",
+        [OP_KEY_LOOKUP] = "KeyLookup",  [OP_AT_LIMIT] = "AtLimit",
+        [OP_PAST_UPPER] = "PastUpper",  [OP_COLUMN] = "Column",
+        [OP_EQ] = "Eq",                 [OP_NE] = "Ne",
+        [OP_LT] = "Lt",                 [OP_LE] = "Le",
+        [OP_GT] = "Gt",                 [OP_GE] = "Ge",
+        [OP_NATIVE_FILTER] = "NativeFilter",
+        [OP_RESULT_ROW] = "ResultRow",  [OP_NEXT] = "Next",
+        [OP_CLOSE] = "Close",           [OP_HALT] = "Halt"};
+
+    Table* table = db_find_table(db, statement->table_name);
+    if(table == NULL)
+    {
+        return EXECUTE_NO_SUCH_TABLE;
+    }
+
+    AccessPath path;
+    access_path_choose(table, statement, &path);
+    printf("%s of %s, about %.0f rows, cost %.1f pages%s\n",
+           methods[path.method], table->name, path.num_rows, path.cost,
+           table->stats.analyzed ? "" : " (not analyzed)");
+
+    Program program;
+    program_compile(table, statement, &path, &program);
+    for(int i = 0; i < program.num_instructions; i++)
+    {
+        Instruction* instruction = &program.instructions[i];
+        printf("%3d %-11s %d %d %d\n", i, opcodes[instruction->opcode],
+               instruction->p1, instruction->p2, instruction->p3);
     }
+
+    return EXECUTE_SUCCESS;
 }
 
-MetaCommandResult do_meta_command(InputBuffer* input_buffer, Table* table)
+ExecuteResult execute_select(Statement* statement, Database* db)
 {
-    if(strcmp(input_buffer->buffer, ".exit") == 0)
+    Table* table = db_find_table(db, statement->table_name);
+    if(table == NULL)
     {
-        db_close(table);
-        exit(EXIT_SUCCESS);
+        return EXECUTE_NO_SUCH_TABLE;
     }
-    else if(strcmp(input_buffer->buffer, ".btree") == 0)
+
+    CachedResult* result = statement->text[0] != '\0'
+                               ? result_cache_find(db, table, statement->text)
+                               : NULL;
+    char* rows = result != NULL ? result->rows : NULL;
+    int num_rows = result != NULL ? result->num_rows
+                                  : table_select_rows(table, statement, &rows);
+
+    for(int i = 0; i < num_rows; i++)
     {
-        printf("Tree:\n");
-        print_tree(table->pager, 0, 0);
-        return META_COMMAND_SUCCESS;
+        if(db->is_shard)
+        {
+            row_print_key(&table->format, rows + i * ROW_SIZE);
+        }
+        row_print_projection(&table->format, rows + i * ROW_SIZE,
+                             statement->num_projections,
+                             statement->projections);
     }
-    else if(strcmp(input_buffer->buffer, ".constants") == 0)
+
+    if(result != NULL)
     {
-        printf("Constants:\n");
-        print_constants();
-        return META_COMMAND_SUCCESS;
+        return EXECUTE_SUCCESS;
+    }
+    // keep the rows for the next time, unless there are too many
+    if(statement->text[0] != '\0' && num_rows <= RESULT_CACHE_MAX_ROWS)
+    {
+        result_cache_put(db, table, statement->text, rows, num_rows);
     }
     else
     {
-        return META_COMMAND_UNRECOGNIZED_COMMAND;
+        free(rows);
     }
+
+    return EXECUTE_SUCCESS;
 }
 
-PrepareResult prepare_statement(InputBuffer* input_buffer, Statement* statement)
+/**
+ * rewrite the rows that match with their new values. like inserts, the
+ * new rows of a B-tree table travel down as messages
+ */
+ExecuteResult execute_update(Statement* statement, Database* db)
 {
-    if(strncmp(input_buffer->buffer, "insert", 6) == 0)
+    Table* table = db_find_table(db, statement->table_name);
+    if(table == NULL)
     {
-        statement->type = STATEMENT_INSERT;
-
-        int args_assigned = sscanf(input_buffer->buffer, "insert %d %s %s",
-                                   &(statement->row_to_insert.id),
-                                   statement->row_to_insert.username,
-                                   statement->row_to_insert.email);
+        return EXECUTE_NO_SUCH_TABLE;
+    }
+    if(table->pager->wal->read_only)
+    {
+        return EXECUTE_READ_ONLY;
+    }
 
-        if(args_assigned < 3)
+    RowFormat* format = &table->format;
+    char* rows;
+    int num_rows = table_select_rows(table, statement, &rows);
+    char* message = malloc(table->engine == TABLE_ENGINE_LSM ? LSM_ENTRY_SIZE
+                                                             : MESSAGE_SIZE);
+    ExecuteResult result = EXECUTE_SUCCESS;
+    for(int i = 0; i < num_rows; i++)
+    {
+        char* row = rows + i * ROW_SIZE;
+        for(int j = 0; j < statement->num_assignments; j++)
         {
-            return PREPARE_SYNTAX_ERROR;
+            int column = statement->assignments[j];
+            memcpy(row + format->offsets[column],
+                   statement->row_to_insert + format->offsets[column],
+                   row_column_size(format, column));
         }
+        uint8_t key[KEY_SIZE];
+        row_key(format, row, key);
 
-        return PREPARE_SUCCESS;
+        int lsn;
+        if(table->engine == TABLE_ENGINE_LSM)
+        {
+            memcpy(lsm_entry_key(message), key, KEY_SIZE);
+            *lsm_entry_flags(message) = 0;
+            memcpy(lsm_entry_value(message), row, ROW_SIZE);
+            lsn = lsm_put(table->lsm, message);
+        }
+        else
+        {
+            Table* partition = table_partition(table, key);
+            if(!tree_has_room(partition, 0))
+            {
+                result = EXECUTE_TABLE_FULL;
+                break;
+            }
+            memcpy(message_key(message), key, KEY_SIZE);
+            memcpy(message_value(message), row, ROW_SIZE);
+            tree_insert_message(partition, message, tree_height(partition));
+            lsn = partition->pager->lsn;
+        }
+        cdc_emit(db->cdc, lsn, table->id, CDC_UPDATE, key, row,
+                 format->row_size);
     }
-    if(strcmp(input_buffer->buffer, "select") == 0)
+
+    // the rows updated before a full table stay updated
+    for(int i = 0; i < table->num_partitions; i++)
     {
-        statement->type = STATEMENT_SELECT;
-        return PREPARE_SUCCESS;
+        wal_commit(table->partitions[i]->pager);
     }
+    wal_commit(table->pager);
+    table->version++;
+    cdc_flush(db->cdc);
 
-    return PREPARE_UNRECOGNIZED_STATEMENT;
+    free(message);
+    free(rows);
+    return result;
 }
 
-PrepareResult prepare_insert(InputBuffer* input_buffer, Statement* statement)
+/**
+ * only LSM tables can lose rows, as tombstones. B-tree leaves are never
+ * merged, so there is no delete for them
+ */
+ExecuteResult execute_delete(Statement* statement, Database* db)
 {
-    statement->type = STATEMENT_INSERT;
-
-    char* keyword = strtok(input_buffer->buffer, " ");
-    char* id_string = strtok(NULL, " ");
-    char* username = strtok(NULL, " ");
-    char* email = strtok(NULL, " ");
-
-    if(id_string == NULL || username == NULL || email == NULL)
+    Table* table = db_find_table(db, statement->table_name);
+    if(table == NULL)
     {
-        return PREPARE_SYNTAX_ERROR;
+        return EXECUTE_NO_SUCH_TABLE;
     }
-
-    int id = atoi(id_string);
-    if(id < 0)
+    if(table->pager->wal->read_only)
     {
-        return PREPARE_NEGATIVE_ID;
+        return EXECUTE_READ_ONLY;
     }
-    if(strlen(username) > COLUMN_USERNAME_SIZE)
+    if(table->engine != TABLE_ENGINE_LSM)
     {
-        return PREPARE_STRING_TOO_LONG;
+        return EXECUTE_UNSUPPORTED;
     }
-    if(strlen(email) > COLUMN_EMAIL_SIZE)
+
+    char* rows;
+    int num_rows = table_select_rows(table, statement, &rows);
+    char* entry = calloc(1, LSM_ENTRY_SIZE);
+    for(int i = 0; i < num_rows; i++)
     {
-        return PREPARE_STRING_TOO_LONG;
+        row_key(&table->format, rows + i * ROW_SIZE, lsm_entry_key(entry));
+        *lsm_entry_flags(entry) = LSM_TOMBSTONE;
+        int sequence = lsm_put(table->lsm, entry);
+        cdc_emit(db->cdc, sequence, table->id, CDC_DELETE,
+                 lsm_entry_key(entry), lsm_entry_value(entry), 0);
     }
+    table->version++;
+    table->stats.num_rows -= num_rows;
+    cdc_flush(db->cdc);
 
-    statement->row_to_insert.id = id;
-
-    strcpy(statement->row_to_insert.username, username);
-    strcpy(statement->row_to_insert.email, email);
-
-    return PREPARE_SUCCESS;
-}
-
-void print_row(Row* row)
-{
-    printf("(%d, %s, %s)\n", row->id, row->username, row->email);
+    free(entry);
+    free(rows);
+    return EXECUTE_SUCCESS;
 }
 
-int get_unused_page_num(Pager* pager)
+/**
+ * a replica serves statements from everything the primary has committed
+ * so far. this runs before a statement is prepared, which needs the
+ * current catalog
+ */
+void db_catch_up(Database* db)
 {
-    return pager->num_pages;
+    if(db->pager->wal->read_only)
+    {
+        int applied_lsn = db->pager->wal->applied_lsn;
+        wal_apply(db->pager);
+        if(db->pager->wal->applied_lsn != applied_lsn)
+        {
+            db_load_catalog(db);
+        }
+    }
 }
 
-void create_new_node(Table* table, int right_child_page_num)
+ExecuteResult execute_statement(Statement* statement, Database* db)
 {
-    /**
-     * handle splitting the root
-     * old root copied to new page. becomes left child
-     * address of right child passed in
-     * re-initialize root page to contain new root node
-     * new root node points to two children
-     */
-
-    void* root = get_page(table->pager, table->root_page_num);
+    if(statement->explain)
+    {
+        return execute_explain(statement, db);
+    }
 
-    int left_child_page_num = get_unused_page_num(table->pager);
+    switch(statement->type)
+    {
+    case(STATEMENT_INSERT):
+        return execute_insert(statement, db);
+    case(STATEMENT_SELECT):
+        return execute_select(statement, db);
+    case(STATEMENT_UPDATE):
+        return execute_update(statement, db);
+    case(STATEMENT_DELETE):
+        return execute_delete(statement, db);
+    case(STATEMENT_CREATE_TABLE):
+        return db_create_table(db, statement->table_name, statement->engine,
+                               &statement->schema, statement->num_partitions,
+                               statement->partition_bounds);
+    case(STATEMENT_DROP_TABLE):
+        return db_drop_table(db, statement->table_name);
+    case(STATEMENT_ANALYZE):
+        return execute_analyze(statement, db);
+    }
 
-    void* right_child = get_page(table->pager, right_child_page_num);
-    void* left_child = get_page(table->pager, left_child_page_num);
+    return EXECUTE_UNSUPPORTED;
 }
 
-void create_new_root(Table* table, int right_child_page_num)
+/**
+ * print the answers to the inserts in flight in the order they were
+ * sent, each followed by the prompt the REPL held back for it
+ */
+void router_drain(Router* router)
 {
-    /**
-     * handle splitting the root.
-     * old root copied to new page, becomes left child.
-     * address of right child passed in.
-     * re-initialize root page to contain the new root node.
-     * new root node points to two children.
-     */
-    void* root = get_page(table->pager, table->root_page_num);
-
-    int left_child_page_num = get_unused_page_num(table->pager);
-
-    void* right_child = get_page(table->pager, right_child_page_num);
-    void* left_child = get_page(table->pager, left_child_page_num);
+    if(router == NULL)
+    {
+        return;
+    }
 
-    memcpy(left_child, root, PAGE_SIZE);
-    set_node_root(left_child, false);
+    for(int i = 0; i < router->num_in_flight; i++)
+    {
+        char* response = router_read_response(router, router->in_flight[i]);
+        printf("%s", response);
+        free(response);
+        print_prompt();
+    }
+    router->num_in_flight = 0;
 }
 
-void leaf_node_split_and_insert(Cursor* cursor, int key, Row* value)
+/**
+ * next row line of a shard's select output, NULL after the last one. a
+ * shard prints the row's key in hex before the row, which sorts like the
+ * key itself. the lines are cut out of the response in place
+ */
+char* router_next_row(char** position)
 {
-    /**
-     * create a new node and move half the cells over
-     * insert the new value in one of the two nodes
-     * update parent or create a new parent
-     */
-    int new_num_page = get_unused_page_num(cursor->table->pager);
-
-    void* new_node = get_page(cursor->table->pager, new_num_page);
-    void* old_node = get_page(cursor->table->pager, cursor->page_num);
+    char* line = *position;
+    for(int i = 0; i < 2 * KEY_SIZE; i++)
+    {
+        if(!isxdigit((unsigned char)line[i]))
+        {
+            return NULL;
+        }
+    }
+    if(line[2 * KEY_SIZE] != ' ')
+    {
+        return NULL;
+    }
 
-    initialize_leaf_node(new_node);
+    char* end = strchr(line, '\n');
+    *end = '\0';
+    *position = end + 1;
+    return line;
+}
 
-    for(int i = LEAF_NODE_MAX_CELLS; i >= 0; i--)
+/**
+ * every shard returns its rows in key order; merge them into one ordered
+ * result
+ */
+void router_merge_rows(Router* router, char** responses)
+{
+    char* positions[MAX_SHARDS];
+    char* rows[MAX_SHARDS];
+    for(int i = 0; i < router->num_shards; i++)
     {
-        void* destination_node;
+        positions[i] = responses[i];
+        rows[i] = router_next_row(&positions[i]);
+    }
 
-        if(i >= LEAF_NODE_LEFT_SPLIT_COUNT)
+    while(true)
+    {
+        int next = -1;
+        for(int i = 0; i < router->num_shards; i++)
         {
-            destination_node = new_node;
+            if(rows[i] != NULL &&
+               (next == -1 || memcmp(rows[i], rows[next], 2 * KEY_SIZE) < 0))
+            {
+                next = i;
+            }
         }
-        else
+        if(next == -1)
         {
-            destination_node = old_node;
+            return;
         }
 
-        int index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-        void* destination = leaf_node_cell(destination_node, index_within_node);
+        printf("%s\n", rows[next] + 2 * KEY_SIZE + 1);
+        rows[next] = router_next_row(&positions[next]);
+    }
+}
 
-        if(i == cursor->cell_num)
-        {
-            serialize_row(value, destination);
-        }
-        else if(i > cursor->cell_num)
+/**
+ * a statement that failed on some shard answers with that shard's error
+ */
+char* router_first_error(Router* router, char** responses)
+{
+    for(int i = 0; i < router->num_shards; i++)
+    {
+        char* last_line = responses[i];
+        for(char* line = responses[i]; *line != '\0';
+            line = strchr(line, '\n') + 1)
         {
-            memcpy(destination, leaf_node_cell(old_node, i - 1),
-                   LEAF_NODE_CELL_SIZE);
+            last_line = line;
         }
-        else
+        if(strcmp(last_line, "Executed\n") != 0)
         {
-            memcpy(destination, leaf_node_cell(old_node, i),
-                   LEAF_NODE_CELL_SIZE);
+            return responses[i];
         }
     }
 
-    /**
-     * update cell count on both leaf nodes
-     */
-    *(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-    *(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    return NULL;
+}
 
-    if(is_node_root(old_node))
+/**
+ * run a prepared statement across the shards. an insert goes to the shard
+ * owning a hash of its key, everything else to all of them. table changes
+ * are made in the router's catalog first.
+ * an insert is left in flight while more input waits: the next ones go
+ * out to their shards meanwhile, so the shards look up their keys and
+ * miss their pages at the same time instead of one after the other
+ */
+ExecuteResult router_execute(Database* db, Statement* statement,
+                             const char* text)
+{
+    Router* router = db->router;
+
+    if(statement->explain)
     {
-        return create_new_node(cursor->table, new_num_page);
+        // every shard would choose for itself
+        return EXECUTE_UNSUPPORTED;
     }
-    else
+    if(statement->type == STATEMENT_INSERT)
     {
-        printf("Need to implement updating parent after split\n");
-        exit(EXIT_FAILURE);
+        int shard = lsm_hash(statement->key) % router->num_shards;
+        for(int i = 0; i < router->num_in_flight; i++)
+        {
+            if(router->in_flight[i] == shard)
+            {
+                router_drain(router);
+                break;
+            }
+        }
+        router_send(router, shard, text);
+        router->in_flight[router->num_in_flight++] = shard;
+        return EXECUTE_FORWARDED;
     }
-}
 
-ExecuteResult execute_insert(Statement* statement, Table* table)
-{
-    void* node = get_page(table->pager, table->root_page_num);
-    int num_cells = (*leaf_node_num_cells(node));
-    if((num_cells >= LEAF_NODE_MAX_CELLS))
+    Table* table = NULL;
+    if(statement->type == STATEMENT_SELECT)
     {
-        return EXECUTE_TABLE_FULL;
+        table = db_find_table(db, statement->table_name);
+        if(table == NULL)
+        {
+            return EXECUTE_NO_SUCH_TABLE;
+        }
+        // the merge puts the rows back in key order only
+        if(statement->order_column != -1 || statement->limit != -1)
+        {
+            return EXECUTE_UNSUPPORTED;
+        }
     }
-
-    Row* row_to_insert = &(statement->row_to_insert);
-    int key_to_insert = row_to_insert->id;
-    Cursor* cursor = table_find(table, key_to_insert);
-
-    if(cursor->cell_num < num_cells)
+    else
     {
-        int key_at_index = *leaf_node_key(node, cursor->cell_num);
-        if(key_at_index == key_to_insert)
+        ExecuteResult result = execute_statement(statement, db);
+        if(result != EXECUTE_SUCCESS)
         {
-            return EXECUTE_DUPLICATE_KEY;
+            return result;
         }
     }
 
-    free(cursor);
-
-    return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_select(Statement* statement, Table* table)
-{
-    Cursor* cursor = table_start(table);
-
-    Row row;
-    while(!(cursor->end_of_table))
+    char** responses = router_broadcast(router, text);
+    char* error = router_first_error(router, responses);
+    if(error != NULL)
     {
-        deserialize_row(cursor_value(cursor), &row);
-        print_row(&row);
-        cursor_advance;
+        printf("%s", error);
+        router_free_responses(router, responses);
+        return EXECUTE_FORWARDED;
     }
-
-    free(cursor);
-
-    return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_statement(Statement* statement, Table* table)
-{
-    switch(statement->type)
+    if(table != NULL)
     {
-    case(STATEMENT_INSERT):
-        return execute_insert(statement, table);
-    case(STATEMENT_SELECT):
-        return execute_select(statement, table);
+        router_merge_rows(router, responses);
     }
+    router_free_responses(router, responses);
+
+    return EXECUTE_SUCCESS;
 }
 
 int main(int argc, char** argv)
@@ -923,15 +8971,138 @@ int main(int argc, char** argv)
         exit(EXIT_FAILURE);
     }
     char* filename = argv[1];
-    Table* table = db_open(filename);
+    char* replica_of = NULL;
+    char* cdc_path = NULL;
+    char* cdc_socket_path = NULL;
+    TableEngine engine = TABLE_ENGINE_BTREE;
+    bool art_index = false;
+    bool jit = false;
+    int num_shards = 0;
+    int cache_pages = TABLE_MAX_PAGES;
+    for(int i = 2; i < argc; i += 2)
+    {
+        if(i + 1 == argc)
+        {
+            printf("Option '%s' needs a value\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+        if(strcmp(argv[i], "--replica-of") == 0)
+        {
+            replica_of = argv[i + 1];
+        }
+        else if(strcmp(argv[i], "--cdc") == 0)
+        {
+            cdc_path = argv[i + 1];
+        }
+        else if(strcmp(argv[i], "--cdc-socket") == 0)
+        {
+            cdc_socket_path = argv[i + 1];
+        }
+        else if(strcmp(argv[i], "--engine") == 0 &&
+                strcmp(argv[i + 1], "btree") == 0)
+        {
+            engine = TABLE_ENGINE_BTREE;
+        }
+        else if(strcmp(argv[i], "--engine") == 0 &&
+                strcmp(argv[i + 1], "lsm") == 0)
+        {
+            engine = TABLE_ENGINE_LSM;
+        }
+        else if(strcmp(argv[i], "--cache-pages") == 0)
+        {
+            cache_pages = atoi(argv[i + 1]);
+            if(cache_pages < 8)
+            {
+                printf("--cache-pages must be at least 8\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(strcmp(argv[i], "--shards") == 0)
+        {
+            num_shards = atoi(argv[i + 1]);
+            if(num_shards < 1 || num_shards > MAX_SHARDS)
+            {
+                printf("--shards must be between 1 and %d\n", MAX_SHARDS);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if(strcmp(argv[i], "--jit") == 0 &&
+                strcmp(argv[i + 1], "on") == 0)
+        {
+            jit = true;
+        }
+        else if(strcmp(argv[i], "--index") == 0 &&
+                strcmp(argv[i + 1], "art") == 0)
+        {
+            art_index = true;
+        }
+        else
+        {
+            printf("Unrecognized option '%s'\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(cdc_socket_path != NULL && cdc_path == NULL)
+    {
+        printf("--cdc-socket requires --cdc\n");
+        exit(EXIT_FAILURE);
+    }
+    if(num_shards > 0 && (replica_of != NULL || cdc_path != NULL))
+    {
+        printf("--shards cannot be combined with --replica-of or --cdc\n");
+        exit(EXIT_FAILURE);
+    }
+    Router* router = NULL;
+    bool is_shard = false;
+    if(num_shards > 0)
+    {
+        router = router_start(num_shards, &filename);
+        is_shard = router == NULL;
+    }
+    Database* db = db_open(filename, replica_of, engine, art_index);
+    db->router = router;
+    db->is_shard = is_shard;
+    db->jit = jit;
+    db_set_cache_pages(db, cache_pages);
+    if(cdc_path != NULL)
+    {
+        db->cdc = cdc_open(cdc_path, cdc_socket_path);
+    }
     InputBuffer* input_buffer = new_input_buffer();
     while(true)
     {
-        print_prompt();
+        // one throttled batch per statement, full speed while idle
+        do
+        {
+            backup_step(db->pager);
+            for(int i = 0; i < db->num_tables; i++)
+            {
+                lsm_compact_step(db->tables[i]->lsm);
+            }
+        } while((db->pager->backup != NULL || db_compaction_pending(db)) &&
+                !input_pending(input_buffer));
+        cdc_serve(db->cdc);
+        db_trim_cache(db);
+
+        if(router == NULL || router->num_in_flight == 0)
+        {
+            print_prompt();
+        }
+        else if(!input_pending(input_buffer))
+        {
+            router_drain(router);
+        }
+        if(is_shard)
+        {
+            // the router waits for the prompt
+            fflush(stdout);
+        }
+        cdc_serve_until_input(db->cdc, input_buffer);
         read_input(input_buffer);
         if(input_buffer->buffer[0] == '.')
         {
-            switch(do_meta_command(input_buffer, table))
+            router_drain(router);
+            switch(do_meta_command(input_buffer, db))
             {
             case(META_COMMAND_SUCCESS):
                 continue;
@@ -940,8 +9111,16 @@ int main(int argc, char** argv)
                 continue;
             }
         }
+        db_catch_up(db);
         Statement statement;
-        switch(prepare_statement(input_buffer, &statement))
+        PrepareResult prepared =
+            prepare_statement(input_buffer, &statement, db);
+        // only an insert can wait behind the answers in flight
+        if(prepared != PREPARE_SUCCESS || statement.type != STATEMENT_INSERT)
+        {
+            router_drain(router);
+        }
+        switch(prepared)
         {
         case(PREPARE_SUCCESS):
             break;
@@ -954,22 +9133,49 @@ int main(int argc, char** argv)
         case(PREPARE_STRING_TOO_LONG):
             printf("Stringis too long\n");
             continue;
+        case(PREPARE_ROW_TOO_WIDE):
+            printf("Row is too wide\n");
+            continue;
+        case(PREPARE_KEY_TOO_WIDE):
+            printf("Primary key is too wide\n");
+            continue;
+        case(PREPARE_NO_SUCH_TABLE):
+            printf("Error: No such table\n");
+            continue;
         case(PREPARE_UNRECOGNIZED_STATEMENT):
             printf("Unrecognized keyword at start of '%s'\n",
                    input_buffer->buffer);
             continue;
         }
-        switch(execute_statement(&statement, table))
+        ExecuteResult result =
+            db->router != NULL
+                ? router_execute(db, &statement, input_buffer->buffer)
+                : execute_statement(&statement, db);
+        switch(result)
         {
         case(EXECUTE_SUCCESS):
             printf("Executed\n");
             break;
+        case(EXECUTE_FORWARDED):
+            break;
         case(EXECUTE_DUPLICATE_KEY):
             printf("Error: Duplicated key\n");
             break;
         case(EXECUTE_TABLE_FULL):
             printf("Error: Table is full\n");
             break;
+        case(EXECUTE_READ_ONLY):
+            printf("Error: Replica is read-only\n");
+            break;
+        case(EXECUTE_NO_SUCH_TABLE):
+            printf("Error: No such table\n");
+            break;
+        case(EXECUTE_TABLE_EXISTS):
+            printf("Error: Table already exists\n");
+            break;
+        case(EXECUTE_UNSUPPORTED):
+            printf("Error: Not supported\n");
+            break;
         }
     }
     return 0;